@@ -0,0 +1,113 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+/*
+ * Connection-accept rate against the number of workers, for each accept mode.
+ *
+ * Client threads storm the server with connections that send nothing: each connects, shuts down its side, and waits
+ * for the server to accept the connection, see the end of it and close it. Only accepting is measured, since no
+ * request is ever parsed or answered.
+ *
+ * Usage: accept [seconds per run (2)] [most workers (number of CPUs, at least 4)] [client threads (8)]
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "bench.h"
+
+#define PORT "18401"
+
+static atomic_bool stop;
+
+static void* storm(void* data)
+{
+    long* count = data;
+    char buf[64];
+    int fd;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        fd = bench_connect(atoi(PORT));
+        if (fd < 0) {
+            continue;
+        }
+        shutdown(fd, SHUT_WR);
+        while (read(fd, buf, sizeof(buf)) > 0) {
+        }
+        close(fd);
+        (*count)++;
+    }
+    return NULL;
+}
+
+/**
+ * Storm a server for the given time.
+ * Returns the number of connections it accepted per second.
+ */
+static double run(struct kitserv_config* config, double seconds, int num_clients)
+{
+    pthread_t threads[num_clients];
+    long counts[num_clients];
+    long total = 0;
+    double start;
+    pid_t server;
+    int i;
+
+    server = bench_server_start(config);
+    atomic_store(&stop, false);
+    start = bench_now_ns();
+    for (i = 0; i < num_clients; i++) {
+        counts[i] = 0;
+        pthread_create(&threads[i], NULL, storm, &counts[i]);
+    }
+    usleep(seconds * 1e6);
+    atomic_store(&stop, true);
+    for (i = 0; i < num_clients; i++) {
+        pthread_join(threads[i], NULL);
+        total += counts[i];
+    }
+    seconds = (bench_now_ns() - start) / 1e9;
+    bench_server_stop(server);
+    return total / seconds;
+}
+
+int main(int argc, char** argv)
+{
+    static const char* mode_names[] = {"thread", "reuseport", "exclusive"};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = argc > 1 ? atof(argv[1]) : 2;
+    int max_workers = argc > 2 ? atoi(argv[2]) : (cpus > 4 ? cpus : 4);
+    int num_clients = argc > 3 ? atoi(argv[3]) : 8;
+    struct kitserv_request_context ctx = {0};
+    struct kitserv_config config = {0};
+    int mode, workers;
+
+    ctx.root = bench_make_root(16);
+    config.port_string = PORT;
+    config.num_slots = 1024;
+    config.bind_ipv4 = true;
+    config.silent_mode = true;
+    config.http_root_context = &ctx;
+
+    printf("%ld CPUs, %d client threads, %.1f s per run\n", cpus, num_clients, seconds);
+    printf("%-8s", "workers");
+    for (mode = 0; mode < 3; mode++) {
+        printf("%14s", mode_names[mode]);
+    }
+    printf("   (accepts/s)\n");
+    for (workers = 1; workers <= max_workers; workers *= 2) {
+        printf("%-8d", workers);
+        config.num_workers = workers;
+        for (mode = 0; mode < 3; mode++) {
+            config.accept_mode = mode;
+            printf("%14.0f", run(&config, seconds, num_clients));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    bench_remove_root(ctx.root);
+    return 0;
+}
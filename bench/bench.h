@@ -0,0 +1,173 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_BENCH_H
+#define KITSERV_BENCH_H
+
+/*
+ * Helpers shared by the benchmarks (make bench, then run them from bin/bench/).
+ * Servers run in a child process, on the loopback interface, so that they can be stopped and started again with
+ * another configuration.
+ */
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kitserv.h"
+
+/**
+ * Get a monotonic timestamp in nanoseconds.
+ */
+static inline double bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Connect to the server listening on the loopback port, from the given source port (0 to let the kernel pick).
+ * Returns the socket, or -1 on error.
+ */
+static inline int bench_connect_from(int port, int source_port)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int one = 1;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (source_port) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        addr.sin_port = htons(source_port);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+            close(fd);
+            return -1;
+        }
+    }
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline int bench_connect(int port)
+{
+    return bench_connect_from(port, 0);
+}
+
+/**
+ * Close a socket with a reset, so that it leaves nothing in TIME_WAIT behind.
+ */
+static inline void bench_close_reset(int fd)
+{
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+/**
+ * Start a server with the given config in a child process, and wait until it accepts connections.
+ * Returns the child's pid. Exits on failure.
+ */
+static inline pid_t bench_server_start(struct kitserv_config* config)
+{
+    int port = atoi(config->port_string);
+    pid_t pid;
+    int fd, i;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (!pid) {
+        // the server announces the signal that stops it
+        if (!freopen("/dev/null", "w", stdout)) {
+            _exit(1);
+        }
+        kitserv_server_start(config);
+        _exit(0);
+    }
+    for (i = 0; i < 500; i++) {
+        fd = bench_connect(port);
+        if (fd >= 0) {
+            close(fd);
+            // every worker's listener must be up before measuring anything
+            usleep(100000);
+            return pid;
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "server did not start on port %d\n", port);
+    kill(pid, SIGKILL);
+    exit(1);
+}
+
+/**
+ * Stop a server started with bench_server_start.
+ */
+static inline void bench_server_stop(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/**
+ * Make a web root holding index.html, with a body of the given size, in a new temporary directory.
+ * Returns the directory (malloc'd). Exits on failure.
+ */
+static inline char* bench_make_root(size_t body_size)
+{
+    char* root = strdup("/tmp/kitserv-bench-XXXXXX");
+    char path[64];
+    char* body;
+    FILE* file;
+
+    if (!root || !mkdtemp(root)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    snprintf(path, sizeof(path), "%s/index.html", root);
+    file = fopen(path, "w");
+    body = malloc(body_size);
+    if (!file || !body) {
+        perror(path);
+        exit(1);
+    }
+    memset(body, 'x', body_size);
+    fwrite(body, 1, body_size, file);
+    fclose(file);
+    free(body);
+    return root;
+}
+
+/**
+ * Remove a web root made with bench_make_root.
+ */
+static inline void bench_remove_root(char* root)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "%s/index.html", root);
+    unlink(path);
+    rmdir(root);
+    free(root);
+}
+
+#endif
@@ -0,0 +1,186 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+/*
+ * HTTP date formatting and parsing, against libc.
+ *
+ * First checks that kitserv_httpdate_format agrees with gmtime_r + strftime, and kitserv_httpdate_parse with
+ * strptime + timegm, on random times between 1970 and 9999 (and on the edges of that range, and leap days), that
+ * times outside of it are clamped, and that malformed dates are rejected. Exits with 1 if anything disagrees, before
+ * timing anything. Then times each of them against the libc calls they replaced.
+ *
+ * Usage: httpdate [samples to check (2000000)] [calls to time (5000000)]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "httpdate.h"
+
+#define HTTPDATE_FORMAT "%a, %d %b %Y %T GMT"
+#define LAST_TIME ((time_t)253402300799)  // Fri, 31 Dec 9999 23:59:59 GMT
+#define MAX_REPORTED (5)
+
+static const time_t edge_times[] = {
+    0,
+    59,
+    86399,
+    951782400,   // Tue, 29 Feb 2000 00:00:00 GMT
+    4107542399,  // Sun, 28 Feb 2100 23:59:59 GMT (not a leap year)
+    4107542400,  // Mon, 01 Mar 2100 00:00:00 GMT
+    LAST_TIME,
+};
+
+static const char* const malformed[] = {
+    "",
+    "Sun, 06 Nov 1994 08:49:37 GM",
+    "Sun, 06 Nov 1994 8:49:37 GMT",
+    "Sun, 6 Nov 1994 08:49:37 GMT",
+    "Xyz, 06 Nov 1994 08:49:37 GMT",
+    "Sun, 06 Nox 1994 08:49:37 GMT",
+    "Sun, 00 Nov 1994 08:49:37 GMT",
+    "Sun, 32 Nov 1994 08:49:37 GMT",
+    "Sun, 06 Nov 1994 24:49:37 GMT",
+    "Sun, 06 Nov 1994 08:60:37 GMT",
+    "Sun, 06 Nov 19x4 08:49:37 GMT",
+    "Sun, 06 Nov 1994 08:49:37 UTC",
+    "Sunday, 06-Nov-94 08:49:37 GMT",  // RFC 850
+    "Sun Nov  6 08:49:37 1994",        // asctime
+};
+
+static int mismatches;
+
+static void mismatch(const char* what, long long time, const char* expected, const char* got)
+{
+    if (mismatches++ < MAX_REPORTED) {
+        printf("%s %lld: expected \"%s\", got \"%s\"\n", what, time, expected, got);
+    }
+}
+
+/**
+ * Check both functions against libc on one time.
+ */
+static void check_time(time_t time)
+{
+    char expected[64], got[HTTPDATE_LEN + 1];
+    time_t parsed, libc_parsed;
+    struct tm tm;
+
+    if (!gmtime_r(&time, &tm) || !strftime(expected, sizeof(expected), HTTPDATE_FORMAT, &tm)) {
+        mismatch("libc cannot format", time, "", "");
+        return;
+    }
+    kitserv_httpdate_format(got, time);
+    got[HTTPDATE_LEN] = '\0';
+    if (strcmp(expected, got)) {
+        mismatch("format", time, expected, got);
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    if (!strptime(expected, HTTPDATE_FORMAT, &tm)) {
+        mismatch("libc cannot parse", time, expected, "");
+        return;
+    }
+    libc_parsed = timegm(&tm);
+    if (kitserv_httpdate_parse(expected, &parsed) || parsed != time || parsed != libc_parsed) {
+        snprintf(got, sizeof(got), "%lld", (long long)parsed);
+        mismatch("parse", time, expected, got);
+    }
+}
+
+/**
+ * Check that times outside of 1970 to 9999 are clamped to them.
+ */
+static void check_clamped(time_t time, time_t clamped)
+{
+    char expected[HTTPDATE_LEN + 1], got[HTTPDATE_LEN + 1];
+
+    kitserv_httpdate_format(expected, clamped);
+    kitserv_httpdate_format(got, time);
+    expected[HTTPDATE_LEN] = got[HTTPDATE_LEN] = '\0';
+    if (strcmp(expected, got)) {
+        mismatch("clamp", time, expected, got);
+    }
+}
+
+static uint64_t next_random(uint64_t* state)
+{
+    // xorshift64*, so that every run checks the same times on every libc
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+int main(int argc, char** argv)
+{
+    static const char date[] = "Tue, 14 Nov 2023 22:13:20 GMT";
+    long samples = argc > 1 ? atol(argv[1]) : 2000000;
+    long calls = argc > 2 ? atol(argv[2]) : 5000000;
+    volatile unsigned long sink = 0;
+    uint64_t state = 1;
+    char buf[64];
+    struct tm tm;
+    double start;
+    time_t time;
+    size_t i;
+    long n;
+
+    if (calls < 1) {
+        fprintf(stderr, "at least one call to time\n");
+        return 1;
+    }
+    for (i = 0; i < sizeof(edge_times) / sizeof(edge_times[0]); i++) {
+        check_time(edge_times[i]);
+    }
+    for (n = 0; n < samples; n++) {
+        check_time(next_random(&state) % (LAST_TIME + 1));
+    }
+    check_clamped(-1, 0);
+    check_clamped(LAST_TIME + 1, LAST_TIME);
+    for (i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        if (!kitserv_httpdate_parse(malformed[i], &time)) {
+            mismatch("parse accepted", i, "an error", malformed[i]);
+        }
+    }
+    printf("checked %ld random times and %zu malformed dates against libc: %d mismatches\n", samples,
+           sizeof(malformed) / sizeof(malformed[0]), mismatches);
+    if (mismatches) {
+        return 1;
+    }
+
+    time = 1700000000;
+    start = bench_now_ns();
+    for (n = 0; n < calls; n++) {
+        time_t t = time + n;
+        gmtime_r(&t, &tm);
+        strftime(buf, sizeof(buf), HTTPDATE_FORMAT, &tm);
+        sink += buf[6];
+    }
+    printf("%-32s %7.1f ns\n", "format: gmtime_r + strftime", (bench_now_ns() - start) / calls);
+    start = bench_now_ns();
+    for (n = 0; n < calls; n++) {
+        kitserv_httpdate_format(buf, time + n);
+        sink += buf[6];
+    }
+    printf("%-32s %7.1f ns\n", "format: kitserv_httpdate_format", (bench_now_ns() - start) / calls);
+    start = bench_now_ns();
+    for (n = 0; n < calls; n++) {
+        memset(&tm, 0, sizeof(tm));
+        strptime(date, HTTPDATE_FORMAT, &tm);
+        sink += timegm(&tm);
+    }
+    printf("%-32s %7.1f ns\n", "parse: strptime + timegm", (bench_now_ns() - start) / calls);
+    start = bench_now_ns();
+    for (n = 0; n < calls; n++) {
+        kitserv_httpdate_parse(date, &time);
+        sink += time;
+    }
+    printf("%-32s %7.1f ns\n", "parse: kitserv_httpdate_parse", (bench_now_ns() - start) / calls);
+    return 0;
+}
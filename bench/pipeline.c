@@ -0,0 +1,290 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+/*
+ * Requests per second per core, on pipelined GETs of a small static file.
+ *
+ * A single worker serves connections that each send batches of pipelined requests. Performance counters are
+ * attached to every thread of the server, so that requests can be counted against the CPU time the server itself
+ * spent (task-clock), and, where the hardware counters are available, against its cycles, instructions and cache
+ * misses.
+ *
+ * Usage: pipeline [seconds (3)] [connections (16)] [requests per batch (32)]
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "bench.h"
+
+#define PORT "18403"
+#define MAX_THREADS (64)
+#define MAX_CONNECTIONS (256)
+
+static const char request[] = "GET /index.html HTTP/1.1\r\nHost: bench\r\nUser-Agent: kitserv-bench\r\n\r\n";
+
+enum counter {
+    COUNTER_TASK_CLOCK = 0,  // ns
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    NUM_COUNTERS,
+};
+
+static const struct {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} counter_defs[NUM_COUNTERS] = {
+    {"task-clock (ns)", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+/**
+ * Counters of every thread of a process, -1 where one couldn't be opened.
+ */
+struct counters {
+    int fds[MAX_THREADS][NUM_COUNTERS];
+    int num_threads;
+};
+
+/**
+ * Open a disabled counter on a thread, counting kernel time too if allowed.
+ * Returns its fd, or -1 on error.
+ */
+static int open_counter(pid_t tid, enum counter counter)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter_defs[counter].type;
+    attr.config = counter_defs[counter].config;
+    attr.disabled = 1;
+    fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+    if (fd < 0) {
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+    }
+    return fd;
+}
+
+/**
+ * Attach counters to every thread of a running process.
+ */
+static void counters_open(struct counters* counters, pid_t pid)
+{
+    char path[64];
+    struct dirent* task;
+    DIR* dir;
+    int i;
+
+    counters->num_threads = 0;
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        exit(1);
+    }
+    while ((task = readdir(dir)) && counters->num_threads < MAX_THREADS) {
+        if (task->d_name[0] == '.') {
+            continue;
+        }
+        for (i = 0; i < NUM_COUNTERS; i++) {
+            counters->fds[counters->num_threads][i] = open_counter(atoi(task->d_name), i);
+        }
+        counters->num_threads++;
+    }
+    closedir(dir);
+}
+
+static void counters_toggle(struct counters* counters, bool enable)
+{
+    int t, i;
+
+    for (t = 0; t < counters->num_threads; t++) {
+        for (i = 0; i < NUM_COUNTERS; i++) {
+            if (counters->fds[t][i] >= 0) {
+                ioctl(counters->fds[t][i], enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+    }
+}
+
+/**
+ * Sum a counter over every thread, and close it.
+ * Returns the sum, or -1 if it couldn't be opened.
+ */
+static double counters_collect(struct counters* counters, enum counter counter)
+{
+    double sum = -1;
+    uint64_t value;
+    int t, fd;
+
+    for (t = 0; t < counters->num_threads; t++) {
+        fd = counters->fds[t][counter];
+        if (fd < 0) {
+            continue;
+        }
+        if (read(fd, &value, sizeof(value)) == sizeof(value)) {
+            sum = (sum < 0 ? 0 : sum) + value;
+        }
+        close(fd);
+    }
+    return sum;
+}
+
+/**
+ * Read exactly len bytes from a socket.
+ * Returns 0 on success, -1 on error.
+ */
+static int read_exactly(int fd, char* buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, buf, len);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Send a single request, to find out how long each response is.
+ * Returns the length, or -1 on error.
+ */
+static int measure_response(int fd)
+{
+    char buf[4096];
+    char *end, *length;
+    int len = 0;
+    int n;
+
+    if (write(fd, request, sizeof(request) - 1) != sizeof(request) - 1) {
+        return -1;
+    }
+    buf[0] = '\0';
+    while (!(end = strstr(buf, "\r\n\r\n")) || !(length = strcasestr(buf, "content-length:")) ||
+           len < end + 4 - buf + atoi(length + 15)) {
+        n = read(fd, &buf[len], sizeof(buf) - 1 - len);
+        if (n <= 0) {
+            return -1;
+        }
+        len += n;
+        buf[len] = '\0';
+    }
+    if (strncmp(buf, "HTTP/1.1 200", 12)) {
+        fprintf(stderr, "unexpected response: %.*s\n", (int)(strchr(buf, '\r') - buf), buf);
+        return -1;
+    }
+    return len;
+}
+
+int main(int argc, char** argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 3;
+    int num_connections = argc > 2 ? atoi(argv[2]) : 16;
+    int batch = argc > 3 ? atoi(argv[3]) : 32;
+    static int fds[MAX_CONNECTIONS];
+    static struct counters counters;
+    struct kitserv_request_context ctx = {0};
+    struct kitserv_config config = {0};
+    char *batch_buf, *response_buf;
+    double values[NUM_COUNTERS];
+    double start, elapsed;
+    long requests = 0;
+    int response_len = -1;
+    pid_t server;
+    int i, c;
+
+    if (num_connections < 1 || num_connections > MAX_CONNECTIONS || batch < 1) {
+        fprintf(stderr, "1 to %d connections, and at least one request per batch\n", MAX_CONNECTIONS);
+        return 1;
+    }
+    ctx.root = bench_make_root(64);
+    config.port_string = PORT;
+    config.num_workers = 1;
+    config.num_slots = MAX_CONNECTIONS;
+    config.bind_ipv4 = true;
+    config.silent_mode = true;
+    config.http_root_context = &ctx;
+    server = bench_server_start(&config);
+
+    for (c = 0; c < num_connections; c++) {
+        fds[c] = bench_connect(atoi(PORT));
+        if (fds[c] < 0 || (response_len = measure_response(fds[c])) < 0) {
+            fprintf(stderr, "could not get a first response\n");
+            bench_server_stop(server);
+            return 1;
+        }
+    }
+    batch_buf = malloc((sizeof(request) - 1) * batch);
+    response_buf = malloc((size_t)response_len * batch);
+    if (!batch_buf || !response_buf) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < batch; i++) {
+        memcpy(&batch_buf[(sizeof(request) - 1) * i], request, sizeof(request) - 1);
+    }
+
+    counters_open(&counters, server);
+    counters_toggle(&counters, true);
+    start = bench_now_ns();
+    do {
+        for (c = 0; c < num_connections; c++) {
+            if (write(fds[c], batch_buf, (sizeof(request) - 1) * batch) != (ssize_t)(sizeof(request) - 1) * batch) {
+                perror("write");
+                return 1;
+            }
+        }
+        for (c = 0; c < num_connections; c++) {
+            if (read_exactly(fds[c], response_buf, (size_t)response_len * batch)) {
+                fprintf(stderr, "connection closed early\n");
+                return 1;
+            }
+        }
+        requests += (long)num_connections * batch;
+        elapsed = (bench_now_ns() - start) / 1e9;
+    } while (elapsed < seconds);
+    counters_toggle(&counters, false);
+    for (i = 0; i < NUM_COUNTERS; i++) {
+        values[i] = counters_collect(&counters, i);
+    }
+
+    for (c = 0; c < num_connections; c++) {
+        close(fds[c]);
+    }
+    bench_server_stop(server);
+    bench_remove_root(ctx.root);
+
+    printf("%d connections, %d pipelined requests per batch, %d-byte responses, %.1f s\n", num_connections, batch,
+           response_len, elapsed);
+    printf("%-26s %12.0f\n", "requests/s (wall clock)", requests / elapsed);
+    if (values[COUNTER_TASK_CLOCK] > 0) {
+        printf("%-26s %12.0f\n", "requests/s per core", requests / (values[COUNTER_TASK_CLOCK] / 1e9));
+    }
+    for (i = 0; i < NUM_COUNTERS; i++) {
+        if (values[i] < 0) {
+            printf("%-26s %12s\n", counter_defs[i].name, "unavailable");
+        } else {
+            printf("%-26s %12.1f per request\n", counter_defs[i].name, values[i] / requests);
+        }
+    }
+    free(batch_buf);
+    free(response_buf);
+    return 0;
+}
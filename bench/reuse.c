@@ -0,0 +1,131 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+/*
+ * Nothing of a connection may carry over to the next one on its slot.
+ *
+ * Not a benchmark, but a check that needs a running server like the others. Runs one with a single slot, so that
+ * every connection reuses the same one, and follows requests that leave state behind with requests that would trip
+ * over it: an API route answering 405 (which records the methods it does allow), then another route, and a static
+ * file answering 405 (which must allow GET and HEAD, not the route's methods).
+ * Exits with 1 on the first unexpected response. Build the library with `make debug` to check its assertions too.
+ *
+ * Usage: reuse
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+
+#include "bench.h"
+
+#define PORT "18451"
+
+struct exchange {
+    const char* request;
+    int status;
+    const char* allow;  // expected value of the allow header, NULL if there should be none
+};
+
+static void ok(struct kitserv_client* client, void* state)
+{
+    (void)state;
+    kitserv_api_write_body(client, "ok", 2);
+    kitserv_api_set_response_status(client, HTTP_200_OK);
+}
+
+/**
+ * Send a request and read its response.
+ * Returns 0 if the response is as expected, -1 otherwise (having said why).
+ */
+static int check(int fd, const struct exchange* exchange)
+{
+    char buf[4096];
+    char *end, *length, *allow;
+    size_t allow_len;
+    int len = 0;
+    int n, status;
+
+    if (write(fd, exchange->request, strlen(exchange->request)) != (ssize_t)strlen(exchange->request)) {
+        perror("write");
+        return -1;
+    }
+    buf[0] = '\0';
+    while (!(end = strstr(buf, "\r\n\r\n")) || !(length = strcasestr(buf, "content-length:")) ||
+           len < end + 4 - buf + atoi(length + 15)) {
+        n = read(fd, &buf[len], sizeof(buf) - 1 - len);
+        if (n <= 0) {
+            fprintf(stderr, "%.*s: connection closed after %d bytes\n", (int)strcspn(exchange->request, "\r"),
+                    exchange->request, len);
+            return -1;
+        }
+        len += n;
+        buf[len] = '\0';
+    }
+    *end = '\0';
+    allow = strcasestr(buf, "\r\nallow:");
+    if (allow) {
+        for (allow += 8; *allow == ' '; allow++) {
+        }
+        allow_len = strcspn(allow, "\r");
+    }
+    if (sscanf(buf, "HTTP/1.1 %d", &status) != 1 || status != exchange->status || !allow != !exchange->allow ||
+        (allow && (allow_len != strlen(exchange->allow) || strncmp(allow, exchange->allow, allow_len)))) {
+        fprintf(stderr, "%.*s: expected %d (allow: %s), got:\n%s\n", (int)strcspn(exchange->request, "\r"),
+                exchange->request, exchange->status, exchange->allow ? exchange->allow : "none", buf);
+        return -1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    static struct kitserv_api_entry entries[] = {
+        {.prefix = "x", .prefix_length = 1, .method = HTTP_PUT, .handler = ok, .finishes_path = true},
+        {.prefix = "x", .prefix_length = 1, .method = HTTP_POST, .handler = ok, .finishes_path = true},
+        {.prefix = "y", .prefix_length = 1, .method = HTTP_GET, .handler = ok, .finishes_path = true},
+    };
+    static struct kitserv_api_tree tree = {.entries = entries, .num_entries = 3};
+    static const struct exchange exchanges[] = {
+        {"DELETE /x HTTP/1.1\r\nHost: test\r\n\r\n", 405, "PUT, POST"},
+        {"GET /y HTTP/1.1\r\nHost: test\r\n\r\n", 200, NULL},
+        {"DELETE /x HTTP/1.1\r\nHost: test\r\n\r\n", 405, "PUT, POST"},
+        {"PUT /index.html HTTP/1.1\r\nHost: test\r\n\r\n", 405, "GET, HEAD"},
+    };
+    const int num_exchanges = sizeof(exchanges) / sizeof(exchanges[0]);
+    struct kitserv_request_context ctx = {0};
+    struct kitserv_config config = {0};
+    int failed = 0;
+    pid_t server;
+    int fd, i;
+    char c;
+
+    ctx.root = bench_make_root(16);
+    config.port_string = PORT;
+    config.num_workers = 1;
+    config.num_slots = 1;
+    config.bind_ipv4 = true;
+    config.silent_mode = true;
+    config.http_root_context = &ctx;
+    config.api_tree = &tree;
+    server = bench_server_start(&config);
+
+    // a connection each (errors close theirs anyway), waiting for the server to close it so that the next one gets
+    // the same slot
+    for (i = 0; i < num_exchanges && !failed; i++) {
+        fd = bench_connect(atoi(PORT));
+        failed = fd < 0 || check(fd, &exchanges[i]);
+        if (fd >= 0) {
+            shutdown(fd, SHUT_WR);
+            while (read(fd, &c, 1) > 0) {
+            }
+            close(fd);
+            // the slot is returned just after the socket is closed
+            usleep(10000);
+        }
+    }
+
+    bench_server_stop(server);
+    bench_remove_root(ctx.root);
+    printf("reuse: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,257 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+/*
+ * Routing time against the number of API routes.
+ *
+ * Builds api/v1/resourceN/action trees, of ten actions per resource, compiles each with kitserv_router_compile, and
+ * times kitserv_router_match on paths picked at random from them, and on paths that miss (an unknown action, and a
+ * method that isn't allowed). For comparison, the same lookups are made with a scan of the tree one level at a time,
+ * which is how requests were routed before there was a trie. Every route is looked up once beforehand, to check that
+ * both find it.
+ *
+ * Usage: router [lookups per size (2000000)] [sizes (100 1000 10000)...]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "router.h"
+
+#define ACTIONS_PER_RESOURCE (10)
+#define NUM_PICKS (1024)
+
+static const char* const actions[ACTIONS_PER_RESOURCE] = {
+    "list", "get", "create", "update", "delete", "search", "count", "export", "import", "stats",
+};
+
+static void handler(struct kitserv_client* client, void* state)
+{
+    (void)client;
+    (void)state;
+}
+
+/**
+ * Find the entry for a path by scanning each level of the tree in turn, entries before subtrees.
+ * Returns the entry, or NULL if there is none for the method.
+ */
+static const struct kitserv_api_entry* scan_tree(const struct kitserv_api_tree* tree, const char* path, int method)
+{
+    const char* end;
+    int i;
+
+    for (;;) {
+        for (end = path; *end && *end != '/'; end++) {
+        }
+        for (i = 0; i < tree->num_entries; i++) {
+            if (tree->entries[i].prefix_length == end - path &&
+                !strncmp(path, tree->entries[i].prefix, end - path) && (tree->entries[i].method & method)) {
+                return &tree->entries[i];
+            }
+        }
+        for (i = 0; i < tree->num_subtrees; i++) {
+            if (tree->subtrees[i].prefix_length == end - path && !strncmp(path, tree->subtrees[i].prefix, end - path)) {
+                break;
+            }
+        }
+        if (i == tree->num_subtrees || !*end) {
+            return NULL;
+        }
+        tree = &tree->subtrees[i];
+        path = end + 1;
+    }
+}
+
+/**
+ * Build the tree for a number of routes (rounded down to whole resources), with the path of each route.
+ * Returns the root tree. Exits on failure.
+ */
+static struct kitserv_api_tree* build_tree(int num_routes, char*** paths)
+{
+    int num_resources = num_routes / ACTIONS_PER_RESOURCE;
+    struct kitserv_api_tree* levels = calloc(3, sizeof(*levels));
+    struct kitserv_api_tree* resources = calloc(num_resources, sizeof(*resources));
+    struct kitserv_api_entry* entries = calloc((size_t)num_resources * ACTIONS_PER_RESOURCE, sizeof(*entries));
+    char name[32];
+    int r, a;
+
+    *paths = calloc((size_t)num_resources * ACTIONS_PER_RESOURCE, sizeof(**paths));
+    if (!levels || !resources || !entries || !*paths) {
+        perror("calloc");
+        exit(1);
+    }
+    for (r = 0; r < num_resources; r++) {
+        snprintf(name, sizeof(name), "resource%d", r);
+        resources[r].prefix = strdup(name);
+        resources[r].prefix_length = strlen(name);
+        resources[r].entries = &entries[r * ACTIONS_PER_RESOURCE];
+        resources[r].num_entries = ACTIONS_PER_RESOURCE;
+        for (a = 0; a < ACTIONS_PER_RESOURCE; a++) {
+            resources[r].entries[a] = (struct kitserv_api_entry){
+                .prefix = (char*)actions[a],
+                .prefix_length = strlen(actions[a]),
+                .method = HTTP_GET,
+                .handler = handler,
+                .finishes_path = true,
+            };
+            if (asprintf(&(*paths)[r * ACTIONS_PER_RESOURCE + a], "api/v1/%s/%s", name, actions[a]) < 0) {
+                perror("asprintf");
+                exit(1);
+            }
+        }
+    }
+    levels[2] = (struct kitserv_api_tree){.prefix = "v1", .prefix_length = 2, .subtrees = resources,
+                                          .num_subtrees = num_resources};
+    levels[1] = (struct kitserv_api_tree){.prefix = "api", .prefix_length = 3, .subtrees = &levels[2],
+                                          .num_subtrees = 1};
+    levels[0] = (struct kitserv_api_tree){.subtrees = &levels[1], .num_subtrees = 1};
+    return levels;
+}
+
+static void free_tree(struct kitserv_api_tree* root, char** paths)
+{
+    struct kitserv_api_tree* resources = root[2].subtrees;
+    int r;
+
+    for (r = 0; r < root[2].num_subtrees; r++) {
+        free(resources[r].prefix);
+    }
+    for (r = 0; r < root[2].num_subtrees * ACTIONS_PER_RESOURCE; r++) {
+        free(paths[r]);
+    }
+    free(resources[0].entries);
+    free(resources);
+    free(root);
+    free(paths);
+}
+
+static void free_router(router_t* router)
+{
+    free(router->nodes);
+    free(router->first_bytes);
+    free(router->labels);
+    free(router->routes);
+    free(router->params);
+    free(router->names);
+}
+
+/**
+ * Time lookups of the picked paths, with the trie or with the tree scan.
+ * Returns ns per lookup, and the number that found a route in *found.
+ */
+static double time_lookups(const router_t* router, const struct kitserv_api_tree* tree, char** picks, int method,
+                           long lookups, long* found)
+{
+    struct router_capture captures[ROUTER_MAX_PARAMS];
+    double start;
+    int allowed;
+    long i;
+
+    *found = 0;
+    start = bench_now_ns();
+    for (i = 0; i < lookups; i++) {
+        if (router) {
+            *found += !!kitserv_router_match(router, picks[i % NUM_PICKS], picks[i % NUM_PICKS], method, captures,
+                                             &allowed);
+        } else {
+            *found += !!scan_tree(tree, picks[i % NUM_PICKS], method);
+        }
+    }
+    return (bench_now_ns() - start) / lookups;
+}
+
+static int run(int num_routes, long lookups)
+{
+    static char* hits[NUM_PICKS];
+    static char* misses[NUM_PICKS];
+    struct router_capture captures[ROUTER_MAX_PARAMS];
+    struct kitserv_api_tree* tree;
+    unsigned int seed = 1;
+    router_t router;
+    double start, compiled;
+    double trie_hit, trie_miss, trie_405, scan_hit, scan_miss;
+    bool wrong;
+    long found;
+    char** paths;
+    int allowed;
+    int i;
+
+    if (num_routes < ACTIONS_PER_RESOURCE) {
+        fprintf(stderr, "at least %d routes\n", ACTIONS_PER_RESOURCE);
+        return -1;
+    }
+    tree = build_tree(num_routes, &paths);
+    num_routes = tree[2].num_subtrees * ACTIONS_PER_RESOURCE;
+    start = bench_now_ns();
+    if (kitserv_router_compile(&router, tree)) {
+        perror("kitserv_router_compile");
+        return -1;
+    }
+    compiled = bench_now_ns() - start;
+
+    for (i = 0; i < num_routes; i++) {
+        if (!kitserv_router_match(&router, paths[i], paths[i], HTTP_GET, captures, &allowed) ||
+            !scan_tree(tree, paths[i], HTTP_GET)) {
+            fprintf(stderr, "no route for %s\n", paths[i]);
+            return -1;
+        }
+    }
+    for (i = 0; i < NUM_PICKS; i++) {
+        seed = seed * 1103515245 + 12345;
+        hits[i] = paths[(seed >> 8) % num_routes];
+        // same resource, unknown action
+        if (asprintf(&misses[i], "%.*s/archive", (int)(strrchr(hits[i], '/') - hits[i]), hits[i]) < 0) {
+            perror("asprintf");
+            return -1;
+        }
+    }
+
+    trie_hit = time_lookups(&router, NULL, hits, HTTP_GET, lookups, &found);
+    wrong = found != lookups;
+    trie_miss = time_lookups(&router, NULL, misses, HTTP_GET, lookups, &found);
+    wrong |= found != 0;
+    trie_405 = time_lookups(&router, NULL, hits, HTTP_POST, lookups, &found);
+    wrong |= found != 0;
+    // the scan gets slow, and is only there for comparison
+    scan_hit = time_lookups(NULL, tree, hits, HTTP_GET, lookups / 10, &found);
+    wrong |= found != lookups / 10;
+    scan_miss = time_lookups(NULL, tree, misses, HTTP_GET, lookups / 10, &found);
+    wrong |= found != 0;
+    if (wrong) {
+        fprintf(stderr, "lookups found the wrong number of routes\n");
+        return -1;
+    }
+
+    printf("%7d %7d %10.2f %9.1f %9.1f %9.1f %11.1f %11.1f\n", num_routes, router.num_nodes, compiled / 1e6,
+           trie_hit, trie_miss, trie_405, scan_hit, scan_miss);
+    for (i = 0; i < NUM_PICKS; i++) {
+        free(misses[i]);
+    }
+    free_router(&router);
+    free_tree(tree, paths);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    static const int default_sizes[] = {100, 1000, 10000};
+    long lookups = argc > 1 ? atol(argv[1]) : 2000000;
+    int i;
+
+    if (lookups < 10) {
+        fprintf(stderr, "at least 10 lookups\n");
+        return 1;
+    }
+    printf("%7s %7s %10s %9s %9s %9s %11s %11s   (ns per lookup)\n", "routes", "nodes", "compile ms", "hit", "miss",
+           "405", "scan hit", "scan miss");
+    for (i = 0; i < (argc > 2 ? argc - 2 : 3); i++) {
+        if (run(argc > 2 ? atoi(argv[i + 2]) : default_sizes[i], lookups)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,190 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+/*
+ * Rejection rate when connections pile up on one worker.
+ *
+ * Holds keep-alive connections open against a server with a fixed number of slots, and counts how many of them are
+ * turned away with a 503, or closed later on to make room for others (workers that accept for themselves reap idle
+ * connections when they run out of slots). Each connection asks GET /who, which answers with the thread id of the
+ * worker serving it, and asks again once all of them are held to check that it is still open.
+ * In reuseport mode, the kernel picks a worker by hashing the source port, so ports are probed first, and only those
+ * that land on the same worker are used: every held connection is skewed onto it. In the other modes, the server
+ * picks (exclusive: whichever worker the kernel wakes, thread: the accept thread's choice). Holding a quarter more
+ * connections than there are slots checks that the excess really is rejected.
+ *
+ * Usage: skew [workers (4)] [slots (64)]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <sys/syscall.h>
+
+#include "bench.h"
+
+#define PORT "18402"
+#define FIRST_SOURCE_PORT (30000)
+#define MAX_HELD (4096)
+
+static void who(struct kitserv_client* client, void* state)
+{
+    (void)state;
+    kitserv_http_header_add_content_type(client, "text/plain");
+    kitserv_api_write_body_fmt(client, "%ld", (long)syscall(SYS_gettid));
+    kitserv_api_set_response_status(client, HTTP_200_OK);
+}
+
+/**
+ * Ask GET /who on a connection.
+ * Returns the response status, with the thread id of the worker in *tid if it is 200, or -1 on error.
+ */
+static int ask_who(int fd, long* tid)
+{
+    static const char request[] = "GET /who HTTP/1.1\r\nHost: bench\r\n\r\n";
+    char buf[1024];
+    char *end, *length;
+    int len = 0;
+    int n, status;
+
+    if (write(fd, request, sizeof(request) - 1) != sizeof(request) - 1) {
+        return -1;
+    }
+    buf[0] = '\0';
+    // a 503 is followed by the server closing, a 200 by the body
+    while (!(end = strstr(buf, "\r\n\r\n")) || !(length = strcasestr(buf, "content-length:")) ||
+           len < end + 4 - buf + atoi(length + 15)) {
+        n = read(fd, &buf[len], sizeof(buf) - 1 - len);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        buf[len] = '\0';
+    }
+    if (len < 12 || sscanf(buf, "HTTP/1.1 %d", &status) != 1) {
+        return -1;
+    }
+    if (status == 200 && end) {
+        *tid = atol(end + 4);
+    }
+    return status;
+}
+
+/**
+ * Find source ports whose connections land on the same worker, writing count of them to ports.
+ * Returns 0 on success, -1 if not enough were found.
+ */
+static int find_skewed_ports(int port, int* ports, int count)
+{
+    long target = 0;
+    long tid;
+    int found = 0;
+    int source, fd;
+
+    for (source = FIRST_SOURCE_PORT; source < 65536 && found < count; source++) {
+        fd = bench_connect_from(port, source);
+        if (fd < 0) {
+            continue;
+        }
+        if (ask_who(fd, &tid) == 200 && (!target || tid == target)) {
+            target = tid;
+            ports[found++] = source;
+        }
+        bench_close_reset(fd);
+    }
+    // let the server see the resets before anything is held
+    usleep(100000);
+    return found == count ? 0 : -1;
+}
+
+/**
+ * Hold a number of connections open, from the given source ports (or any if NULL).
+ * Writes the number that were rejected, the number that were reaped while held, and the most that any one worker
+ * served to the given pointers.
+ */
+static void hold(int port, const int* ports, int count, int* rejected, int* reaped, int* busiest)
+{
+    static int fds[MAX_HELD];
+    static long tids[MAX_HELD];
+    int served = 0;
+    int i, j, same;
+    long tid;
+
+    *rejected = 0;
+    *reaped = 0;
+    *busiest = 0;
+    for (i = 0; i < count; i++) {
+        fds[i] = bench_connect_from(port, ports ? ports[i] : 0);
+        if (fds[i] < 0 || ask_who(fds[i], &tids[served]) != 200) {
+            (*rejected)++;
+            if (fds[i] >= 0) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+            continue;
+        }
+        same = 1;
+        for (j = 0; j < served; j++) {
+            same += tids[j] == tids[served];
+        }
+        if (same > *busiest) {
+            *busiest = same;
+        }
+        served++;
+    }
+    for (i = 0; i < count; i++) {
+        if (fds[i] >= 0) {
+            *reaped += ask_who(fds[i], &tid) != 200;
+            bench_close_reset(fds[i]);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    static const char* mode_names[] = {"thread", "reuseport", "exclusive"};
+    static int ports[MAX_HELD];
+    static struct kitserv_api_entry entries[] = {
+        {.prefix = "who", .prefix_length = 3, .method = HTTP_GET, .handler = who, .finishes_path = true},
+    };
+    static struct kitserv_api_tree tree = {.entries = entries, .num_entries = 1};
+    int workers = argc > 1 ? atoi(argv[1]) : 4;
+    int slots = argc > 2 ? atoi(argv[2]) : 64;
+    struct kitserv_request_context ctx = {0};
+    struct kitserv_config config = {0};
+    int mode, held, rejected, reaped, busiest;
+    pid_t server;
+
+    if (slots * 2 > MAX_HELD) {
+        fprintf(stderr, "at most %d slots\n", MAX_HELD / 2);
+        return 1;
+    }
+    ctx.root = bench_make_root(16);
+    config.port_string = PORT;
+    config.num_workers = workers;
+    config.num_slots = slots;
+    config.bind_ipv4 = true;
+    config.silent_mode = true;
+    config.http_root_context = &ctx;
+    config.api_tree = &tree;
+
+    printf("%d workers, %d slots\n", workers, slots);
+    printf("%-10s %6s %9s %7s %10s %8s\n", "mode", "held", "rejected", "reaped", "lost", "busiest");
+    for (mode = 0; mode < 3; mode++) {
+        config.accept_mode = mode;
+        for (held = slots / 4; held <= slots + slots / 4; held += slots / 4) {
+            server = bench_server_start(&config);
+            if (mode == KITSERV_ACCEPT_REUSEPORT && find_skewed_ports(atoi(PORT), ports, held)) {
+                fprintf(stderr, "could not find %d source ports landing on one worker\n", held);
+                bench_server_stop(server);
+                return 1;
+            }
+            hold(atoi(PORT), mode == KITSERV_ACCEPT_REUSEPORT ? ports : NULL, held, &rejected, &reaped, &busiest);
+            bench_server_stop(server);
+            printf("%-10s %6d %9d %7d %9.1f%% %8d\n", mode_names[mode], held, rejected, reaped,
+                   100.0 * (rejected + reaped) / held, busiest);
+        }
+    }
+
+    bench_remove_root(ctx.root);
+    return 0;
+}
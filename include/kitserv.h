@@ -23,6 +23,13 @@ struct kitserv_client;  // not defined here - use public functions to interact
  * If no match, the subtrees of the current tree are iterated. If a match is found, iteration recurses into it.
  * If nothing matches, then either return a 405 response (if any prefixes matched) or serve as a regular static file.
  *
+ * A prefix of ":name" matches any (non-empty) path element, and an entry's prefix of "*" or "*name" matches the rest
+ * of the path, capturing them for kitserv_api_get_path_param. At each level, exact prefixes are tried before ":name"
+ * ones, and if an exact subtree leads nowhere, a ":name" one is tried next. "*" entries are only tried after that.
+ *
+ * The tree is compiled into a radix trie when the server starts, so that routing takes time proportional to the length
+ * of the path, however many entries there are. Changes to the tree after that are not seen.
+ *
  * Note that the request's payload may not be fully read. In particular, be prepared to return from the handler if
  * a read attempt fails. Kitserv offers a void* to remember parsing context if necessary.
  */
@@ -73,18 +80,20 @@ struct kitserv_request_context {
     char* root_fallback;            // null to disable, fallback on '/'
     char* fallback;                 // null to disable, fallback on any 404 error as an exact path from root
     bool use_http_append_fallback;  // try to append .html on failure (/public -> /public.html)
+    bool use_precompressed;         // serve name.br or name.gz in place of name, if the client accepts it
 };
 
 struct kitserv_api_entry {
-    char* prefix;  // prefix of the api endpoint, e.g. "login" - no '/' characters
+    char* prefix;  // prefix of the api endpoint, e.g. "login", ":id" or "*" - no '/' characters
     int prefix_length;
     enum kitserv_http_method method;  // GET implies HEAD, do not set a separate HEAD endpoint
     kitserv_api_handler_t handler;    // function to receive client for API processing
     bool finishes_path;               // if true, do not allow any extra path components (ignore if it does)
+    bool compress;                    // compress responses on the fly when the client accepts it (see kitserv_config)
 };
 
 struct kitserv_api_tree {
-    char* prefix;  // prefix of this tree, ignored for entry point
+    char* prefix;  // prefix of this tree, e.g. "users" or ":id", ignored for entry point
     int prefix_length;
     struct kitserv_api_tree* subtrees;
     struct kitserv_api_entry* entries;
@@ -92,6 +101,17 @@ struct kitserv_api_tree {
     int num_entries;
 };
 
+#define KITSERV_MAX_RANGES (64)  // the most that kitserv_config.max_ranges may allow
+
+/**
+ * Strategies for accepting new connections
+ */
+enum kitserv_accept_mode {
+    KITSERV_ACCEPT_THREAD = 0,  // accept threads (one per address family) hand connections to the workers
+    KITSERV_ACCEPT_REUSEPORT,   // every worker owns SO_REUSEPORT listeners, the kernel spreads connections
+    KITSERV_ACCEPT_EXCLUSIVE,   // every worker waits on the same listeners with EPOLLEXCLUSIVE and accepts itself
+};
+
 struct kitserv_config {
     char* port_string;
     int num_workers;
@@ -99,6 +119,26 @@ struct kitserv_config {
     bool bind_ipv4;
     bool bind_ipv6;
     bool silent_mode;  // disable non-catastrophic error output and logging
+    enum kitserv_accept_mode accept_mode;
+    int header_timeout_ms;     // max time to receive a request's headers (408 on expiry), 0 to disable
+    int body_timeout_ms;       // max time an API handler may wait between payload reads (408 on expiry), 0 to disable
+    int idle_timeout_ms;       // max time a keep-alive connection may wait for its next request, 0 to disable
+    int send_timeout_ms;       // max time a response may go without sending progress, 0 to disable
+    int reap_watermark;        // close idle keep-alive connections when fewer slots are free, 0 to disable
+    bool use_arena;            // allocate each worker's connections and buffers from one mapping, preferring huge pages
+    bool prefault_arena;       // fault the arenas in at startup instead of on first use
+    int arena_buffers;         // buffers of each size that each worker preallocates in its arena
+    int file_cache_entries;    // static files each worker keeps open (and missing paths it remembers), 0 to disable
+    int file_cache_ttl_ms;     // re-check cached files this often, 0 to rely on inotify alone
+    int body_cache_bytes;      // bytes of small static files each worker keeps in memory, 0 to disable
+    int body_cache_max_file;   // largest static file kept in memory
+    int compress_level;        // zlib level (1-9) to compress responses at on the fly if built with zlib, 0 to disable
+    int compress_min_size;     // smallest response body worth compressing
+    int compress_cache_bytes;  // bytes of compressed static files each worker keeps, 0 to only compress API responses
+    int compress_max_file;     // largest static file compressed on the fly
+    int max_ranges;            // most ranges a request may ask for, up to KITSERV_MAX_RANGES (0 or 1: single ranges)
+    bool snapshot_root;        // serve the root context from a snapshot taken at startup (and on SIGHUP)
+    char* mime_types;          // mime.types file to register types from at startup (see kitserv_mime_load), or null
     struct kitserv_request_context* http_root_context;
     struct kitserv_api_tree* api_tree;  // nullable to disable API
 };
@@ -111,6 +151,23 @@ struct kitserv_config {
  */
 void kitserv_server_start(struct kitserv_config*);
 
+/**
+ * Register the MIME type that static files with the given extension (with or without its period, ex: ".webp") are
+ * served as, ignoring case. Replaces any type registered for it before, including the built-in one.
+ * Must be called before kitserv_server_start.
+ * Returns 0 on success, -1 on failure (i.e. if the extension or type is malformed).
+ */
+int kitserv_mime_register(const char* extension, const char* type);
+
+/**
+ * Register every type listed in a mime.types file: lines of a type followed by its extensions, separated by
+ * whitespace, with comments from '#'. Extensions of more than one part (ex: "tar.gz") are skipped, as files are
+ * looked up by their last extension alone.
+ * Must be called before kitserv_server_start.
+ * Returns 0 on success, -1 on failure (with errno set, and the types before the failure registered).
+ */
+int kitserv_mime_load(const char* path);
+
 /**
  * Add a formatted header to the given client's current transaction.
  * Returns 0 on success, -1 on failure (i.e. if the header does not fit).
@@ -125,7 +182,7 @@ int kitserv_http_header_add_content_type(struct kitserv_client*, const char* mim
 
 /**
  * Add a content-type header to the given client's current transaction.
- * Guess the mime type based on file extension (include period, ex: ".html").
+ * Look up the mime type registered for a file extension (include period, ex: ".html"), or application/octet-stream.
  * Returns 0 on success, -1 on failure (i.e. if the header does not fit).
  */
 int kitserv_http_header_add_content_type_guess(struct kitserv_client*, const char* extension);
@@ -156,11 +213,47 @@ enum kitserv_http_method kitserv_api_get_request_method(struct kitserv_client*);
 const char* kitserv_api_get_request_path(struct kitserv_client*);
 
 /**
- * Get request query.
- * Returns NULL if not provided.
+ * Get a parameter that the API entry handling the request captured from its path: the component matched by a ":name"
+ * prefix (as name), or the rest of the path matched by a "*name" or "*" prefix (as name or "*").
+ * Returns a pointer into the request path, of *len bytes and not null-terminated, or NULL if there is no such
+ * parameter.
+ */
+const char* kitserv_api_get_path_param(struct kitserv_client*, const char* name, int* len);
+
+/**
+ * Get request query, URL-decoded as a whole (the first time it is asked for).
+ * Returns NULL if not provided, or on error.
  */
 const char* kitserv_api_get_request_query(struct kitserv_client*);
 
+/**
+ * Get request query as it was sent: still URL-encoded, so that it can be split on '&' and '=' safely.
+ * Returns NULL if not provided.
+ */
+const char* kitserv_api_get_request_query_raw(struct kitserv_client*);
+
+/**
+ * Get the number of parameters in the request query, which is split into them (and each key and value decoded) the
+ * first time any of them is asked for. Later lookups take constant time.
+ * Returns the number of parameters on success, -1 on error.
+ */
+int kitserv_api_get_query_param_count(struct kitserv_client*);
+
+/**
+ * Get the value of the first query parameter with a key.
+ * Returns a pointer to it, of *len bytes and not null-terminated, or NULL if there is no such parameter (or on error).
+ */
+const char* kitserv_api_get_query_param(struct kitserv_client*, const char* key, int* len);
+
+/**
+ * Get the query parameter at a position (from 0), and its key (of *keylen bytes, not null-terminated) if key and
+ * keylen aren't NULL.
+ * Returns a pointer to its value, of *len bytes and not null-terminated, or NULL if there is no such parameter (or on
+ * error).
+ */
+const char* kitserv_api_get_query_param_at(struct kitserv_client*, int index, const char** key, int* keylen,
+                                           int* len);
+
 /**
  * Get request content length (i.e. payload length).
  * Returns 0 if not provided.
@@ -9,6 +9,7 @@
 
 #include "buffer.h"
 #include "http.h"
+#include "httpdate.h"
 #include "kitserv.h"
 
 enum kitserv_http_method kitserv_api_get_request_method(struct kitserv_client* client)
@@ -21,14 +22,93 @@ const char* kitserv_api_get_request_path(struct kitserv_client* client)
     return client->ta.req_path;
 }
 
+const char* kitserv_api_get_path_param(struct kitserv_client* client, const char* name, int* len)
+{
+    const struct router_route* route = client->ta_cold.api_route;
+    int i;
+
+    if (!name || !len) {
+        errno = EINVAL;
+        return NULL;
+    }
+    for (i = 0; route && i < route->num_params; i++) {
+        if (!strcmp(route->params[i], name)) {
+            *len = client->ta_cold.api_params[i].len;
+            return &client->req_headers[client->ta_cold.api_params[i].off];
+        }
+    }
+    return NULL;
+}
+
 const char* kitserv_api_get_request_query(struct kitserv_client* client)
 {
-    return client->ta.req_query;
+    if (kitserv_http_decode_query(client)) {
+        return NULL;
+    }
+    return client->req_query_decoded;
+}
+
+const char* kitserv_api_get_request_query_raw(struct kitserv_client* client)
+{
+    return client->ta_cold.req_query;
+}
+
+int kitserv_api_get_query_param_count(struct kitserv_client* client)
+{
+    if (kitserv_http_parse_query(client)) {
+        return -1;
+    }
+    return client->req_query_index->num_params;
+}
+
+const char* kitserv_api_get_query_param(struct kitserv_client* client, const char* key, int* len)
+{
+    const struct query_param* param;
+
+    if (!key || !len) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (kitserv_http_parse_query(client)) {
+        return NULL;
+    }
+    param = kitserv_query_find(client->req_query_index, key, strlen(key));
+    if (!param) {
+        return NULL;
+    }
+    *len = param->len;
+    return param->value;
+}
+
+const char* kitserv_api_get_query_param_at(struct kitserv_client* client, int index, const char** key, int* keylen,
+                                           int* len)
+{
+    const struct query_param* param;
+
+    if (!len) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (kitserv_http_parse_query(client)) {
+        return NULL;
+    }
+    if (index < 0 || index >= client->req_query_index->num_params) {
+        return NULL;
+    }
+    param = &client->req_query_index->params[index];
+    if (key) {
+        *key = param->key;
+    }
+    if (keylen) {
+        *keylen = param->keylen;
+    }
+    *len = param->len;
+    return param->value;
 }
 
 off_t kitserv_api_get_request_content_length(struct kitserv_client* client)
 {
-    return client->ta.req_content_len;
+    return client->ta_cold.req_content_len;
 }
 
 const char* kitserv_api_get_request_cookie(struct kitserv_client* client, const char* key)
@@ -47,10 +127,10 @@ const char* kitserv_api_get_request_cookie_n(struct kitserv_client* client, cons
         errno = EINVAL;
         return NULL;
     }
-    if (client->ta.req_fresh_cookies) {
+    if (client->ta_cold.req_fresh_cookies) {
         kitserv_http_parse_cookies(client);
     }
-    for (i = 0; i < client->ta.req_num_cookies; i++) {
+    for (i = 0; i < client->ta_cold.req_num_cookies; i++) {
         if (keylen == client->req_cookies[i].keylen && !strcmp(key, client->req_cookies[i].key)) {
             return client->req_cookies[i].value;
         }
@@ -60,12 +140,12 @@ const char* kitserv_api_get_request_cookie_n(struct kitserv_client* client, cons
 
 const char* kitserv_api_get_request_mime_type(struct kitserv_client* client)
 {
-    return client->ta.req_mimetype;
+    return client->ta_cold.req_mimetype;
 }
 
 const char* kitserv_api_get_request_disposition(struct kitserv_client* client)
 {
-    return client->ta.req_disposition;
+    return client->ta_cold.req_disposition;
 }
 
 int kitserv_api_get_request_range(struct kitserv_client* client, off_t* start, off_t* end)
@@ -78,11 +158,11 @@ int kitserv_api_get_request_range(struct kitserv_client* client, off_t* start, o
 
 int kitserv_api_get_request_modified_since_difference(struct kitserv_client* client, double* difference, time_t time)
 {
-    struct tm tm;
-    if (!client->ta.req_modified_since || !strptime(client->ta.req_modified_since, "%a, %d %b %Y %T GMT", &tm)) {
+    time_t since;
+    if (!client->ta_cold.req_modified_since || kitserv_httpdate_parse(client->ta_cold.req_modified_since, &since)) {
         return -1;
     }
-    *difference = difftime(time, timegm(&tm));
+    *difference = difftime(time, since);
     return 0;
 }
 
@@ -91,6 +171,11 @@ int kitserv_api_read_payload(struct kitserv_client* client, char* buf, int nbyte
     int rc;
     int written = 0;
 
+    if (client->ta_cold.timed_out) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
     // if we overread from the headers, give them that data now
     rc = client->ta.req_payload_len - client->ta.req_payload_pos;
     if (rc > 0) {
@@ -128,7 +213,7 @@ int kitserv_api_read_payload(struct kitserv_client* client, char* buf, int nbyte
 int kitserv_api_write_body(struct kitserv_client* client, const char* buf, int buflen)
 {
     int pre_sz = client->resp_body.len;
-    if (kitserv_buffer_append(&client->resp_body, buf, buflen)) {
+    if (kitserv_http_acquire_body(client) || kitserv_buffer_append(&client->resp_body, buf, buflen)) {
         errno = ENOMEM;
         return -1;
     }
@@ -139,6 +224,10 @@ int kitserv_api_write_body_fmt(struct kitserv_client* client, const char* fmt, .
 {
     va_list ap;
     int pre_sz = client->resp_body.len;
+    if (kitserv_http_acquire_body(client)) {
+        errno = ENOMEM;
+        return -1;
+    }
     va_start(ap, fmt);
     if (kitserv_buffer_appendva(&client->resp_body, fmt, &ap)) {
         errno = ENOMEM;
@@ -161,9 +250,7 @@ void kitserv_api_reset_body(struct kitserv_client* client)
 
 int kitserv_api_send_file(struct kitserv_client* client, int fd, off_t filesize)
 {
-    if (client->ta.resp_fd > 0) {
-        close(client->ta.resp_fd);
-    }
+    kitserv_http_release_resp_fd(client);
     client->ta.resp_fd = fd;
     client->ta.resp_body_pos = 0;
     if (fd != KITSERV_FD_DISABLE) {
@@ -185,12 +272,12 @@ int kitserv_api_set_send_range(struct kitserv_client* client, off_t from, off_t
 
 void kitserv_api_set_preserve_headers_on_error(struct kitserv_client* client, bool preserve_enabled)
 {
-    client->ta.preserve_headers_on_error = preserve_enabled;
+    kitserv_http_ta_cold(client)->preserve_headers_on_error = preserve_enabled;
 }
 
 void kitserv_api_set_preserve_body_on_error(struct kitserv_client* client, bool preserve_enabled)
 {
-    client->ta.preserve_body_on_error = preserve_enabled;
+    kitserv_http_ta_cold(client)->preserve_body_on_error = preserve_enabled;
 }
 
 void kitserv_api_set_response_status(struct kitserv_client* client, enum kitserv_http_response_status status)
@@ -200,5 +287,5 @@ void kitserv_api_set_response_status(struct kitserv_client* client, enum kitserv
 
 void kitserv_api_save_state(struct kitserv_client* client, void* state)
 {
-    client->ta.api_internal_data = state;
+    kitserv_http_ta_cold(client)->api_internal_data = state;
 }
@@ -0,0 +1,90 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#define _DEFAULT_SOURCE
+
+#include "arena.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define ARENA_HUGE_PAGE_SIZE ((size_t)2 << 20)  // the common x86-64/aarch64 size, mmap rounds to the real one
+
+static inline size_t round_up(size_t n, size_t to)
+{
+    return (n + to - 1) / to * to;
+}
+
+int kitserv_arena_init(arena_t* arena, size_t size, bool prefault)
+{
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void* base = MAP_FAILED;
+
+    arena->backing = ARENA_PAGES;
+#ifdef MAP_HUGETLB
+    // only succeeds if the administrator has reserved enough huge pages, so fall back quietly
+    arena->size = round_up(size, ARENA_HUGE_PAGE_SIZE);
+    base = mmap(NULL, arena->size, prot, flags | MAP_HUGETLB, -1, 0);
+    if (base != MAP_FAILED) {
+        arena->backing = ARENA_HUGETLB;
+    }
+#endif
+    if (base == MAP_FAILED) {
+        arena->size = round_up(size, sysconf(_SC_PAGESIZE));
+        base = mmap(NULL, arena->size, prot, flags, -1, 0);
+        if (base == MAP_FAILED) {
+            arena->base = NULL;
+            return -1;
+        }
+#ifdef MADV_HUGEPAGE
+        // has to be asked for before the first fault, and may well be refused (e.g. THP disabled), which is fine
+        if (!madvise(base, arena->size, MADV_HUGEPAGE)) {
+            arena->backing = ARENA_THP;
+        }
+#endif
+    }
+
+    // fault everything in from this thread, rather than populating in the kernel, to be sure who touched it first
+    if (prefault) {
+        memset(base, 0, arena->size);
+    }
+
+    arena->base = base;
+    arena->used = 0;
+    return 0;
+}
+
+void kitserv_arena_free(arena_t* arena)
+{
+    if (arena->base) {
+        munmap(arena->base, arena->size);
+        arena->base = NULL;
+    }
+}
+
+void* kitserv_arena_alloc(arena_t* arena, size_t size, size_t align)
+{
+    size_t start = round_up(arena->used, align);
+
+    if (start > arena->size || size > arena->size - start) {
+        return NULL;
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+const char* kitserv_arena_backing_name(enum arena_backing backing)
+{
+    switch (backing) {
+        case ARENA_HUGETLB:
+            return "huge pages";
+        case ARENA_THP:
+            return "transparent huge pages";
+        case ARENA_PAGES:
+        default:
+            return "regular pages";
+    }
+}
@@ -0,0 +1,229 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#define _DEFAULT_SOURCE
+
+#include "bodycache.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INITIAL_BUCKETS (64)
+
+static unsigned int hash_key(const struct body_key* key)
+{
+    uint64_t x = (uint64_t)key->ino ^ ((uint64_t)key->dev << 32) ^ ((uint64_t)(key->encoding + 1) << 56);
+
+    // splitmix64 finalizer, since inode numbers are anything but random
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return (unsigned int)(x ^ (x >> 31));
+}
+
+static inline bool key_equals(const struct body_key* a, const struct body_key* b)
+{
+    return a->ino == b->ino && a->dev == b->dev && a->size == b->size && a->mtime.tv_sec == b->mtime.tv_sec &&
+           a->mtime.tv_nsec == b->mtime.tv_nsec && a->encoding == b->encoding;
+}
+
+int kitserv_bodycache_init(bodycache_t* cache, size_t budget, size_t max_size)
+{
+    cache->buckets = NULL;
+    cache->mask = 0;
+    cache->clock = NULL;
+    cache->count = 0;
+    cache->clock_max = 0;
+    cache->hand = 0;
+    cache->used = 0;
+    cache->budget = 0;
+    cache->max_size = max_size < budget ? max_size : budget;
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+
+    if (budget == 0) {
+        return 0;
+    }
+    cache->buckets = calloc(INITIAL_BUCKETS, sizeof(struct body_entry*));
+    if (!cache->buckets) {
+        return -1;
+    }
+    cache->mask = INITIAL_BUCKETS - 1;
+    cache->budget = budget;
+    return 0;
+}
+
+/**
+ * Count an event without a locked instruction: only the owning worker ever writes to the counter.
+ */
+static inline void count(atomic_ulong* counter)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+struct body_entry* kitserv_bodycache_lookup(bodycache_t* cache, const struct body_key* key)
+{
+    unsigned int hash = hash_key(key);
+    struct body_entry* entry;
+
+    for (entry = cache->buckets[hash & cache->mask]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && key_equals(&entry->key, key)) {
+            entry->referenced = true;
+            count(&cache->hits);
+            return entry;
+        }
+    }
+    count(&cache->misses);
+    return NULL;
+}
+
+void kitserv_bodycache_release(struct body_entry* entry)
+{
+    if (--entry->refs == 0) {
+        free(entry);
+    }
+}
+
+/**
+ * Drop the entry under the clock hand from the cache, moving the last one into its place.
+ */
+static void evict_at_hand(bodycache_t* cache)
+{
+    struct body_entry* entry = cache->clock[cache->hand];
+    struct body_entry** link = &cache->buckets[entry->hash & cache->mask];
+
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    cache->count--;
+    cache->clock[cache->hand] = cache->clock[cache->count];
+    cache->clock[cache->hand]->clock_index = cache->hand;
+    cache->used -= entry->len + entry->headers_len;
+    kitserv_bodycache_release(entry);
+}
+
+/**
+ * Evict entries until size more bytes fit in the budget.
+ */
+static void make_room(bodycache_t* cache, size_t size)
+{
+    while (cache->count && cache->used + size > cache->budget) {
+        if (cache->hand >= cache->count) {
+            cache->hand = 0;
+        }
+        // second chance for anything used since the last pass
+        if (cache->clock[cache->hand]->referenced) {
+            cache->clock[cache->hand]->referenced = false;
+            cache->hand++;
+        } else {
+            evict_at_hand(cache);
+        }
+    }
+}
+
+/**
+ * Make room for one more entry in the clock and hash table.
+ * Returns 0 on success, -1 on error.
+ */
+static int grow(bodycache_t* cache)
+{
+    struct body_entry **buckets, **clock, *entry, *next;
+    unsigned int i, clock_max;
+
+    if (cache->count == cache->clock_max) {
+        clock_max = cache->clock_max ? cache->clock_max * 2 : INITIAL_BUCKETS;
+        clock = realloc(cache->clock, clock_max * sizeof(struct body_entry*));
+        if (!clock) {
+            return -1;
+        }
+        cache->clock = clock;
+        cache->clock_max = clock_max;
+    }
+    if (cache->count > cache->mask) {
+        buckets = calloc((cache->mask + 1) * 2, sizeof(struct body_entry*));
+        if (!buckets) {
+            return -1;
+        }
+        for (i = 0; i <= cache->mask; i++) {
+            for (entry = cache->buckets[i]; entry; entry = next) {
+                next = entry->hash_next;
+                entry->hash_next = buckets[entry->hash & (cache->mask * 2 + 1)];
+                buckets[entry->hash & (cache->mask * 2 + 1)] = entry;
+            }
+        }
+        free(cache->buckets);
+        cache->buckets = buckets;
+        cache->mask = cache->mask * 2 + 1;
+    }
+    return 0;
+}
+
+/**
+ * Add an entry whose data (and headers, if any) are filled in to the cache, or free it if that fails.
+ * Returns the entry, or NULL on error.
+ */
+static struct body_entry* add_entry(bodycache_t* cache, const struct body_key* key, struct body_entry* entry)
+{
+    make_room(cache, entry->len + entry->headers_len);
+    if (grow(cache)) {
+        free(entry);
+        return NULL;
+    }
+    entry->key = *key;
+    entry->hash = hash_key(key);
+    entry->refs = 1;
+    entry->referenced = false;
+    entry->hash_next = cache->buckets[entry->hash & cache->mask];
+    cache->buckets[entry->hash & cache->mask] = entry;
+    entry->clock_index = cache->count;
+    cache->clock[cache->count++] = entry;
+    cache->used += entry->len + entry->headers_len;
+    return entry;
+}
+
+struct body_entry* kitserv_bodycache_fill(bodycache_t* cache, const struct body_key* key, int fd)
+{
+    struct body_entry* entry;
+    ssize_t rc;
+    off_t pos;
+
+    entry = malloc(sizeof(struct body_entry) + key->size);
+    if (!entry) {
+        return NULL;
+    }
+    for (pos = 0; pos < key->size; pos += rc) {
+        rc = pread(fd, &entry->data[pos], key->size - pos, pos);
+        if (rc <= 0) {
+            // changed under us, or unreadable
+            free(entry);
+            return NULL;
+        }
+    }
+    entry->len = key->size;
+    entry->headers = NULL;
+    entry->headers_len = 0;
+    return add_entry(cache, key, entry);
+}
+
+struct body_entry* kitserv_bodycache_insert(bodycache_t* cache, const struct body_key* key, const char* data,
+                                            size_t len, const char* headers, int headers_len)
+{
+    struct body_entry* entry;
+
+    entry = malloc(sizeof(struct body_entry) + len + headers_len);
+    if (!entry) {
+        return NULL;
+    }
+    memcpy(entry->data, data, len);
+    entry->len = len;
+    entry->headers = NULL;
+    entry->headers_len = 0;
+    if (headers) {
+        memcpy(&entry->data[len], headers, headers_len);
+        entry->headers = &entry->data[len];
+        entry->headers_len = headers_len;
+    }
+    return add_entry(cache, key, entry);
+}
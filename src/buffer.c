@@ -17,18 +17,29 @@ int kitserv_buffer_init(buffer_t* buffer, off_t initial_size)
     }
     buffer->len = 0;
     buffer->max = initial_size;
+    buffer->borrowed = false;
     return 0;
 }
 
+void kitserv_buffer_borrow(buffer_t* buffer, char* buf, off_t size)
+{
+    buffer->buf = buf;
+    buffer->len = 0;
+    buffer->max = size;
+    buffer->borrowed = true;
+}
+
 void kitserv_buffer_free(buffer_t* buffer)
 {
-    free(buffer->buf);
+    if (!buffer->borrowed) {
+        free(buffer->buf);
+    }
 }
 
 void kitserv_buffer_reset(buffer_t* buffer, off_t size)
 {
     buffer->len = 0;
-    if (buffer->max > size) {
+    if (buffer->max > size && !buffer->borrowed) {
         char* new_buf = realloc(buffer->buf, size);
         if (new_buf) {
             buffer->buf = new_buf;
@@ -40,10 +51,21 @@ void kitserv_buffer_reset(buffer_t* buffer, off_t size)
 static inline char* kitserv_buffer_ensure_space(buffer_t* buffer, off_t n)
 {
     if (buffer->len + n >= buffer->max) {
-        off_t new_max = (n / BUFFER_INCREMENT + 1) * BUFFER_INCREMENT;  // min increments to fit
-        char* new_buf = realloc(buffer->buf, n);
-        if (!new_buf) {
-            return NULL;
+        off_t new_max = ((buffer->len + n) / BUFFER_INCREMENT + 1) * BUFFER_INCREMENT;  // min increments to fit
+        char* new_buf;
+        if (buffer->borrowed) {
+            // leave the original where it is, its owner will take it back
+            new_buf = malloc(new_max);
+            if (!new_buf) {
+                return NULL;
+            }
+            memcpy(new_buf, buffer->buf, buffer->len);
+            buffer->borrowed = false;
+        } else {
+            new_buf = realloc(buffer->buf, new_max);
+            if (!new_buf) {
+                return NULL;
+            }
         }
         buffer->buf = new_buf;
         buffer->max = new_max;
@@ -64,17 +86,27 @@ int kitserv_buffer_append(buffer_t* buffer, const void* elems, off_t n)
 
 int kitserv_buffer_appendva(buffer_t* buffer, const char* fmt, va_list* ap)
 {
+    va_list retry;
     int rc;
 
-    rc = vsnprintf(&buffer->buf[buffer->len], buffer->max - buffer->len, fmt, *ap);
-    if (rc > buffer->max - buffer->len) {
+    // the first attempt consumes ap, so keep a copy for the retry
+    va_copy(retry, *ap);
+    rc = vsnprintf(buffer->buf ? &buffer->buf[buffer->len] : NULL, buffer->max - buffer->len, fmt, *ap);
+    if (rc >= buffer->max - buffer->len) {
         // failed - would have overrun the buffer (so, expand and retry)
-        kitserv_buffer_ensure_space(buffer, rc);
-        rc = vsnprintf(&buffer->buf[buffer->len], buffer->max - buffer->len, fmt, *ap);
-        if (rc > buffer->max - buffer->len) {
-            return -1;
+        if (!kitserv_buffer_ensure_space(buffer, rc)) {
+            rc = -1;
+        } else {
+            rc = vsnprintf(&buffer->buf[buffer->len], buffer->max - buffer->len, fmt, retry);
+            if (rc >= buffer->max - buffer->len) {
+                rc = -1;
+            }
         }
     }
+    va_end(retry);
+    if (rc < 0) {
+        return -1;
+    }
     buffer->len += rc;
     return 0;
 }
@@ -0,0 +1,81 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#include "bufpool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+void kitserv_bufpool_init(bufpool_t* pool, size_t size, unsigned int max_free)
+{
+    assert(size >= sizeof(void*));
+    pool->first_free = NULL;
+    pool->size = size;
+    pool->num_free = 0;
+    pool->max_free = max_free;
+    pool->num_out = 0;
+    pool->arena = NULL;
+}
+
+void kitserv_bufpool_free(bufpool_t* pool)
+{
+    void* buf;
+
+    while ((buf = pool->first_free)) {
+        pool->first_free = *(void**)buf;
+        if (!pool->arena || !kitserv_arena_contains(pool->arena, buf)) {
+            free(buf);
+        }
+    }
+    pool->num_free = 0;
+}
+
+int kitserv_bufpool_seed(bufpool_t* pool, arena_t* arena, unsigned int count)
+{
+    void* buf;
+
+    assert(!pool->arena || pool->arena == arena);
+    pool->arena = arena;
+    while (count--) {
+        buf = kitserv_arena_alloc(arena, pool->size, sizeof(void*));
+        if (!buf) {
+            return -1;
+        }
+        *(void**)buf = pool->first_free;
+        pool->first_free = buf;
+        pool->num_free++;
+    }
+    return 0;
+}
+
+void* kitserv_bufpool_get(bufpool_t* pool)
+{
+    void* buf = pool->first_free;
+
+    if (buf) {
+        pool->first_free = *(void**)buf;
+        pool->num_free--;
+    } else {
+        buf = malloc(pool->size);
+        if (!buf) {
+            return NULL;
+        }
+    }
+    pool->num_out++;
+    return buf;
+}
+
+void kitserv_bufpool_put(bufpool_t* pool, void* buf)
+{
+    if (!buf) {
+        return;
+    }
+    assert(pool->num_out > 0);
+    pool->num_out--;
+    if (pool->num_free >= pool->max_free && (!pool->arena || !kitserv_arena_contains(pool->arena, buf))) {
+        free(buf);
+        return;
+    }
+    *(void**)buf = pool->first_free;
+    pool->first_free = buf;
+    pool->num_free++;
+}
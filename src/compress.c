@@ -0,0 +1,179 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#define _DEFAULT_SOURCE
+
+#include "compress.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#ifdef KITSERV_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define READ_CHUNK (64 << 10)
+
+/**
+ * Types that are compressed already: whole top-level types end in '/', the rest are matched exactly.
+ */
+static const char* const precompressed_types[] = {
+    "image/",
+    "audio/",
+    "video/",
+    "font/woff",
+    "font/woff2",
+    "application/gzip",
+    "application/x-gzip",
+    "application/zip",
+    "application/zstd",
+    "application/x-bzip2",
+    "application/x-xz",
+    "application/x-7z-compressed",
+    "application/pdf",
+    "application/octet-stream",  // unknown, so not worth the CPU
+};
+
+bool kitserv_compress_mime_type(const char* mime_type)
+{
+    size_t len, type_len, i;
+
+    for (len = 0; mime_type[len] && !strchr("; \t\r\n", mime_type[len]); len++) {
+    }
+    // the one image format that is text
+    if (len == 13 && !strncasecmp(mime_type, "image/svg+xml", 13)) {
+        return true;
+    }
+    for (i = 0; i < sizeof(precompressed_types) / sizeof(precompressed_types[0]); i++) {
+        type_len = strlen(precompressed_types[i]);
+        if (precompressed_types[i][type_len - 1] == '/' ? len > type_len : len == type_len) {
+            if (!strncasecmp(mime_type, precompressed_types[i], type_len)) {
+                return false;
+            }
+        }
+    }
+    return len > 0;
+}
+
+#ifdef KITSERV_HAVE_ZLIB
+
+bool kitserv_compress_available(void)
+{
+    return true;
+}
+
+/**
+ * Start compressing up to len bytes into out, which is made large enough to take all of it in one go.
+ * Returns 0 on success, -1 on error.
+ */
+static int compress_start(z_stream* zs, enum content_encoding encoding, int level, size_t len, buffer_t* out)
+{
+    uLong bound;
+
+    memset(zs, 0, sizeof(z_stream));
+    // 16 more window bits asks zlib for a gzip wrapper, rather than the zlib one that deflate means in HTTP
+    if (deflateInit2(zs, level, Z_DEFLATED, encoding == ENCODING_GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    bound = deflateBound(zs, len);
+    if (len > UINT_MAX || bound > UINT_MAX || kitserv_buffer_init(out, bound)) {
+        deflateEnd(zs);
+        return -1;
+    }
+    zs->next_out = (Bytef*)out->buf;
+    zs->avail_out = bound;
+    return 0;
+}
+
+/**
+ * Finish compressing after the last call to deflate returned rc.
+ * Returns 0 on success, -1 on error (freeing out).
+ */
+static int compress_end(z_stream* zs, int rc, buffer_t* out)
+{
+    out->len = zs->total_out;
+    deflateEnd(zs);
+    if (rc != Z_STREAM_END) {
+        kitserv_buffer_free(out);
+        return -1;
+    }
+    return 0;
+}
+
+int kitserv_compress_buffer(enum content_encoding encoding, int level, const char* data, size_t len, buffer_t* out)
+{
+    z_stream zs;
+
+    if (compress_start(&zs, encoding, level, len, out)) {
+        return -1;
+    }
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = len;
+    return compress_end(&zs, deflate(&zs, Z_FINISH), out);
+}
+
+int kitserv_compress_fd(enum content_encoding encoding, int level, int fd, off_t size, buffer_t* out)
+{
+    z_stream zs;
+    char* chunk;
+    ssize_t n;
+    off_t pos = 0;
+    int rc;
+
+    chunk = malloc(READ_CHUNK);
+    if (!chunk) {
+        return -1;
+    }
+    if (compress_start(&zs, encoding, level, size, out)) {
+        free(chunk);
+        return -1;
+    }
+    do {
+        n = 0;
+        if (pos < size) {
+            n = pread(fd, chunk, size - pos < READ_CHUNK ? size - pos : READ_CHUNK, pos);
+            if (n <= 0) {
+                // changed under us, or unreadable
+                rc = Z_DATA_ERROR;
+                break;
+            }
+        }
+        pos += n;
+        zs.next_in = (Bytef*)chunk;
+        zs.avail_in = n;
+        rc = deflate(&zs, pos == size ? Z_FINISH : Z_NO_FLUSH);
+    } while (rc == Z_OK);
+    free(chunk);
+    return compress_end(&zs, rc, out);
+}
+
+#else
+
+bool kitserv_compress_available(void)
+{
+    return false;
+}
+
+int kitserv_compress_buffer(enum content_encoding encoding, int level, const char* data, size_t len, buffer_t* out)
+{
+    (void)encoding;
+    (void)level;
+    (void)data;
+    (void)len;
+    (void)out;
+    return -1;
+}
+
+int kitserv_compress_fd(enum content_encoding encoding, int level, int fd, off_t size, buffer_t* out)
+{
+    (void)encoding;
+    (void)level;
+    (void)fd;
+    (void)size;
+    (void)out;
+    return -1;
+}
+
+#endif
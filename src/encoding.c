@@ -0,0 +1,91 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#define _DEFAULT_SOURCE
+
+#include "encoding.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+#define ENCODING_ALL (ENCODING_BIT(ENCODING_COUNT) - 1)
+
+static inline bool is_ows(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/**
+ * Returns true if the q-value at value is zero (0, 0., 0.0, up to 0.000).
+ */
+static bool qvalue_is_zero(const char* value)
+{
+    if (*value++ != '0') {
+        return false;
+    }
+    if (*value == '.') {
+        value++;
+    }
+    while (*value == '0') {
+        value++;
+    }
+    return *value == '\0' || *value == ',' || *value == ';' || is_ows(*value);
+}
+
+unsigned int kitserv_encoding_parse_accept(const char* value)
+{
+    // Accept-Encoding: CODING[;q=QVALUE], ...
+    unsigned int listed = 0, accepted = 0, bits;
+    bool wildcard = false, refused;
+    const char* coding;
+    int len, i;
+
+    while (*value) {
+        if (*value == ',' || is_ows(*value)) {
+            value++;
+            continue;
+        }
+        coding = value;
+        while (*value && *value != ',' && *value != ';' && !is_ows(*value)) {
+            value++;
+        }
+        len = value - coding;
+
+        // only q matters among the parameters
+        refused = false;
+        while (*value && *value != ',') {
+            if (*value == ';') {
+                do {
+                    value++;
+                } while (is_ows(*value));
+                if ((*value == 'q' || *value == 'Q') && value[1] == '=') {
+                    refused = qvalue_is_zero(&value[2]);
+                }
+                continue;
+            }
+            value++;
+        }
+
+        if (len == 1 && *coding == '*') {
+            wildcard = !refused;
+            continue;
+        }
+        bits = 0;
+        for (i = 0; i < ENCODING_COUNT; i++) {
+            if ((int)strlen(kitserv_encoding_name(i)) == len && !strncasecmp(coding, kitserv_encoding_name(i), len)) {
+                bits = ENCODING_BIT(i);
+            }
+        }
+        if (len == 6 && !strncasecmp(coding, "x-gzip", 6)) {
+            bits = ENCODING_BIT(ENCODING_GZIP);
+        }
+        listed |= bits;
+        if (!refused) {
+            accepted |= bits;
+        }
+    }
+    if (wildcard) {
+        accepted |= ENCODING_ALL & ~listed;
+    }
+    return accepted;
+}
@@ -0,0 +1,439 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#define _DEFAULT_SOURCE
+
+#include "filecache.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#define KITSERV_HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+#include "kitserv.h"
+#include "timer.h"
+
+#ifdef KITSERV_HAVE_INOTIFY
+// anything that could change what a name in the directory refers to, or the directory itself
+#define WATCH_MASK                                                                                                    \
+    (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+     IN_MOVE_SELF | IN_ONLYDIR)
+#endif
+
+static unsigned int hash_path(const char* path, int len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return hash;
+}
+
+int kitserv_filecache_init(filecache_t* cache, unsigned int max_entries, int ttl_ms)
+{
+    unsigned int size = 1;
+
+    cache->buckets = NULL;
+    cache->mask = 0;
+    cache->max_entries = 0;
+    cache->files = (struct filecache_lru){NULL, NULL, 0};
+    cache->missing = (struct filecache_lru){NULL, NULL, 0};
+    cache->generation = 0;
+    cache->ttl_ms = ttl_ms;
+    cache->inotify_fd = -1;
+    cache->watches = NULL;
+    cache->num_watches = 0;
+
+    if (max_entries == 0) {
+        return 0;
+    }
+
+#ifdef KITSERV_HAVE_INOTIFY
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotify_fd < 0 && !kitserv_silent_mode) {
+        perror("inotify_init1");
+    }
+#endif
+    if (cache->inotify_fd < 0 && ttl_ms <= 0) {
+        // nothing would ever tell us that a file changed
+        if (!kitserv_silent_mode) {
+            fprintf(stderr, "File cache disabled: no inotify support, and no TTL set.\n");
+        }
+        return 0;
+    }
+
+    // room for both kinds of entry
+    while (size < max_entries * 2) {
+        size <<= 1;
+    }
+    cache->buckets = calloc(size, sizeof(struct file_entry*));
+    if (!cache->buckets) {
+        return -1;
+    }
+    cache->mask = size - 1;
+    cache->max_entries = max_entries;
+    return 0;
+}
+
+void kitserv_filecache_release(struct file_entry* entry)
+{
+    if (--entry->refs > 0) {
+        return;
+    }
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    free(entry->headers);
+    free(entry);
+}
+
+static inline struct filecache_lru* entry_lru(filecache_t* cache, struct file_entry* entry)
+{
+    return kitserv_filecache_missing(entry) ? &cache->missing : &cache->files;
+}
+
+static void lru_unlink(struct filecache_lru* lru, struct file_entry* entry)
+{
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru->head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru->tail = entry->lru_prev;
+    }
+}
+
+static void lru_append(struct filecache_lru* lru, struct file_entry* entry)
+{
+    entry->lru_next = NULL;
+    entry->lru_prev = lru->tail;
+    if (lru->tail) {
+        lru->tail->lru_next = entry;
+    } else {
+        lru->head = entry;
+    }
+    lru->tail = entry;
+}
+
+/**
+ * Drop an entry from the cache. Transactions that still use it keep it alive until they're done.
+ */
+static void entry_remove(filecache_t* cache, struct file_entry* entry)
+{
+    struct file_entry** link = &cache->buckets[entry->hash & cache->mask];
+
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    lru_unlink(entry_lru(cache, entry), entry);
+    entry_lru(cache, entry)->count--;
+
+    if (entry->watch >= 0) {
+        if (entry->watch_prev) {
+            entry->watch_prev->watch_next = entry->watch_next;
+        } else {
+            cache->watches[entry->watch] = entry->watch_next;
+        }
+        if (entry->watch_next) {
+            entry->watch_next->watch_prev = entry->watch_prev;
+        }
+    }
+
+    entry->cached = false;
+    kitserv_filecache_release(entry);
+}
+
+/**
+ * Drop every entry from the cache, for changes that are too broad to track down.
+ */
+static void remove_all(filecache_t* cache)
+{
+    while (cache->files.head) {
+        entry_remove(cache, cache->files.head);
+    }
+    while (cache->missing.head) {
+        entry_remove(cache, cache->missing.head);
+    }
+    cache->generation++;
+}
+
+#ifdef KITSERV_HAVE_INOTIFY
+/**
+ * Watch the directory at path, which is temporarily terminated at len.
+ * Returns the watch descriptor, or -1 on error.
+ */
+static int watch_directory(filecache_t* cache, char* path, int len)
+{
+    struct file_entry** new_watches;
+    char saved = path[len];
+    int watch, i;
+
+    path[len] = '\0';
+    watch = inotify_add_watch(cache->inotify_fd, path, WATCH_MASK);
+    path[len] = saved;
+    if (watch < 0) {
+        return -1;
+    }
+
+    // descriptors are handed out in increasing order, so this stays about as big as the number of directories
+    if (watch >= cache->num_watches) {
+        new_watches = realloc(cache->watches, (watch + 1) * 2 * sizeof(struct file_entry*));
+        if (!new_watches) {
+            return -1;
+        }
+        for (i = cache->num_watches; i < (watch + 1) * 2; i++) {
+            new_watches[i] = NULL;
+        }
+        cache->watches = new_watches;
+        cache->num_watches = (watch + 1) * 2;
+    }
+    return watch;
+}
+
+/**
+ * Watch every directory from the root down to the one containing the entry, or for a missing entry, down to the
+ * deepest one that exists (where the missing component would have to appear).
+ * Returns 0 on success, -1 on error.
+ */
+static int watch_entry(filecache_t* cache, struct file_entry* entry, int root_len)
+{
+    int watch = -1, name_off = 0, i;
+
+    // directories above the entry only matter if they are renamed or removed, which drops everything anyway
+    for (i = root_len; i < entry->path_len; i++) {
+        if (entry->path[i] != '/' || (i > root_len && entry->path[i - 1] == '/')) {
+            continue;
+        }
+        name_off = watch_directory(cache, entry->path, i > 0 ? i : 1);
+        if (name_off < 0) {
+            if (kitserv_filecache_missing(entry) && watch >= 0 && (errno == ENOENT || errno == ENOTDIR)) {
+                break;
+            }
+            return -1;
+        }
+        watch = name_off;
+        name_off = i + 1;
+        while (entry->path[name_off] == '/') {
+            name_off++;
+        }
+        entry->name_off = name_off;
+    }
+    if (watch < 0) {
+        return -1;
+    }
+    i = entry->name_off;
+    while (i < entry->path_len && entry->path[i] != '/') {
+        i++;
+    }
+    entry->name_len = i - entry->name_off;
+
+    entry->watch = watch;
+    entry->watch_prev = NULL;
+    entry->watch_next = cache->watches[entry->watch];
+    if (entry->watch_next) {
+        entry->watch_next->watch_prev = entry;
+    }
+    cache->watches[entry->watch] = entry;
+    return 0;
+}
+#endif
+
+void kitserv_filecache_process_events(filecache_t* cache)
+{
+#ifdef KITSERV_HAVE_INOTIFY
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* event;
+    struct file_entry *entry, *next;
+    bool changed;
+    ssize_t len;
+    char* p;
+
+    if (cache->inotify_fd < 0) {
+        return;
+    }
+
+    while ((len = read(cache->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event*)p;
+            if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF) ||
+                (event->mask & IN_ISDIR && !(event->mask & IN_CREATE))) {
+                // lost track, or a directory on the way to some files changed
+                remove_all(cache);
+                continue;
+            }
+            if (event->wd < 0 || event->wd >= cache->num_watches || !event->len) {
+                continue;
+            }
+            changed = false;
+            for (entry = cache->watches[event->wd]; entry; entry = next) {
+                next = entry->watch_next;
+                if (!strncmp(&entry->path[entry->name_off], event->name, entry->name_len) &&
+                    !event->name[entry->name_len]) {
+                    entry_remove(cache, entry);
+                    changed = true;
+                }
+            }
+            if (changed) {
+                cache->generation++;
+            }
+        }
+    }
+    if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && !kitserv_silent_mode) {
+        perror("filecache (read inotify)");
+    }
+#else
+    (void)cache;
+#endif
+}
+
+/**
+ * Returns true if the entry still matches the file on disk. Only needed for entries older than the TTL.
+ */
+static bool entry_revalidate(filecache_t* cache, struct file_entry* entry)
+{
+    long now = kitserv_timer_now();
+    struct stat st;
+
+    if (now - entry->validated_ms < cache->ttl_ms) {
+        return true;
+    }
+    if (kitserv_filecache_missing(entry)) {
+        if (!stat(entry->path, &st) && S_ISREG(st.st_mode)) {
+            return false;
+        }
+        // whatever was recorded may depend on other paths, which could have changed since
+        entry->resolved = -1;
+    } else if (stat(entry->path, &st) || st.st_dev != entry->st.st_dev || st.st_ino != entry->st.st_ino ||
+        st.st_size != entry->st.st_size || st.st_mtim.tv_sec != entry->st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != entry->st.st_mtim.tv_nsec) {
+        return false;
+    }
+    entry->validated_ms = now;
+    return true;
+}
+
+struct file_entry* kitserv_filecache_lookup(filecache_t* cache, const char* path, int len)
+{
+    struct file_entry* entry;
+    unsigned int hash;
+
+    if (!cache->max_entries) {
+        return NULL;
+    }
+
+    hash = hash_path(path, len);
+    for (entry = cache->buckets[hash & cache->mask]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && entry->path_len == len && !memcmp(entry->path, path, len)) {
+            break;
+        }
+    }
+    if (!entry) {
+        return NULL;
+    }
+    if (cache->ttl_ms > 0 && !entry_revalidate(cache, entry)) {
+        entry_remove(cache, entry);
+        cache->generation++;
+        return NULL;
+    }
+
+    // most recently used goes to the back
+    lru_unlink(entry_lru(cache, entry), entry);
+    lru_append(entry_lru(cache, entry), entry);
+    return entry;
+}
+
+/**
+ * Cache a new entry for path, with the given fd (-1 for a missing entry) and metadata.
+ * Returns the entry, or NULL if it wasn't cached.
+ */
+static struct file_entry* entry_add(filecache_t* cache, const char* path, int len, int root_len, int fd,
+                                    const struct stat* st)
+{
+    struct filecache_lru* lru;
+    struct file_entry* entry;
+    int i;
+
+    if (!cache->max_entries) {
+        return NULL;
+    }
+
+    entry = malloc(sizeof(struct file_entry) + len + 1);
+    if (!entry) {
+        return NULL;
+    }
+    memcpy(entry->path, path, len);
+    entry->path[len] = '\0';
+    entry->path_len = len;
+    i = len;
+    while (i > 0 && path[i - 1] != '/') {
+        i--;
+    }
+    entry->name_off = i;
+    entry->name_len = len - i;
+    entry->hash = hash_path(path, len);
+    entry->fd = fd;
+    if (st) {
+        entry->st = *st;
+    }
+    entry->validated_ms = cache->ttl_ms > 0 ? kitserv_timer_now() : 0;
+    entry->resolved = -1;
+    entry->resolved_generation = cache->generation;
+    entry->headers = NULL;
+    entry->headers_len = 0;
+    entry->refs = 1;
+    entry->cached = true;
+    entry->watch = -1;
+
+#ifdef KITSERV_HAVE_INOTIFY
+    // without a watch, only the TTL would catch changes
+    if (cache->inotify_fd >= 0 && watch_entry(cache, entry, root_len) && cache->ttl_ms <= 0) {
+        free(entry);
+        return NULL;
+    }
+#else
+    (void)root_len;
+#endif
+
+    lru = entry_lru(cache, entry);
+    if (lru->count >= cache->max_entries) {
+        // a recorded resolution may have skipped past the evicted miss, and nothing on disk would say so once it's gone
+        if (lru == &cache->missing) {
+            cache->generation++;
+        }
+        entry_remove(cache, lru->head);
+    }
+
+    entry->hash_next = cache->buckets[entry->hash & cache->mask];
+    cache->buckets[entry->hash & cache->mask] = entry;
+    lru_append(lru, entry);
+    lru->count++;
+    return entry;
+}
+
+struct file_entry* kitserv_filecache_insert(filecache_t* cache, const char* path, int len, int root_len, int fd,
+                                            const struct stat* st)
+{
+    return entry_add(cache, path, len, root_len, fd, st);
+}
+
+struct file_entry* kitserv_filecache_insert_missing(filecache_t* cache, const char* path, int len, int root_len)
+{
+    return entry_add(cache, path, len, root_len, -1, NULL);
+}
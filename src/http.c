@@ -27,14 +27,34 @@
 #endif
 
 #include "buffer.h"
+#include "bufpool.h"
+#include "compress.h"
+#include "encoding.h"
+#include "filecache.h"
+#include "httpdate.h"
 #include "kitserv.h"
+#include "manifest.h"
+#include "mime.h"
+#include "router.h"
+#include "scan.h"
+#include "timer.h"
 
-#define SERVER_NAME ("kitserv")
+#define SERVER_NAME "kitserv"
+#define RETRY_AFTER_SECONDS "1"
+#define HEADER_BLOCK_MAX (512)  // preformatted headers of a static file
+#define RANGE_MERGE_GAP (80)    // ranges closer than this are sent as one part
 
 #define bufscmp(s, target) (!memcmp(s, target, sizeof(target) - 1))
 
+// the end of the headers of every response after content-length, which each worker keeps a copy of to date
+#define HEADERS_TAIL_DATE "\r\ndate: "
+static const char headers_tail[] = HEADERS_TAIL_DATE "Thu, 01 Jan 1970 00:00:00 GMT\r\nserver: " SERVER_NAME "\r\n\r\n";
+static_assert(sizeof(headers_tail) <= HTTP_HEADERS_TAIL_MAX, "headers tail must fit in HTTP_HEADERS_TAIL_MAX");
+
 static struct kitserv_request_context* default_context;
-static struct kitserv_api_tree* api_tree;
+static router_t api_router;
+
+static void header_table_init(void);
 
 void kitserv_http_init(struct kitserv_request_context* http_default_context, struct kitserv_api_tree* http_api_list)
 {
@@ -48,55 +68,159 @@ void kitserv_http_init(struct kitserv_request_context* http_default_context, str
     }
 
     default_context = http_default_context;
-    api_tree = http_api_list;
+    if (http_api_list && kitserv_router_compile(&api_router, http_api_list)) {
+        fprintf(stderr, "Could not compile the API tree: %s\n", strerror(errno));
+        abort();
+    }
+    header_table_init();
 }
 
-int kitserv_http_create_client_struct(struct kitserv_client* client)
+int kitserv_http_create_worker(struct http_worker* worker, arena_t* arena, unsigned int num_buffers,
+                               const struct http_worker_config* config)
 {
-    assert(client != NULL);
-    if (!(client->req_headers = malloc(HTTP_BUFSZ))) {
-        goto err_reqheaders;
+    // without a compression level, there is nothing to keep compressed
+    if (kitserv_filecache_init(&worker->files, config->file_cache_entries, config->file_cache_ttl_ms) ||
+        kitserv_bodycache_init(&worker->bodies, config->body_cache_bytes, config->body_cache_max_file) ||
+        kitserv_bodycache_init(&worker->compressed, config->compress_level > 0 ? config->compress_cache_bytes : 0,
+                               config->compress_max_file)) {
+        return -1;
     }
-    if (!(client->resp_headers = malloc(HTTP_BUFSZ))) {
-        goto err_respheaders;
+    worker->config = config;
+    worker->snapshot = NULL;
+    worker->snapshot_generation = 0;
+    worker->boundary_seed = (uint64_t)time(NULL) ^ (uintptr_t)worker;
+    memcpy(worker->headers_tail, headers_tail, sizeof(headers_tail));
+    worker->date = -1;
+    kitserv_http_update_date(worker);
+    kitserv_bufpool_init(&worker->bufs_small, HTTP_BUFSZ_SMALL, HTTP_BUFPOOL_MAX_FREE);
+    kitserv_bufpool_init(&worker->bufs, HTTP_BUFSZ, HTTP_BUFPOOL_MAX_FREE);
+    if (arena && (kitserv_bufpool_seed(&worker->bufs, arena, num_buffers) ||
+                  kitserv_bufpool_seed(&worker->bufs_small, arena, num_buffers))) {
+        return -1;
     }
-    if (!(client->resp_start = malloc(HTTP_BUFSZ_SMALL))) {
-        goto err_respstart;
+    return 0;
+}
+
+void kitserv_http_update_date(struct http_worker* worker)
+{
+    struct timespec now;
+
+#ifdef CLOCK_REALTIME_COARSE
+    // only whole seconds are sent, and the coarse clock is much cheaper to read
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+#else
+    clock_gettime(CLOCK_REALTIME, &now);
+#endif
+    if (now.tv_sec != worker->date) {
+        worker->date = now.tv_sec;
+        kitserv_httpdate_format(&worker->headers_tail[sizeof(HEADERS_TAIL_DATE) - 1], now.tv_sec);
     }
-    if (!(client->req_cookies = malloc(sizeof(struct http_cookie) * HTTP_MAX_COOKIES))) {
-        goto err_cookies;
+}
+
+int kitserv_http_create_client_struct(struct kitserv_client* client, struct http_worker* worker)
+{
+    assert(client != NULL);
+    // cookies borrow a regular buffer, since they're rare enough not to deserve their own pool
+    static_assert(sizeof(struct http_cookie) * HTTP_MAX_COOKIES <= HTTP_BUFSZ, "cookies must fit in HTTP_BUFSZ");
+    // and the query's parameters, with room to spare for decoding them
+    static_assert(sizeof(query_index_t) <= HTTP_BUFSZ / 2, "query index must fit in HTTP_BUFSZ");
+    // as do the parts of a multipart response, with the closing delimiter
+    static_assert(sizeof(struct http_range) * (HTTP_MAX_RANGES + 1) <= HTTP_BUFSZ, "ranges must fit in HTTP_BUFSZ");
+
+    client->worker = worker;
+    client->req_headers = NULL;
+    client->req_cookies = NULL;
+    client->req_query_index = NULL;
+    client->req_query_decoded = NULL;
+    client->resp_ranges = NULL;
+    client->resp_start = NULL;
+    client->resp_headers = NULL;
+    client->resp_body_block = NULL;
+    kitserv_buffer_borrow(&client->resp_body, NULL, 0);
+    client->ta.cold_dirty = true;  // never been wiped
+    kitserv_http_reset_client(client);
+    return 0;
+}
+
+int kitserv_http_acquire_body(struct kitserv_client* client)
+{
+    if (client->resp_body_block) {
+        return 0;
     }
-    if (kitserv_buffer_init(&client->resp_body, HTTP_BUFSZ)) {
-        goto err_respbody;
+    client->resp_body_block = kitserv_bufpool_get(&client->worker->bufs);
+    if (!client->resp_body_block) {
+        return -1;
     }
-    kitserv_http_reset_client(client);
+    kitserv_buffer_borrow(&client->resp_body, client->resp_body_block, HTTP_BUFSZ);
     return 0;
+}
 
-err_respbody:
-    free(client->req_cookies);
-err_cookies:
-    free(client->resp_start);
-err_respstart:
-    free(client->resp_headers);
-err_respheaders:
-    free(client->req_headers);
-err_reqheaders:
-    return -1;
+/**
+ * Take the buffers needed to build a response, if the client doesn't already have them.
+ * Returns 0 on success, -1 on failure.
+ */
+static int acquire_response_buffers(struct kitserv_client* client)
+{
+    if (!client->resp_start && !(client->resp_start = kitserv_bufpool_get(&client->worker->bufs_small))) {
+        return -1;
+    }
+    if (!client->resp_headers && !(client->resp_headers = kitserv_bufpool_get(&client->worker->bufs))) {
+        return -1;
+    }
+    return 0;
+}
+
+static inline void release_request_headers(struct kitserv_client* client)
+{
+    kitserv_bufpool_put(&client->worker->bufs, client->req_headers);
+    client->req_headers = NULL;
 }
 
 static inline void cleanup_client(struct kitserv_client* client)
 {
+    struct http_worker* worker = client->worker;
+
+    // the connection may have been dropped partway through sending a file
+    kitserv_http_release_resp_fd(client);
+
+    // most requests never touch the cold part, and it is larger than the rest, so leave it be when it's still clean
+    if (client->ta.cold_dirty) {
+        memset(&client->ta_cold, 0, sizeof(struct http_transaction_cold));
+    }
     memset(&client->ta, 0, sizeof(struct http_transaction));
-    kitserv_buffer_reset(&client->resp_body, HTTP_BUFSZ);
+
+    kitserv_bufpool_put(&worker->bufs, client->req_cookies);
+    kitserv_bufpool_put(&worker->bufs, client->req_query_index);
+    kitserv_bufpool_put(&worker->bufs, client->req_query_decoded);
+    kitserv_bufpool_put(&worker->bufs, client->resp_ranges);
+    kitserv_bufpool_put(&worker->bufs_small, client->resp_start);
+    kitserv_bufpool_put(&worker->bufs, client->resp_headers);
+    client->req_cookies = NULL;
+    client->req_query_index = NULL;
+    client->req_query_decoded = NULL;
+    client->resp_ranges = NULL;
+    client->resp_start = NULL;
+    client->resp_headers = NULL;
+
+    // a body that grew past its pool buffer has moved out of it, so free that copy and return the original
+    kitserv_buffer_free(&client->resp_body);
+    kitserv_buffer_borrow(&client->resp_body, NULL, 0);
+    kitserv_bufpool_put(&worker->bufs, client->resp_body_block);
+    client->resp_body_block = NULL;
 }
 
 void kitserv_http_finalize_transaction(struct kitserv_client* client)
 {
+    client->num_transactions++;
     // in case the client sent part of their next request into the buffers for this one
     // so, what we considered the payload length is actually now the header length
     const int remaining_payload = client->ta.req_payload_len - client->ta.req_payload_pos;
     assert(remaining_payload >= 0 && remaining_payload <= HTTP_BUFSZ);
-    memmove(client->req_headers, &client->ta.req_payload[client->ta.req_payload_pos], remaining_payload);
+    if (remaining_payload) {
+        memmove(client->req_headers, &client->ta.req_payload[client->ta.req_payload_pos], remaining_payload);
+    } else {
+        release_request_headers(client);
+    }
     client->req_headers_len = remaining_payload;
     cleanup_client(client);
 }
@@ -104,6 +228,8 @@ void kitserv_http_finalize_transaction(struct kitserv_client* client)
 void kitserv_http_reset_client(struct kitserv_client* client)
 {
     client->req_headers_len = 0;
+    client->num_transactions = 0;
+    release_request_headers(client);
     cleanup_client(client);
 }
 
@@ -134,6 +260,38 @@ static inline void close_fd_to_zero(int* fd)
     }
 }
 
+/**
+ * Drop a use of a worker's hold on a snapshot, releasing the snapshot along with the last one.
+ */
+static void snapshot_release(struct snapshot_hold* hold)
+{
+    if (--hold->users == 0) {
+        kitserv_manifest_release(hold->manifest);
+        free(hold);
+    }
+}
+
+void kitserv_http_release_resp_fd(struct kitserv_client* client)
+{
+    if (client->ta.resp_cached) {
+        kitserv_bodycache_release(client->ta.resp_cached);
+        client->ta.resp_cached = NULL;
+    }
+    if (client->ta.resp_file) {
+        // shared with other transactions through the file cache
+        kitserv_filecache_release(client->ta.resp_file);
+        client->ta.resp_file = NULL;
+        client->ta.resp_fd = 0;
+    } else if (client->ta.resp_snapshot) {
+        // belongs to the snapshot
+        snapshot_release(client->ta.resp_snapshot);
+        client->ta.resp_snapshot = NULL;
+        client->ta.resp_fd = 0;
+    } else {
+        close_fd_to_zero(&client->ta.resp_fd);
+    }
+}
+
 /**
  * Append to buf at the given offset (which is incremented), respecting max.
  * Returns 0 on success, -1 on failure.
@@ -150,21 +308,6 @@ static inline int str_appendva(char* buf, size_t* offset, size_t max, const char
     return 0;
 }
 
-/**
- * Append to buf at the given offset (which is incremented), respecting max.
- * Returns 0 on success, -1 on failure.
- * *offset is not incremented on failure, but buf[offset..max] is undefined.
- */
-static int str_append(char* buf, size_t* offset, size_t max, char* fmt, ...)
-{
-    va_list ap;
-    int rc;
-    va_start(ap, fmt);
-    rc = str_appendva(buf, offset, max, fmt, &ap);
-    va_end(ap);
-    return rc;
-}
-
 /**
  * Returns true if the given path contains attempted path traversal - /../ or similar
  */
@@ -190,30 +333,52 @@ static inline bool status_is_error(enum kitserv_http_response_status status)
     return status >= 400;
 }
 
+static int parse_header_accept_encoding(struct kitserv_client* client, char* value)
+{
+    // Accept-Encoding: CODING[;q=QVALUE], ...
+    client->ta.req_encodings = kitserv_encoding_parse_accept(value);
+    return 0;
+}
+
 static int parse_header_cookie(struct kitserv_client* client, char* value)
 {
-    client->ta.req_fresh_cookies = value;
+    kitserv_http_ta_cold(client)->req_fresh_cookies = value;
     return 0;
 }
 
 static int parse_header_range(struct kitserv_client* client, char* value)
 {
-    client->ta.range_requested = true;
-    client->ta.req_range = value;
+    kitserv_http_ta_cold(client)->range_requested = true;
+    kitserv_http_ta_cold(client)->req_range = value;
     return 0;
 }
 
 static int parse_header_if_modified_since(struct kitserv_client* client, char* value)
 {
     // If-Modified-Since: DAYNAME, DAY MONTH YEAR HH:MM:SS GMT
-    client->ta.req_modified_since = value;
+    kitserv_http_ta_cold(client)->req_modified_since = value;
+    return 0;
+}
+
+static int parse_header_if_none_match(struct kitserv_client* client, char* value)
+{
+    // If-None-Match: "ETAG", W/"ETAG", ... or *
+    kitserv_http_ta_cold(client)->req_if_none_match = value;
+    return 0;
+}
+
+static int parse_header_if_range(struct kitserv_client* client, char* value)
+{
+    // If-Range: "ETAG" or DAYNAME, DAY MONTH YEAR HH:MM:SS GMT
+    kitserv_http_ta_cold(client)->req_if_range = value;
     return 0;
 }
 
 static int parse_header_content_length(struct kitserv_client* client, char* value)
 {
     // Content-Length: LENGTH
-    if (strtonum(value, &client->ta.req_content_len) || client->ta.req_content_len < 0) {
+    struct http_transaction_cold* cold = kitserv_http_ta_cold(client);
+    if (strtonum(value, &cold->req_content_len) || cold->req_content_len < 0) {
         goto bad_request;
     }
     return 0;
@@ -225,14 +390,14 @@ bad_request:
 static int parse_header_content_type(struct kitserv_client* client, char* value)
 {
     // Content-Type: MIME/TYPE
-    client->ta.req_mimetype = value;
+    kitserv_http_ta_cold(client)->req_mimetype = value;
     return 0;
 }
 
 static int parse_header_content_disposition(struct kitserv_client* client, char* value)
 {
     // Content-Disposition: attachment; filename=FILENAME
-    client->ta.req_disposition = value;
+    kitserv_http_ta_cold(client)->req_disposition = value;
     return 0;
 }
 
@@ -243,26 +408,61 @@ struct header {
                 char* value); /* returns 0 on successs, -1 on error, setting resp_status */
 };
 
-#define HEADERS_NUM (6)
+#define HEADERS_NUM (9)
 static const struct header headers[] = {
+    {.name = "accept-encoding", .len = 15, .func = parse_header_accept_encoding},
     {.name = "cookie", .len = 6, .func = parse_header_cookie},
     {.name = "range", .len = 5, .func = parse_header_range},
     {.name = "if-modified-since", .len = 17, .func = parse_header_if_modified_since},
+    {.name = "if-none-match", .len = 13, .func = parse_header_if_none_match},
+    {.name = "if-range", .len = 8, .func = parse_header_if_range},
     {.name = "content-length", .len = 14, .func = parse_header_content_length},
     {.name = "content-type", .len = 12, .func = parse_header_content_type},
     {.name = "content-disposition", .len = 19, .func = parse_header_content_disposition},
 };
 
+/**
+ * Known headers, by the hash of their (lowercase) name, which must be perfect over headers[].
+ * If a new header collides, change HEADER_HASH_MULT or grow the table - header_table_init will say so.
+ */
+#define HEADER_TABLE_BITS (6)
+#define HEADER_TABLE_MASK ((1u << HEADER_TABLE_BITS) - 1)
+#define HEADER_HASH_MULT (31u)
+#define header_hash_step(hash, c) ((hash)*HEADER_HASH_MULT ^ (unsigned char)(c))
+static const struct header* header_table[HEADER_TABLE_MASK + 1];
+
+static void header_table_init(void)
+{
+    unsigned int hash;
+    int i, j;
+
+    for (i = 0; i < HEADERS_NUM; i++) {
+        hash = 0;
+        for (j = 0; j < headers[i].len; j++) {
+            assert(!isupper(headers[i].name[j]));
+            hash = header_hash_step(hash, headers[i].name[j]);
+        }
+        if (header_table[hash & HEADER_TABLE_MASK]) {
+            fprintf(stderr, "Header hash collision: %s and %s\n", headers[i].name,
+                    header_table[hash & HEADER_TABLE_MASK]->name);
+            abort();
+        }
+        header_table[hash & HEADER_TABLE_MASK] = &headers[i];
+    }
+}
+
 int kitserv_http_parse_cookies(struct kitserv_client* client)
 {
     // Cookie: NAME=VALUE; NAME=VALUE
 
-    char* p = client->ta.req_fresh_cookies;
+    char* p = client->ta_cold.req_fresh_cookies;
     char* r;  // =, then value
     char* q;  // ; or NULL if end
     int cookie_index = 0;
 
-    assert(client->req_cookies != NULL);
+    if (!client->req_cookies && !(client->req_cookies = kitserv_bufpool_get(&client->worker->bufs))) {
+        return -1;
+    }
 
     /*  name=value;
      *  ^    ^    ^
@@ -280,7 +480,7 @@ int kitserv_http_parse_cookies(struct kitserv_client* client)
         r = strchr(p, '=');
         if (!r) {
             // saw something weird, discard this header without saving cookies
-            client->ta.req_fresh_cookies = NULL;
+            kitserv_http_ta_cold(client)->req_fresh_cookies = NULL;
             return -1;
         }
         q = strchr(r, ';');
@@ -312,164 +512,199 @@ int kitserv_http_parse_cookies(struct kitserv_client* client)
 
 finished:
     // commit all of our spotted cookies
-    client->ta.req_num_cookies = cookie_index;
-    client->ta.req_fresh_cookies = NULL;
+    kitserv_http_ta_cold(client)->req_num_cookies = cookie_index;
+    kitserv_http_ta_cold(client)->req_fresh_cookies = NULL;
     return 0;
 }
 
-int kitserv_http_parse_range(struct kitserv_client* client, off_t* out_from, off_t* out_to)
+int kitserv_http_parse_query(struct kitserv_client* client)
 {
-    char* p = client->ta.req_range;
-    char* q = NULL;
-    char* r;
-    char* hyphen = NULL;
-    off_t from = -1;
-    off_t to = -1;
-
-    if (!client->ta.range_requested) {
+    if (client->req_query_index) {
+        return 0;
+    }
+    client->req_query_index = kitserv_bufpool_get(&client->worker->bufs);
+    if (!client->req_query_index) {
         return -1;
     }
+    kitserv_query_index(client->req_query_index, HTTP_BUFSZ, client->ta_cold.req_query);
+    return 0;
+}
 
-    if (strncmp(p, "bytes=", 6)) {
+/**
+ * Parse a byte offset of a range at *p, advancing *p past it.
+ * Returns 0 on success, -1 if there are no digits, or too many of them for an off_t.
+ */
+static int parse_range_offset(const char** p, off_t* out)
+{
+    const char* s = *p;
+    off_t n = 0;
+
+    if (*s < '0' || *s > '9') {
         return -1;
     }
-    p += 6;
-
-    // find the position of the hyphen, set p to before and q after
-    for (r = p; *r != '\0'; r++) {
-        if (*r < '0' || *r > '9') {
-            if (*r == '-') {
-                if (hyphen) {
-                    return -1;  // two hyphens
-                }
-                hyphen = r;
-            } else {
-                // a comma means multipart - we don't support that, so throw it in with the rest
-                return -1;
-            }
+    for (; *s >= '0' && *s <= '9'; s++) {
+        if (n > (INT64_MAX - (*s - '0')) / 10) {
+            return -1;
         }
+        n = n * 10 + (*s - '0');
+    }
+    *p = s;
+    *out = n;
+    return 0;
+}
+
+/**
+ * Parse one range of a Range header at *p (XXX-YYY, XXX- or -YYY), advancing *p past it.
+ * Sets *from and *to as kitserv_http_parse_range does.
+ * Returns 0 on success, -1 if it is malformed.
+ */
+static int parse_range_spec(const char** p, off_t* from, off_t* to)
+{
+    *from = -1;
+    *to = -1;
+    if (**p != '-' && parse_range_offset(p, from)) {
+        return -1;
     }
-    if (!hyphen) {
+    if (**p != '-') {
         return -1;
     }
-
-    if (p == hyphen) {
-        // i.e. bytes=-YYY
-        p = NULL;
+    (*p)++;
+    if (*from < 0) {
+        // bytes=-YYY (and mm yes `bytes=-`, very good)
+        return parse_range_offset(p, to);
     }
-    if (hyphen[1] != '\0') {
-        q = hyphen + 1;
+    if (**p >= '0' && **p <= '9' && (parse_range_offset(p, to) || *to < *from)) {
+        return -1;
     }
+    return 0;
+}
 
-    // parse individual sections
-    if (p) {
-        *hyphen = '\0';  // cap off p
-        // bytes=XXX- or bytes=XXX-YYY
-        if (strtonum(p, &from)) {
-            goto err;
-        }
-        if (q) {
-            // bytes=XXX-YYY
-            if (strtonum(q, &to)) {
-                goto err;
-            }
-            if (to < from) {
-                goto err;
-            }
-        }
-    } else if (q) {
-        // bytes=-YYY
-        if (strtonum(q, &to)) {
-            goto err;
-        }
-    } else {
-        // mm yes `bytes=-`, very good
-        goto err;
+int kitserv_http_parse_range(struct kitserv_client* client, off_t* out_from, off_t* out_to)
+{
+    const char* p = client->ta_cold.req_range;
+    off_t from, to;
+
+    if (!client->ta_cold.range_requested || strncmp(p, "bytes=", 6)) {
+        return -1;
     }
+    p += 6;
 
-    *hyphen = '-';
+    // anything after the range (such as a comma, for several of them) can't be described here
+    if (parse_range_spec(&p, &from, &to) || *p != '\0') {
+        return -1;
+    }
     *out_from = from;
     *out_to = to;
     return 0;
-err:
-    *hyphen = '-';
-    return -1;
 }
 
 /**
- * Parse the range request of a client, setting resp_body_pos and resp_body_end fields appropriately (only on success).
- * Assumes `client->ta.range_requested` is true, and `client->ta.req_range` is set.
- * Returns -1 if the range is malformed (or multipart), setting `client->ta.resp_status` (resp_body_* unchanged).
+ * Resolve a range from parse_range_spec against a file of the given size, clamping its end to that of the file.
+ * Returns true if it is satisfiable (with *from and *to set to the first and last byte to send), false otherwise.
+ */
+static bool resolve_range(off_t* from, off_t* to, off_t filesize)
+{
+    if (*from < 0) {
+        // bytes=-YYY, the last YYY bytes
+        if (*to == 0 || filesize == 0) {
+            return false;
+        }
+        *from = *to < filesize ? filesize - *to : 0;
+    } else if (*from >= filesize) {
+        return false;
+    } else if (*to >= 0 && *to < filesize) {
+        return true;
+    }
+    *to = filesize - 1;
+    return true;
+}
+
+/**
+ * Parse the range request of a client against a file of the given size, leaving out the ranges it can't satisfy.
+ * Assumes `client->ta_cold.range_requested` is true, and `client->ta_cold.req_range` is set.
+ * A single range sets resp_body_pos and resp_body_end. Several are put in client->resp_ranges in order, with those
+ * that overlap or nearly touch merged, so that asking for the same bytes over and over costs no more than asking for
+ * them once.
+ * Returns the number of ranges, 0 if the header should be ignored (it is malformed, or asks for more ranges than
+ * allowed), or -1 on error with resp_status set (416 if none of the ranges are satisfiable).
  */
 static int parse_range_request(struct kitserv_client* client, off_t filesize)
 {
+    const char* p = client->ta_cold.req_range;
+    struct http_range* ranges;
+    int num_specs = 0;
+    int num = 0;
+    int i, j;
     off_t from, to;
 
-    if (kitserv_http_parse_range(client, &from, &to)) {
-        client->ta.resp_status = HTTP_400_BAD_REQUEST;
-        return -1;
+    if (strncmp(p, "bytes=", 6)) {
+        return 0;
     }
+    p += 6;
 
-    // bytes=XXX- or needs clamping
-    if (to < 0 || to > filesize - 1) {
-        to = filesize - 1;
+    ranges = client->resp_ranges;
+    if (strchr(p, ',') && !ranges && !(ranges = client->resp_ranges = kitserv_bufpool_get(&client->worker->bufs))) {
+        client->ta.resp_status = HTTP_500_INTERNAL_ERROR;
+        return -1;
     }
 
-    // bytes=-YYY
-    if (from < 0) {
-        from = filesize - to;
-        to = filesize - 1;
-    } else if (from > filesize) {
+    while (1) {
+        // a list may have empty elements, and whitespace around its commas
+        while (*p == ',' || *p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if (parse_range_spec(&p, &from, &to) || ++num_specs > client->worker->config->max_ranges) {
+            return 0;
+        }
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p != ',' && *p != '\0') {
+            return 0;
+        }
+        if (!resolve_range(&from, &to, filesize)) {
+            continue;
+        }
+        if (!ranges) {
+            // no comma, so this is the only one
+            client->ta.resp_body_pos = from;
+            client->ta.resp_body_end = to;
+            return 1;
+        }
+        for (i = num; i > 0 && ranges[i - 1].from > from; i--) {
+            ranges[i] = ranges[i - 1];
+        }
+        ranges[i].from = from;
+        ranges[i].to = to;
+        num++;
+    }
+    if (num_specs == 0) {
+        return 0;
+    }
+    if (num == 0) {
         client->ta.resp_status = HTTP_416_RANGE_NOT_SATISFIABLE;
         return -1;
     }
 
-    client->ta.resp_body_pos = from;
-    client->ta.resp_body_end = to;
-    return 0;
-}
-
-/**
- * Guess the mime type from a limited list.
- * On null, return application/octet-stream.
- */
-static const char* guess_mime_type(const char* extension)
-{
-    // TODO: get a better system for this
-
-    if (extension == NULL) {
-        return "application/octet-stream";
-    } else if (!strcasecmp(extension, ".js")) {
-        return "text/javascript";
-    } else if (!strcasecmp(extension, ".html")) {
-        return "text/html";
-    } else if (!strcasecmp(extension, ".htm")) {
-        return "text/html";
-    } else if (!strcasecmp(extension, ".css")) {
-        return "text/css";
-    } else if (!strcasecmp(extension, ".json")) {
-        return "application/json";
-    } else if (!strcasecmp(extension, ".svg")) {
-        return "image/svg+xml";
-    } else if (!strcasecmp(extension, ".png")) {
-        return "image/png";
-    } else if (!strcasecmp(extension, ".jpg")) {
-        return "image/jpeg";
-    } else if (!strcasecmp(extension, ".jpeg")) {
-        return "image/jpeg";
-    } else if (!strcasecmp(extension, ".txt")) {
-        return "text/plain";
-    } else if (!strcasecmp(extension, ".md")) {
-        return "text/plain";
-    } else if (!strcasecmp(extension, ".gif")) {
-        return "image/gif";
-    } else if (!strcasecmp(extension, ".mp4")) {
-        return "video/mp4";
-    } else if (!strcasecmp(extension, ".zip")) {
-        return "applicaton/zip";
-    }
-
-    return "application/octet-stream";
+    // a gap that is shorter than the headers of another part is cheaper to send along
+    for (i = 0, j = 1; j < num; j++) {
+        if (ranges[j].from - ranges[i].to <= RANGE_MERGE_GAP) {
+            if (ranges[j].to > ranges[i].to) {
+                ranges[i].to = ranges[j].to;
+            }
+        } else {
+            ranges[++i] = ranges[j];
+        }
+    }
+    num = i + 1;
+    if (num == 1) {
+        client->ta.resp_body_pos = ranges[0].from;
+        client->ta.resp_body_end = ranges[0].to;
+    }
+    return num;
 }
 
 /**
@@ -495,25 +730,44 @@ static void url_decode(char* str)
     *r = '\0';
 }
 
+int kitserv_http_decode_query(struct kitserv_client* client)
+{
+    const char* query = client->ta_cold.req_query;
+
+    if (client->req_query_decoded || !query) {
+        return 0;
+    }
+    // the query came out of req_headers, so it fits in a buffer of the same size
+    client->req_query_decoded = kitserv_bufpool_get(&client->worker->bufs);
+    if (!client->req_query_decoded) {
+        return -1;
+    }
+    memcpy(client->req_query_decoded, query, strlen(query) + 1);
+    url_decode(client->req_query_decoded);
+    return 0;
+}
+
 static inline int http_header_add_ap(struct kitserv_client* client, const char* key, const char* fmt, va_list* ap)
 {
-    int pre_sz;
-    pre_sz = client->ta.resp_bufs[1].iov_len;
+    size_t pre_sz = client->ta.resp_bufs[1].iov_len;
+    size_t keylen = strlen(key);
 
-    // append key
-    if (str_append(client->resp_headers, &client->ta.resp_bufs[1].iov_len, HTTP_BUFSZ, "%s: ", key)) {
+    // append key (the value needs at least the EOL after it, so leave room for that too)
+    if (pre_sz + keylen + 2 + 2 > HTTP_BUFSZ) {
         goto too_large;
     }
+    memcpy(&client->resp_headers[pre_sz], key, keylen);
+    memcpy(&client->resp_headers[pre_sz + keylen], ": ", 2);
+    client->ta.resp_bufs[1].iov_len += keylen + 2;
 
     // append value
-    if (str_appendva(client->resp_headers, &client->ta.resp_bufs[1].iov_len, HTTP_BUFSZ, fmt, ap)) {
+    if (str_appendva(client->resp_headers, &client->ta.resp_bufs[1].iov_len, HTTP_BUFSZ - 2, fmt, ap)) {
         goto too_large;
     }
 
     // append EOL
-    if (str_append(client->resp_headers, &client->ta.resp_bufs[1].iov_len, HTTP_BUFSZ, "\r\n")) {
-        goto too_large;
-    }
+    memcpy(&client->resp_headers[client->ta.resp_bufs[1].iov_len], "\r\n", 2);
+    client->ta.resp_bufs[1].iov_len += 2;
     return 0;
 
 too_large:
@@ -534,6 +788,22 @@ int kitserv_http_header_add(struct kitserv_client* client, const char* key, cons
     return ret;
 }
 
+/**
+ * Append preformatted headers (each ending in CRLF) of length len.
+ * Returns 0 on success, -1 on failure.
+ */
+static int http_header_add_block(struct kitserv_client* client, const char* headers, int len)
+{
+    if (client->ta.resp_bufs[1].iov_len + len > HTTP_BUFSZ) {
+        errno = ENOMEM;
+        client->ta.resp_status = HTTP_507_INSUFFICIENT_STORAGE;
+        return -1;
+    }
+    memcpy(&client->resp_headers[client->ta.resp_bufs[1].iov_len], headers, len);
+    client->ta.resp_bufs[1].iov_len += len;
+    return 0;
+}
+
 int kitserv_http_header_add_content_type(struct kitserv_client* client, const char* mime)
 {
     return kitserv_http_header_add(client, "content-type", "%s", mime);
@@ -541,18 +811,15 @@ int kitserv_http_header_add_content_type(struct kitserv_client* client, const ch
 
 int kitserv_http_header_add_content_type_guess(struct kitserv_client* client, const char* extension)
 {
-    return kitserv_http_header_add(client, "content-type", "%s", guess_mime_type(extension));
+    return kitserv_http_header_add(client, "content-type", "%s", kitserv_mime_lookup(extension)->name);
 }
 
 int kitserv_http_header_add_last_modified(struct kitserv_client* client, time_t time)
 {
     // take time_t from (struct stat).st_mtim.tv_sec
-    struct tm tm;
-    char buf[32];
-    if (!gmtime_r(&time, &tm) || !strftime(buf, 32, "%a, %d %b %Y %T GMT", &tm)) {
-        return -1;
-    }
-    return kitserv_http_header_add(client, "last-modified", "%s", buf);
+    char buf[HTTPDATE_LEN];
+    kitserv_httpdate_format(buf, time);
+    return kitserv_http_header_add(client, "last-modified", "%.*s", HTTPDATE_LEN, buf);
 }
 
 static inline int http_header_add_content_range(struct kitserv_client* client, off_t start, off_t end, off_t total)
@@ -560,9 +827,45 @@ static inline int http_header_add_content_range(struct kitserv_client* client, o
     return kitserv_http_header_add(client, "content-range", "bytes %ld-%ld/%ld", start, end, total);
 }
 
-static inline int http_header_add_content_length(struct kitserv_client* client, off_t length)
+/**
+ * Write the decimal digits of n into buf (of at least 20 bytes), without a terminator.
+ * Returns the number of digits.
+ */
+static inline int format_decimal(char* buf, uint64_t n)
+{
+    char digits[20];
+    int i = sizeof(digits);
+
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    memcpy(buf, &digits[i], sizeof(digits) - i);
+    return sizeof(digits) - i;
+}
+
+/**
+ * Finish the headers of a response: content-length, date, server, and the blank line.
+ * Every response ends the same way, so this copies a template around the length instead of formatting it all (with
+ * the worker's copy of the rest, already dated).
+ * Returns 0 on success, -1 on failure (with resp_status set).
+ */
+static int http_header_add_final(struct kitserv_client* client, off_t length)
 {
-    return kitserv_http_header_add(client, "content-length", "%ld", length);
+    static const char prefix[] = "content-length: ";
+    size_t len = client->ta.resp_bufs[1].iov_len;
+
+    if (len + sizeof(prefix) - 1 + 20 + sizeof(headers_tail) - 1 > HTTP_BUFSZ) {
+        errno = ENOMEM;
+        client->ta.resp_status = HTTP_507_INSUFFICIENT_STORAGE;
+        return -1;
+    }
+    memcpy(&client->resp_headers[len], prefix, sizeof(prefix) - 1);
+    len += sizeof(prefix) - 1;
+    len += format_decimal(&client->resp_headers[len], length);
+    memcpy(&client->resp_headers[len], client->worker->headers_tail, sizeof(headers_tail) - 1);
+    client->ta.resp_bufs[1].iov_len = len + sizeof(headers_tail) - 1;
+    return 0;
 }
 
 static int http_header_add_allow(struct kitserv_client* client)
@@ -571,18 +874,18 @@ static int http_header_add_allow(struct kitserv_client* client)
     char allow_body[ALLOW_BODY_MAX];
     int len = 0;
 
-    if (client->ta.api_allow_flags != 0) {
+    if (client->ta_cold.api_allow_flags != 0) {
         // we set allow flags when parsing the tree, so extract what the legal ones for that endpoint are
-        if (client->ta.api_allow_flags & HTTP_GET) {
+        if (client->ta_cold.api_allow_flags & HTTP_GET) {
             len += snprintf(&allow_body[len], ALLOW_BODY_MAX - len, "GET, HEAD, ");
         }
-        if (client->ta.api_allow_flags & HTTP_PUT) {
+        if (client->ta_cold.api_allow_flags & HTTP_PUT) {
             len += snprintf(&allow_body[len], ALLOW_BODY_MAX - len, "PUT, ");
         }
-        if (client->ta.api_allow_flags & HTTP_POST) {
+        if (client->ta_cold.api_allow_flags & HTTP_POST) {
             len += snprintf(&allow_body[len], ALLOW_BODY_MAX - len, "POST, ");
         }
-        if (client->ta.api_allow_flags & HTTP_DELETE) {
+        if (client->ta_cold.api_allow_flags & HTTP_DELETE) {
             len += snprintf(&allow_body[len], ALLOW_BODY_MAX - len, "DELETE, ");
         }
         assert(len > 2);
@@ -595,18 +898,30 @@ static int http_header_add_allow(struct kitserv_client* client)
 
 int kitserv_http_recv_request(struct kitserv_client* client)
 {
-    int readrc, i;
+    int readrc;
+    unsigned int hash;             // of the header name
+    const struct header* header;  // known header that the name may be
     char* p = client->ta.req_parse_blk;   // beginning of unconsumed block
     char* r = client->ta.req_parse_iter;  // segment iterator
     char *q, *s;                          // extra iters - in between p and r
 
 #define parse_past_end(ptr) (ptr - client->req_headers >= client->req_headers_len)
+#define parse_end (client->req_headers + client->req_headers_len)
 #define parse_advance \
     do {              \
         r++;          \
         p = r;        \
     } while (0)
 
+    if (!client->req_headers) {
+        // nothing was carried over from a previous request, so this is the start of a new one
+        client->req_headers = kitserv_bufpool_get(&client->worker->bufs);
+        if (!client->req_headers) {
+            client->ta.resp_status = HTTP_X_HANGUP;
+            return -1;
+        }
+    }
+
     /* before jumping here, set the parse state to wherever you came from */
 read_more:
     readrc = read(client->sockfd, &client->req_headers[client->req_headers_len], HTTP_BUFSZ - client->req_headers_len);
@@ -621,6 +936,12 @@ read_more:
         if (readrc != 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 if (parse_past_end(r)) {
+                    if (client->req_headers_len == 0) {
+                        // woken up without a request after all, don't hold a buffer while waiting for one
+                        release_request_headers(client);
+                        client->ta.parse_state = HTTP_PS_NEW;
+                        return 0;
+                    }
                     client->ta.req_parse_blk = p;
                     client->ta.req_parse_iter = r;
                     return 0;
@@ -654,8 +975,7 @@ read_more:
 
         case HTTP_PS_REQ_METHOD:
             /* 'GET ' */
-            for (; !parse_past_end(r) && *r != ' '; r++)
-                ;
+            r = kitserv_scan_char(r, parse_end, ' ');
             if (parse_past_end(r)) {
                 client->ta.parse_state = HTTP_PS_REQ_METHOD;
                 goto read_more;
@@ -699,26 +1019,20 @@ method_not_recognized:
              *  ^            ^     ^
              *  p            s     r/q
              */
-            for (; !parse_past_end(r) && *r != ' '; r++)
-                ;
+            r = kitserv_scan_char(r, parse_end, ' ');
             if (parse_past_end(r)) {
                 client->ta.parse_state = HTTP_PS_REQ_PATH;
                 goto read_more;
             }
-            s = NULL;
-            for (q = p; q < r; q++) {
-                if (!isprint(*q)) {
-                    goto bad_request;
-                }
-                if (!s && *q == '?') {
-                    s = q;
-                }
+            if (kitserv_scan_nonprint(p, r) != r) {
+                goto bad_request;
             }
+            s = kitserv_scan_char(p, r, '?');
             *r = '\0';
-            if (s) {
+            if (s != r) {
                 *s = '\0';
-                url_decode(s + 1);
-                client->ta.req_query = s + 1;
+                // left encoded, so that escaped '&' and '=' can be told apart from separators when it is split
+                kitserv_http_ta_cold(client)->req_query = s + 1;
             }
             url_decode(p);
             client->ta.req_path = p;
@@ -730,8 +1044,7 @@ method_not_recognized:
 
         case HTTP_PS_REQ_VERSION:
             /* 'HTTP/1.1\r' */
-            for (; !parse_past_end(r) && *r != '\r'; r++)
-                ;
+            r = kitserv_scan_char(r, parse_end, '\r');
             if (parse_past_end(r)) {
                 client->ta.parse_state = HTTP_PS_REQ_VERSION;
                 goto read_more;
@@ -772,8 +1085,7 @@ method_not_recognized:
         case HTTP_PS_REQ_HEAD:
 parse_header:
             /* 'Header: value\r' or simply '\r' if no more */
-            for (; !parse_past_end(r) && *r != '\r'; r++)
-                ;
+            r = kitserv_scan_char(r, parse_end, '\r');
             if (parse_past_end(r)) {
                 client->ta.parse_state = HTTP_PS_REQ_HEAD;
                 goto read_more;
@@ -784,26 +1096,29 @@ parse_header:
                  *  ^     ^  ^    ^
                  *  p     s  q    r
                  */
-                // split off this header into its own string
-                *r = '\0';
-                // separate name/value
-                q = strchr(p, ':');
-                if (!q) {
+                // separate name/value, lowercasing and hashing the name on the way
+                hash = 0;
+                for (q = p; q < r && *q != ':'; q++) {
+                    if (*q >= 'A' && *q <= 'Z') {
+                        *q += 'a' - 'A';
+                    }
+                    hash = header_hash_step(hash, *q);
+                }
+                if (q == r) {
                     goto bad_request;
                 }
+                // split off this header into its own string
+                *r = '\0';
                 *q = '\0';
                 s = q;
                 // skip whitespace
                 for (q++; *q == ' ' || *q == '\t'; q++)
                     ;
                 // process the header if it's one we care about
-                for (i = 0; i < HEADERS_NUM; i++) {
-                    if (s - p == headers[i].len && !strcasecmp(p, headers[i].name)) {
-                        if (headers[i].func(client, q)) {
-                            return -1;
-                        }
-                        break;
-                    }
+                header = header_table[hash & HEADER_TABLE_MASK];
+                if (header && s - p == header->len && !memcmp(p, header->name, header->len) &&
+                    header->func(client, q)) {
+                    return -1;
                 }
                 parse_advance;
             } else {
@@ -848,149 +1163,303 @@ bad_request:
     return -1;
 
 #undef parse_past_end
+#undef parse_end
 #undef parse_advance
 }
 
 /**
- * Verify a given path, stat'ing it into *st
- * Returns 0 on success, or -1 on error (catastrophic errors also set resp_status)
- * assumed_pathlen is the size that path was attempted to be, which may be either invalid or too long (>= PATH_MAX)
- * (if it is so, then the status is set as 414_URI_TOO_LONG)
+ * Format the headers of a static file into buf (of size max): etag, content-type, accept-ranges and last-modified,
+ * followed by content-encoding if it is sent in key->encoding, and vary if its encoding depends on Accept-Encoding.
+ * The etag is strong, derived from the version of the file that key identifies (and its encoding), and always comes
+ * first (see header_block_etag).
+ * The type is looked up from extension (see kitserv_mime_lookup), which is that of the original file (NULL for none).
+ * Returns the length of the headers, or -1 if they don't fit.
  */
-static int verify_static_path(struct stat* st, struct kitserv_client* client, int assumed_pathlen, char* path)
+static int format_file_headers(char* buf, int max, const char* extension, const struct body_key* key, bool vary)
 {
-    if (assumed_pathlen < 0 || assumed_pathlen >= PATH_MAX) {
-        errno = ENAMETOOLONG;
-        client->ta.resp_status = HTTP_414_URI_TOO_LONG;
-    } else if (!stat(path, st) && S_ISREG(st->st_mode)) {
+    unsigned long long mtime_ns;
+    char modified[HTTPDATE_LEN];
+    int len;
+
+    kitserv_httpdate_format(modified, key->mtime.tv_sec);
+    mtime_ns = (unsigned long long)key->mtime.tv_sec * 1000000000 + key->mtime.tv_nsec;
+    len = snprintf(buf, max, "etag: \"%lx-%llx-%lx%s%s\"\r\ncontent-type: %s\r\naccept-ranges: bytes\r\n"
+                   "last-modified: %.*s\r\n",
+                   (unsigned long)key->ino, mtime_ns, (unsigned long)key->size,
+                   key->encoding != ENCODING_IDENTITY ? "-" : "",
+                   key->encoding != ENCODING_IDENTITY ? kitserv_encoding_name(key->encoding) : "",
+                   kitserv_mime_lookup(extension)->name, HTTPDATE_LEN, modified);
+    if (len >= 0 && len < max && key->encoding != ENCODING_IDENTITY) {
+        len += snprintf(&buf[len], max - len, "content-encoding: %s\r\n", kitserv_encoding_name(key->encoding));
+    }
+    if (len >= 0 && len < max && vary) {
+        len += snprintf(&buf[len], max - len, "vary: accept-encoding\r\n");
+    }
+    return len >= 0 && len < max ? len : -1;
+}
+
+/**
+ * Find the etag at the start of headers (of length len) from format_file_headers.
+ * Returns its length (with its quotes), pointing *etag to it, or 0 if there is none.
+ */
+static int header_block_etag(const char* headers, int len, const char** etag)
+{
+    const char* end;
+
+    if (len < 6 || memcmp(headers, "etag: ", 6) || !(end = memchr(&headers[6], '\r', len - 6))) {
         return 0;
     }
-    if (errno == EACCES) {
-        client->ta.resp_status = HTTP_403_PERMISSION_DENIED;
-    }
-    return -1;
+    *etag = &headers[6];
+    return end - *etag;
 }
 
-int kitserv_http_handle_static_path(struct kitserv_client* client, const char* path,
-                                    struct kitserv_request_context* ctx)
+/**
+ * Find the header with the given name (with its colon and space, as in "content-type: ") in headers (of length len)
+ * from format_file_headers.
+ * Returns the length of its line (with the CRLF), pointing *line to it, or 0 if there is none (pointing *line past the
+ * end of the headers).
+ */
+static int header_block_line(const char* headers, int len, const char* name, const char** line)
 {
-    char fname[PATH_MAX];
-    struct stat st;
-    struct tm tm;
-    int rc;
-
-    if (!ctx) {
-        ctx = default_context;
+    const char* p = headers;
+    const char* end = &headers[len];
+    const char* eol;
+    int name_len = strlen(name);
+
+    for (; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1) {
+        if (end - p >= name_len && !strncasecmp(p, name, name_len)) {
+            *line = p;
+            return eol + 1 - p;
+        }
     }
+    *line = end;
+    return 0;
+}
 
-    if (!(client->ta.req_method & HTTP_GET)) {
-        // we only allow GET or HEAD here
-        errno = ENOTSUP;
-        client->ta.resp_status = HTTP_405_METHOD_NOT_ALLOWED;
-        return -1;
+/**
+ * Returns true if a list of entity tags (as in If-None-Match, or a single one as in If-Range) includes etag (of length
+ * len, with its quotes). Weak comparison ignores whether the client's tags are weak, strong comparison never matches a
+ * weak one. A * matches anything, under weak comparison.
+ */
+static bool etag_list_matches(const char* value, const char* etag, int len, bool weak)
+{
+    const char* tag;
+    bool tag_weak;
+
+    while (*value) {
+        if (*value == ',' || *value == ' ' || *value == '\t') {
+            value++;
+            continue;
+        }
+        if (*value == '*') {
+            return weak;
+        }
+        tag_weak = value[0] == 'W' && value[1] == '/';
+        value += tag_weak ? 2 : 0;
+        tag = value;
+        if (*value == '"') {
+            value = strchr(&value[1], '"');
+            if (!value) {
+                return false;
+            }
+            value++;
+        }
+        if (value - tag == len && !memcmp(tag, etag, len) && (weak || !tag_weak)) {
+            return true;
+        }
+        // skip whatever else was in this element
+        while (*value && *value != ',') {
+            value++;
+        }
     }
+    return false;
+}
 
-    // regular direct path or the root fallback
-    if (!strcmp(client->ta.req_path, "/") && ctx->root_fallback) {
-        rc = snprintf(fname, PATH_MAX, "%s/%s", ctx->root, ctx->root_fallback);
-    } else {
-        rc = snprintf(fname, PATH_MAX, "%s/%s", ctx->root, path);
+/**
+ * Check whether the client's copy of a static file is current, by If-None-Match against its etag (of length
+ * etag_len, 0 if it has none), or failing that, by If-Modified-Since against its modification time.
+ * Returns 1 if it is (so the file needn't be sent), 0 if it is not, or -1 if If-Modified-Since is malformed.
+ */
+static int check_not_modified(struct kitserv_client* client, const char* etag, int etag_len, time_t mtime)
+{
+    time_t since;
+
+    if (client->ta_cold.req_if_none_match) {
+        // If-Modified-Since is ignored then, since the etag is exact
+        return etag_len && etag_list_matches(client->ta_cold.req_if_none_match, etag, etag_len, true);
     }
-    if (verify_static_path(&st, client, rc, fname)) {
-        if (client->ta.resp_status) {
+    if (client->ta_cold.req_modified_since) {
+        if (kitserv_httpdate_parse(client->ta_cold.req_modified_since, &since)) {
             return -1;
         }
-    } else {
-        goto path_set;
+        return mtime <= since;
     }
+    return 0;
+}
 
-    // failed standard, append .html and see if it exists
-    if (ctx->use_http_append_fallback) {
-        rc = snprintf(fname, PATH_MAX, "%s/%s.html", ctx->root, path);
-        if (verify_static_path(&st, client, rc, fname)) {
-            if (client->ta.resp_status) {
-                return -1;
-            }
-        } else {
-            goto path_set;
-        }
+/**
+ * Returns true if a range of a static file may be sent according to If-Range (if any): the client's copy of the rest
+ * must still be current, as told by its strong etag (of length etag_len, 0 if it has none), or its exact modification
+ * time.
+ */
+static bool if_range_current(struct kitserv_client* client, const char* etag, int etag_len, time_t mtime)
+{
+    const char* value = client->ta_cold.req_if_range;
+    time_t date;
+
+    if (!value) {
+        return true;
     }
-    // failed .http append, serve the generic fallback
-    if (ctx->fallback) {
-        rc = snprintf(fname, PATH_MAX, "%s/%s", ctx->root, ctx->fallback);
-        if (verify_static_path(&st, client, rc, fname)) {
-            if (client->ta.resp_status) {
-                return -1;
-            }
-        } else {
-            goto path_set;
-        }
+    if (*value == '"' || *value == 'W') {
+        return etag_len && etag_list_matches(value, etag, etag_len, false);
     }
+    return !kitserv_httpdate_parse(value, &date) && date == mtime;
+}
 
-    // could not find a path from above, abort
-    client->ta.resp_status = HTTP_404_NOT_FOUND;
-    return -1;
+/**
+ * Returns true if the client's copy of a static file with the given headers (as from format_file_headers) and
+ * modification time is current, so that its body won't be needed.
+ */
+static inline bool client_copy_current(struct kitserv_client* client, const char* headers, int headers_len,
+                                       time_t mtime)
+{
+    const char* etag = NULL;
+    int etag_len;
 
-path_set:
+    if (!client->ta_cold.req_if_none_match && !client->ta_cold.req_modified_since) {
+        return false;
+    }
+    etag_len = header_block_etag(headers, headers_len, &etag);
+    return check_not_modified(client, etag, etag_len, mtime) > 0;
+}
 
-    // don't open on a HEAD - we already got our info from the stat
-    if (client->ta.req_method == HTTP_GET) {
-        rc = open(fname, O_RDONLY);
-        if (rc < 0) {
+/**
+ * Set up a multipart/byteranges response for the num ranges in client->resp_ranges, of a file of the given size with
+ * the given preformatted headers (as from format_file_headers, whose content type moves into each part).
+ * The delimiter and headers of every part are formatted into resp_body, to be sent between the ranges of the file.
+ * Returns 0 on success, -1 on error (with resp_status set).
+ */
+static int multipart_response(struct kitserv_client* client, off_t size, const char* headers, int headers_len,
+                              int num)
+{
+    struct http_range* ranges = client->resp_ranges;
+    struct http_worker* worker = client->worker;
+    const char* type_line;
+    const char* type = "application/octet-stream";
+    char boundary[17];
+    int type_line_len, type_len, i, rc;
+
+    type_line_len = header_block_line(headers, headers_len, "content-type: ", &type_line);
+    type_len = strlen(type);
+    if (type_line_len) {
+        type = &type_line[sizeof("content-type: ") - 1];
+        type_len = type_line_len - (sizeof("content-type: ") - 1) - 2;
+    }
+
+    // the boundary only has to stay out of the file, which a file that doesn't know it won't manage by chance
+    worker->boundary_seed = worker->boundary_seed * 6364136223846793005u + 1442695040888963407u;
+    snprintf(boundary, sizeof(boundary), "%016" PRIx64, worker->boundary_seed);
+
+    if (kitserv_http_acquire_body(client)) {
+        client->ta.resp_status = HTTP_500_INTERNAL_ERROR;
+        return -1;
+    }
+    for (i = 0; i <= num; i++) {
+        ranges[i].head_off = client->resp_body.len;
+        if (i < num) {
+            rc = kitserv_buffer_appendf(&client->resp_body,
+                                        "\r\n--%s\r\ncontent-type: %.*s\r\ncontent-range: bytes %ld-%ld/%ld\r\n\r\n",
+                                        boundary, type_len, type, ranges[i].from, ranges[i].to, size);
+        } else {
+            ranges[i].from = 0;
+            ranges[i].to = -1;
+            rc = kitserv_buffer_appendf(&client->resp_body, "\r\n--%s--\r\n", boundary);
+        }
+        if (rc) {
             client->ta.resp_status = HTTP_500_INTERNAL_ERROR;
             return -1;
         }
-        client->ta.resp_fd = rc;
-    } else {
-        client->ta.resp_fd = KITSERV_FD_HEAD;
+        ranges[i].head_len = client->resp_body.len - ranges[i].head_off;
     }
+    kitserv_http_ta_cold(client)->resp_num_parts = num + 1;
+
+    // the rest of the headers apply to the response as a whole
+    if (http_header_add_block(client, headers, type_line - headers) ||
+        kitserv_http_header_add(client, "content-type", "multipart/byteranges; boundary=%s", boundary) ||
+        http_header_add_block(client, &type_line[type_line_len], &headers[headers_len] - &type_line[type_line_len])) {
+        client->ta.resp_status = HTTP_500_INTERNAL_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Finish a response for a static file of the given size and modification time, with resp_fd already set.
+ * Adds the given preformatted headers (of length headers_len), as from format_file_headers, and answers conditional
+ * requests against them.
+ * Returns 0 on success, or -1 on error (with resp_status set, and resp_fd released)
+ */
+static int static_file_response(struct kitserv_client* client, off_t size, time_t mtime, const char* headers,
+                                int headers_len)
+{
+    const char* etag = NULL;
+    int etag_len, rc;
 
     // resp_body_pos already set - 0
-    client->ta.resp_body_end = st.st_size - 1;
+    client->ta.resp_body_end = size - 1;
 
-    if (client->ta.range_requested) {
+    etag_len = header_block_etag(headers, headers_len, &etag);
+    rc = check_not_modified(client, etag, etag_len, mtime);
+    if (rc < 0) {
+        client->ta.resp_status = HTTP_400_BAD_REQUEST;
+        goto err_closefd;
+    }
+    if (rc) {
+        if (http_header_add_block(client, headers, headers_len)) {
+            client->ta.resp_status = HTTP_500_INTERNAL_ERROR;
+            goto err_closefd;
+        }
+        client->ta.resp_status = HTTP_304_NOT_MODIFIED;
+        client->ta.req_method = HTTP_HEAD;  // since the response is otherwise identical
+        kitserv_http_release_resp_fd(client);
+        client->ta.resp_fd = KITSERV_FD_HEAD;  // still with the content-length of the full response
+        return 0;
+    }
+
+    if (client->ta_cold.range_requested && !if_range_current(client, etag, etag_len, mtime)) {
+        // the client's copy is outdated, so a range of the new one would be useless to it: send all of it instead
+        kitserv_http_ta_cold(client)->range_requested = false;
+    }
+    if (client->ta_cold.range_requested) {
         // we have a range request, parse it and set the header
-        if (!parse_range_request(client, st.st_size)) {
-            if (http_header_add_content_range(client, client->ta.resp_body_pos, client->ta.resp_body_end, st.st_size)) {
-                client->ta.resp_status = HTTP_500_INTERNAL_ERROR;
-                goto err_closefd;
+        rc = parse_range_request(client, size);
+        if (rc < 0) {
+            if (client->ta.resp_status == HTTP_416_RANGE_NOT_SATISFIABLE) {
+                kitserv_http_header_add(client, "content-range", "bytes */%ld", size);
+                kitserv_http_ta_cold(client)->preserve_headers_on_error = true;
             }
-        } else {
-            // range parsing failed, we ignore the header on bad req but return other errors as-is
-            if (client->ta.resp_status != HTTP_400_BAD_REQUEST) {
-                if (client->ta.resp_status == HTTP_416_RANGE_NOT_SATISFIABLE) {
-                    kitserv_http_header_add(client, "content-range", "*/%ld", st.st_size);
-                    client->ta.preserve_headers_on_error = true;
-                    goto err_closefd;
-                }
+            goto err_closefd;
+        } else if (rc == 0) {
+            // malformed (or asking for too many ranges), so ignore it
+            kitserv_http_ta_cold(client)->range_requested = false;
+        } else if (rc > 1) {
+            if (multipart_response(client, size, headers, headers_len, rc)) {
                 goto err_closefd;
             }
-            client->ta.range_requested = false;
+            client->ta.resp_status = HTTP_206_PARTIAL_CONTENT;
+            return 0;
+        } else if (http_header_add_content_range(client, client->ta.resp_body_pos, client->ta.resp_body_end, size)) {
+            client->ta.resp_status = HTTP_500_INTERNAL_ERROR;
+            goto err_closefd;
         }
     }
 
-    // add content type, accept-ranges, and last modified headers
-    if (kitserv_http_header_add_content_type_guess(client, strrchr(fname, '.')) ||
-        kitserv_http_header_add(client, "accept-ranges", "bytes") ||
-        kitserv_http_header_add_last_modified(client, st.st_mtim.tv_sec)) {
+    // add etag, content type, accept-ranges, and last modified headers
+    if (http_header_add_block(client, headers, headers_len)) {
         client->ta.resp_status = HTTP_500_INTERNAL_ERROR;
         goto err_closefd;
     }
-
-    if (client->ta.req_modified_since) {
-        if (!strptime(client->ta.req_modified_since, "%a, %d %b %Y %T GMT", &tm)) {
-            client->ta.resp_status = HTTP_400_BAD_REQUEST;
-            goto err_closefd;
-        }
-        if (difftime(st.st_mtim.tv_sec, timegm(&tm)) <= 0) {
-            client->ta.resp_status = HTTP_304_NOT_MODIFIED;
-            client->ta.req_method = HTTP_HEAD;  // since the response is otherwise identical
-            close_fd_to_zero(&client->ta.resp_fd);
-            return 0;
-        }
-        // else cascade below for a standard response
-    }
-    if (client->ta.range_requested) {
+    if (client->ta_cold.range_requested) {
         client->ta.resp_status = HTTP_206_PARTIAL_CONTENT;
     } else {
         client->ta.resp_status = HTTP_200_OK;
@@ -1000,89 +1469,713 @@ path_set:
     return 0;
 
 err_closefd:
-    close_fd_to_zero(&client->ta.resp_fd);
+    kitserv_http_release_resp_fd(client);
     return -1;
 }
 
 /**
- * Parse API tree for a given client, writing their handler if any is found (otherwise unchanged).
- * Return 0 if parsing either succeeded or found no matches.
- * Return -1 if parsing found a match for the path, but not the method.
+ * Send the body of the given file from the worker's body cache, if it is there.
+ * Returns true if it will be sent from memory, false otherwise (counting a miss if it could have been cached).
  */
-static int parse_api_tree(struct kitserv_client* client, char* path, struct kitserv_api_tree* current_tree)
+static bool cached_body_hit(struct kitserv_client* client, const struct body_key* key)
 {
-    int i;
-    char *q, *r;
+    bodycache_t* cache = &client->worker->bodies;
+    struct body_entry* body;
 
-    /* /request/path
-     *  ^      ^
-     *  path   q
-     */
+    if (client->ta.req_method != HTTP_GET || !kitserv_bodycache_eligible(cache, key) ||
+        !(body = kitserv_bodycache_lookup(cache, key))) {
+        return false;
+    }
+    kitserv_bodycache_acquire(body);
+    client->ta.resp_cached = body;
+    return true;
+}
 
-recurse:
-    for (q = path; *q && *q != '/'; q++)
-        ;
-    for (i = 0; i < current_tree->num_entries; i++) {
-        if (current_tree->entries[i].prefix_length == q - path &&
-            !strncmp(path, current_tree->entries[i].prefix, q - path)) {
-            // if the entry should finish the current path, make sure it does
-            if (current_tree->entries[i].finishes_path) {
-                for (r = q; *r == '/'; r++)
-                    ;
-                if (*r) {
-                    // didn't finish path
-                    continue;
-                }
+/**
+ * Read the body of the given file from fd into the worker's body cache after a miss, and send it from there.
+ * Returns true if it will be sent from memory (fd is then not needed), false if it must be sent from fd.
+ */
+static bool cached_body_fill(struct kitserv_client* client, const struct body_key* key, int fd)
+{
+    bodycache_t* cache = &client->worker->bodies;
+    struct body_entry* body;
+
+    if (client->ta.req_method != HTTP_GET || !kitserv_bodycache_eligible(cache, key) ||
+        !(body = kitserv_bodycache_fill(cache, key, fd))) {
+        return false;
+    }
+    kitserv_bodycache_acquire(body);
+    client->ta.resp_cached = body;
+    return true;
+}
+
+/**
+ * Pick the encoding that the client would rather have responses compressed in on the fly, if any.
+ */
+static inline enum content_encoding accepted_compression(struct kitserv_client* client)
+{
+    // gzip first, since deflate has a history of clients that expect it without the zlib wrapper
+    if (client->ta.req_encodings & ENCODING_BIT(ENCODING_GZIP)) {
+        return ENCODING_GZIP;
+    }
+    if (client->ta.req_encodings & ENCODING_BIT(ENCODING_DEFLATE)) {
+        return ENCODING_DEFLATE;
+    }
+    return ENCODING_IDENTITY;
+}
+
+/**
+ * Pick the encoding that the given static file should be compressed in on the fly, if the client accepts one and the
+ * file is worth it: large enough, small enough to be cached compressed, and not of a type that is compressed already.
+ */
+static enum content_encoding static_compression(struct kitserv_client* client, const struct body_key* key,
+                                                const char* extension)
+{
+    enum content_encoding encoding = accepted_compression(client);
+
+    if (encoding == ENCODING_IDENTITY || !kitserv_bodycache_eligible(&client->worker->compressed, key) ||
+        (size_t)key->size < client->worker->config->compress_min_size ||
+        !kitserv_mime_lookup(extension)->compressible) {
+        return ENCODING_IDENTITY;
+    }
+    return encoding;
+}
+
+/**
+ * Send a static file compressed on the fly (in key->encoding), from the worker's cache of compressed files. After a
+ * miss, it is compressed from fd first, or if fd is negative, from the file at path.
+ * Returns true if it will be sent compressed from memory, false if it must be sent as is.
+ */
+static bool compressed_body(struct kitserv_client* client, const struct body_key* key, int fd, const char* path,
+                            const char* extension)
+{
+    bodycache_t* cache = &client->worker->compressed;
+    char headers[HEADER_BLOCK_MAX];
+    struct body_entry* body;
+    int file, rc, headers_len;
+    buffer_t out;
+
+    body = kitserv_bodycache_lookup(cache, key);
+    if (!body) {
+        file = fd >= 0 ? fd : open(path, O_RDONLY | O_CLOEXEC);
+        if (file < 0) {
+            return false;
+        }
+        rc = kitserv_compress_fd(key->encoding, client->worker->config->compress_level, file, key->size, &out);
+        if (fd < 0) {
+            close(file);
+        }
+        if (rc) {
+            return false;
+        }
+        headers_len = format_file_headers(headers, sizeof(headers), extension, key, true);
+        if (headers_len >= 0) {
+            body = kitserv_bodycache_insert(cache, key, out.buf, out.len, headers, headers_len);
+        }
+        kitserv_buffer_free(&out);
+        if (!body) {
+            return false;
+        }
+    }
+    kitserv_bodycache_acquire(body);
+    client->ta.resp_cached = body;
+    return true;
+}
+
+/**
+ * Get the headers of a cached file, as identified by key (see format_file_headers), formatting them on first use so
+ * that later responses only have to copy them. A file that is served both as itself and as a sibling has them
+ * reformatted on every switch.
+ * Returns the headers (of length entry->headers_len), or NULL on failure.
+ */
+static const char* file_entry_headers(struct file_entry* entry, const char* extension, const struct body_key* key)
+{
+    char buf[HEADER_BLOCK_MAX];
+    char* headers;
+    int len;
+
+    if (entry->headers && entry->headers_variant == key->encoding) {
+        return entry->headers;
+    }
+    len = format_file_headers(buf, sizeof(buf), extension, key, key->encoding != ENCODING_IDENTITY);
+    if (len < 0 || !(headers = malloc(len))) {
+        return NULL;
+    }
+    memcpy(headers, buf, len);
+    free(entry->headers);
+    entry->headers = headers;
+    entry->headers_len = len;
+    entry->headers_variant = key->encoding;
+    return headers;
+}
+
+static inline void body_key_from_stat(struct body_key* key, const struct stat* st)
+{
+    key->dev = st->st_dev;
+    key->ino = st->st_ino;
+    key->size = st->st_size;
+    key->mtime = st->st_mtim;
+    key->encoding = ENCODING_IDENTITY;
+}
+
+/**
+ * Get the snapshot that the worker serves its root context from, switching to a new one if it was replaced.
+ * Returns the worker's hold on it, or NULL if there is none.
+ */
+static struct snapshot_hold* worker_snapshot(struct http_worker* worker)
+{
+    struct snapshot_hold* hold;
+    unsigned int generation;
+    manifest_t* manifest;
+
+    if (kitserv_manifest_generation() == worker->snapshot_generation) {
+        return worker->snapshot;
+    }
+
+    manifest = kitserv_manifest_get_current(&generation);
+    hold = NULL;
+    if (manifest) {
+        hold = malloc(sizeof(struct snapshot_hold));
+        if (!hold) {
+            // keep serving the old one for now
+            kitserv_manifest_release(manifest);
+            return worker->snapshot;
+        }
+        hold->manifest = manifest;
+        hold->users = 1;  // the worker's own
+    }
+    // transactions still sending from the old one keep it alive until they're done
+    if (worker->snapshot) {
+        snapshot_release(worker->snapshot);
+    }
+    worker->snapshot = hold;
+    worker->snapshot_generation = generation;
+    return hold;
+}
+
+/**
+ * Serve a static path (within the default context) from the worker's snapshot.
+ * Returns 0 on success, -1 on error (with resp_status set), or 1 if the snapshot can't tell and the filesystem must.
+ */
+static int handle_snapshot_path(struct kitserv_client* client, const char* path, struct kitserv_request_context* ctx,
+                                struct snapshot_hold* hold)
+{
+    const struct manifest_entry* entry;
+    const manifest_t* manifest = hold->manifest;
+    const char *headers, *extension;
+    struct body_key key;
+    int fd, headers_len, encoding;
+
+    if (!strcmp(client->ta.req_path, "/") && ctx->root_fallback) {
+        entry = manifest->root_entry >= 0 ? &manifest->entries[manifest->root_entry] : NULL;
+    } else {
+        while (*path == '/') {
+            path++;
+        }
+        entry = kitserv_manifest_lookup(manifest, path, strlen(path));
+        if (!entry && (strstr(path, "//") || strstr(path, "/."))) {
+            // not spelled the way the manifest names files, but the filesystem could still resolve it
+            return 1;
+        }
+    }
+    if (!entry) {
+        if (manifest->fallback_entry < 0) {
+            client->ta.resp_status = HTTP_404_NOT_FOUND;
+            return -1;
+        }
+        entry = &manifest->entries[manifest->fallback_entry];
+    }
+
+    // send the first precompressed sibling the client accepts instead (only linked if the context uses them)
+    headers = entry->headers;
+    headers_len = entry->headers_len;
+    for (encoding = 0; encoding < ENCODING_COUNT; encoding++) {
+        if ((client->ta.req_encodings & ENCODING_BIT(encoding)) && entry->variants[encoding].entry >= 0) {
+            headers = entry->variants[encoding].headers;
+            headers_len = entry->variants[encoding].headers_len;
+            entry = &manifest->entries[entry->variants[encoding].entry];
+            break;
+        }
+    }
+
+    key.dev = entry->dev;
+    key.ino = entry->ino;
+    key.size = entry->size;
+    key.mtime = entry->mtime;
+    key.encoding = encoding < ENCODING_COUNT ? encoding : ENCODING_IDENTITY;
+    if (encoding == ENCODING_COUNT) {
+        // no sibling to send, but it may be worth compressing on the fly instead
+        extension = strrchr(entry->path, '.');
+        key.encoding = static_compression(client, &key, extension);
+        if (key.encoding != ENCODING_IDENTITY && compressed_body(client, &key, entry->fd, entry->path, extension)) {
+            return static_file_response(client, client->ta.resp_cached->len, entry->mtime.tv_sec,
+                                        client->ta.resp_cached->headers, client->ta.resp_cached->headers_len);
+        }
+        key.encoding = ENCODING_IDENTITY;
+    }
+    if (client_copy_current(client, headers, headers_len, entry->mtime.tv_sec)) {
+        // answered with a 304 below, so the body isn't needed
+        client->ta.resp_fd = KITSERV_FD_HEAD;
+    } else if (client->ta.req_method != HTTP_GET) {
+        client->ta.resp_fd = KITSERV_FD_HEAD;
+    } else if (cached_body_hit(client, &key) || (entry->fd >= 0 && cached_body_fill(client, &key, entry->fd))) {
+        // sent from memory, so the snapshot's fd isn't needed
+    } else if (entry->fd >= 0) {
+        hold->users++;
+        client->ta.resp_snapshot = hold;
+        client->ta.resp_fd = entry->fd;
+    } else {
+        // there weren't enough fds to keep this one open
+        fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            client->ta.resp_status = HTTP_500_INTERNAL_ERROR;
+            return -1;
+        }
+        if (cached_body_fill(client, &key, fd)) {
+            close(fd);
+        } else {
+            client->ta.resp_fd = fd;
+        }
+    }
+    return static_file_response(client, entry->size, entry->mtime.tv_sec, headers, headers_len);
+}
+
+int kitserv_http_load_snapshot(void)
+{
+    struct manifest_options options = {
+        .root = default_context->root,
+        .root_fallback = default_context->root_fallback,
+        .fallback = default_context->fallback,
+        .append_html = default_context->use_http_append_fallback,
+        .precompressed = default_context->use_precompressed,
+        .format_headers = format_file_headers,
+    };
+    uint64_t start = kitserv_timer_now();
+    manifest_t* manifest;
+
+    manifest = kitserv_manifest_build(&options);
+    if (!manifest) {
+        return -1;
+    }
+    if (!kitserv_silent_mode) {
+        printf("Snapshot of %s: %d files, %zu bytes, built in %lu ms.\n", options.root, manifest->num_entries,
+               manifest->memory, (unsigned long)(kitserv_timer_now() - start));
+    }
+    kitserv_manifest_publish(manifest);
+    return 0;
+}
+
+/**
+ * Verify a given path, stat'ing it into *st (or taking it from the worker's file cache)
+ * *entry is set to the cache entry for path, whether it was found or is missing (NULL if not cached)
+ * Returns 0 on success, or -1 on error (catastrophic errors also set resp_status)
+ * assumed_pathlen is the size that path was attempted to be, which may be either invalid or too long (>= PATH_MAX)
+ * (if it is so, then the status is set as 414_URI_TOO_LONG)
+ */
+static int verify_static_path(struct stat* st, struct file_entry** entry, struct kitserv_client* client, int root_len,
+                              int assumed_pathlen, char* path)
+{
+    filecache_t* cache = &client->worker->files;
+
+    *entry = NULL;
+    if (assumed_pathlen < 0 || assumed_pathlen >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        client->ta.resp_status = HTTP_414_URI_TOO_LONG;
+        return -1;
+    }
+    if ((*entry = kitserv_filecache_lookup(cache, path, assumed_pathlen))) {
+        if (kitserv_filecache_missing(*entry)) {
+            errno = ENOENT;
+            return -1;
+        }
+        *st = (*entry)->st;
+        return 0;
+    }
+    if (!stat(path, st)) {
+        if (S_ISREG(st->st_mode)) {
+            return 0;
+        }
+    } else if (errno != ENOENT && errno != ENOTDIR) {
+        if (errno == EACCES) {
+            client->ta.resp_status = HTTP_403_PERMISSION_DENIED;
+        }
+        return -1;
+    }
+    // remember the miss, so that the next request for it doesn't have to stat again
+    *entry = kitserv_filecache_insert_missing(cache, path, assumed_pathlen, root_len);
+    errno = ENOENT;
+    return -1;
+}
+
+/**
+ * Paths that kitserv_http_handle_static_path tries in turn, until one exists.
+ */
+enum static_candidate {
+    STATIC_DIRECT,     // the path itself, or the root fallback
+    STATIC_HTML,       // the path with .html appended
+    STATIC_FALLBACK,   // the generic fallback
+    STATIC_NOT_FOUND,  // none of the above
+};
+
+/**
+ * Write the file name for the given candidate into fname (of size PATH_MAX), and its attempted length into *len.
+ * Returns true if the context uses that candidate at all, false otherwise.
+ */
+static bool static_candidate_path(char* fname, int* len, struct kitserv_client* client,
+                                  struct kitserv_request_context* ctx, const char* path,
+                                  enum static_candidate candidate)
+{
+    switch (candidate) {
+        case STATIC_DIRECT:
+            // regular direct path or the root fallback
+            if (!strcmp(client->ta.req_path, "/") && ctx->root_fallback) {
+                *len = snprintf(fname, PATH_MAX, "%s/%s", ctx->root, ctx->root_fallback);
+            } else {
+                *len = snprintf(fname, PATH_MAX, "%s/%s", ctx->root, path);
             }
-            // matched an endpoint, see if method matches
-            client->ta.api_allow_flags |= current_tree->entries[i].method;
-            if (client->ta.req_method & current_tree->entries[i].method) {
-                client->ta.api_endpoint_hit = current_tree->entries[i].handler;
-                return 0;
+            return true;
+        case STATIC_HTML:
+            *len = snprintf(fname, PATH_MAX, "%s/%s.html", ctx->root, path);
+            return ctx->use_http_append_fallback;
+        case STATIC_FALLBACK:
+            *len = snprintf(fname, PATH_MAX, "%s/%s", ctx->root, ctx->fallback);
+            return ctx->fallback != NULL;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Open the file at fname (of length len) only to remember it in the worker's file cache, since it isn't being sent.
+ */
+static void remember_file(struct kitserv_client* client, const char* fname, int len, int root_len,
+                          const struct stat* st)
+{
+    filecache_t* cache = &client->worker->files;
+    int fd;
+
+    if (!kitserv_filecache_enabled(cache) || (fd = open(fname, O_RDONLY | O_CLOEXEC)) < 0) {
+        return;
+    }
+    if (!kitserv_filecache_insert(cache, fname, len, root_len, fd, st)) {
+        close(fd);
+    }
+}
+
+/**
+ * Find a precompressed sibling of the file at fname (of length len) in an encoding that the client accepts, writing
+ * its path into variant (of size PATH_MAX) and its length into *variant_len. If found, *st and *entry are replaced
+ * with the sibling's, as from verify_static_path.
+ * Returns the encoding of the sibling, or ENCODING_IDENTITY if there is none.
+ */
+static enum content_encoding find_precompressed(struct kitserv_client* client, char* variant, int* variant_len,
+                                                int root_len, const char* fname, int len, struct stat* st,
+                                                struct file_entry** entry)
+{
+    struct file_entry* variant_entry;
+    struct stat variant_st;
+    int encoding;
+
+    for (encoding = 0; encoding < ENCODING_COUNT; encoding++) {
+        if (!(client->ta.req_encodings & ENCODING_BIT(encoding)) || !kitserv_encoding_suffix(encoding)) {
+            continue;
+        }
+        // looked up like any other path, so that the file cache remembers siblings that don't exist as well
+        *variant_len = snprintf(variant, PATH_MAX, "%.*s%s", len, fname, kitserv_encoding_suffix(encoding));
+        if (!verify_static_path(&variant_st, &variant_entry, client, root_len, *variant_len, variant)) {
+            // the file itself still has to be found next time, before its sibling is
+            if (!*entry) {
+                remember_file(client, fname, len, root_len, st);
             }
+            *st = variant_st;
+            *entry = variant_entry;
+            return encoding;
         }
+        // whatever is wrong with the sibling, the file itself can still be served
+        client->ta.resp_status = HTTP_X_RESP_STATUS_UNSET;
     }
-    if (client->ta.api_allow_flags) {
-        // we hit an endpoint but didn't match any of its methods - stop parsing
+    return ENCODING_IDENTITY;
+}
+
+int kitserv_http_handle_static_path(struct kitserv_client* client, const char* path,
+                                    struct kitserv_request_context* ctx)
+{
+    filecache_t* cache = &client->worker->files;
+    struct file_entry* direct_miss = NULL;
+    struct file_entry* entry = NULL;
+    enum static_candidate candidate;
+    enum content_encoding encoding = ENCODING_IDENTITY;
+    struct snapshot_hold* snapshot;
+    char fname[PATH_MAX];
+    char variant[PATH_MAX];
+    char headers_buf[HEADER_BLOCK_MAX];
+    const char *file, *extension, *headers;
+    struct body_key key;
+    struct stat st;
+    int rc, fname_len, file_len, variant_len, root_len, resolved, headers_len;
+
+    if (!ctx) {
+        ctx = default_context;
+    }
+
+    if (!(client->ta.req_method & HTTP_GET)) {
+        // we only allow GET or HEAD here
+        errno = ENOTSUP;
         client->ta.resp_status = HTTP_405_METHOD_NOT_ALLOWED;
         return -1;
     }
-    for (i = 0; i < current_tree->num_subtrees; i++) {
-        if (current_tree->subtrees[i].prefix_length == q - path &&
-            !strncmp(path, api_tree->subtrees[i].prefix, q - path)) {
-            // return parse_api_tree(client, q + 1, &current_tree->subtrees[i]);
-            current_tree = &current_tree->subtrees[i];
-            path = q + 1;
-            goto recurse;
+
+    if (ctx == default_context && (snapshot = worker_snapshot(client->worker))) {
+        rc = handle_snapshot_path(client, path, ctx, snapshot);
+        if (rc != 1) {
+            return rc;
+        }
+    }
+
+    // try the direct path, then append .html, then serve the generic fallback
+    root_len = strlen(ctx->root);
+    for (candidate = STATIC_DIRECT; candidate < STATIC_NOT_FOUND; candidate++) {
+        if (!static_candidate_path(fname, &fname_len, client, ctx, path, candidate)) {
+            continue;
+        }
+        if (!verify_static_path(&st, &entry, client, root_len, fname_len, fname)) {
+            break;
+        }
+        if (client->ta.resp_status) {
+            goto err_release_miss;
+        }
+        if (candidate == STATIC_DIRECT && entry) {
+            // a known miss also knows where the search went from there, unless something has changed since
+            direct_miss = entry;
+            kitserv_filecache_acquire(direct_miss);
+            resolved = kitserv_filecache_get_resolved(cache, direct_miss);
+            if (resolved > STATIC_DIRECT) {
+                candidate = resolved - 1;
+            }
+        }
+    }
+    if (direct_miss) {
+        kitserv_filecache_set_resolved(cache, direct_miss, candidate);
+        kitserv_filecache_release(direct_miss);
+    }
+
+    if (candidate == STATIC_NOT_FOUND) {
+        // could not find a path from above, abort
+        client->ta.resp_status = HTTP_404_NOT_FOUND;
+        return -1;
+    }
+
+    // a precompressed sibling is sent in place of the file, but with the type of the file itself
+    file = fname;
+    file_len = fname_len;
+    extension = strrchr(fname, '.');
+    if (ctx->use_precompressed && client->ta.req_encodings) {
+        encoding = find_precompressed(client, variant, &variant_len, root_len, fname, fname_len, &st, &entry);
+        if (encoding != ENCODING_IDENTITY) {
+            file = variant;
+            file_len = variant_len;
+        }
+    }
+
+    body_key_from_stat(&key, &st);
+    key.encoding = encoding;
+    if (encoding == ENCODING_IDENTITY) {
+        // no sibling to send, but it may be worth compressing on the fly instead (for a HEAD too, for its length)
+        key.encoding = static_compression(client, &key, extension);
+        if (key.encoding != ENCODING_IDENTITY &&
+            compressed_body(client, &key, entry ? entry->fd : -1, file, extension)) {
+            if (!entry) {
+                remember_file(client, file, file_len, root_len, &st);
+            }
+            return static_file_response(client, client->ta.resp_cached->len, st.st_mtim.tv_sec,
+                                        client->ta.resp_cached->headers, client->ta.resp_cached->headers_len);
+        }
+        key.encoding = ENCODING_IDENTITY;
+    }
+
+    // formatted before the file is opened, so that a client whose copy is current is answered without opening it
+    if (entry && (headers = file_entry_headers(entry, extension, &key))) {
+        headers_len = entry->headers_len;
+    } else {
+        headers = headers_buf;
+        headers_len = format_file_headers(headers_buf, sizeof(headers_buf), extension, &key,
+                                          encoding != ENCODING_IDENTITY);
+        if (headers_len < 0) {
+            client->ta.resp_status = HTTP_500_INTERNAL_ERROR;
+            return -1;
+        }
+    }
+
+    if (client_copy_current(client, headers, headers_len, st.st_mtim.tv_sec)) {
+        // answered with a 304 below, so the body isn't needed
+        client->ta.resp_fd = KITSERV_FD_HEAD;
+    } else if (entry) {
+        // cached: share its fd, which stays open until every transaction using it is done
+        if (client->ta.req_method != HTTP_GET) {
+            client->ta.resp_fd = KITSERV_FD_HEAD;
+        } else if (!cached_body_hit(client, &key) && !cached_body_fill(client, &key, entry->fd)) {
+            kitserv_filecache_acquire(entry);
+            client->ta.resp_file = entry;
+            client->ta.resp_fd = entry->fd;
+        }
+    } else if (!kitserv_filecache_enabled(cache) && cached_body_hit(client, &key)) {
+        // small enough to be in memory already, and there is no file cache to open it for
+    } else if (client->ta.req_method == HTTP_GET || kitserv_filecache_enabled(cache)) {
+        // don't open on a HEAD - we already got our info from the stat (unless it's worth caching)
+        rc = open(file, O_RDONLY | O_CLOEXEC);
+        if (rc < 0) {
+            client->ta.resp_status = HTTP_500_INTERNAL_ERROR;
+            return -1;
         }
+        entry = kitserv_filecache_insert(cache, file, file_len, root_len, rc, &st);
+        if (client->ta.req_method != HTTP_GET) {
+            if (!entry) {
+                close(rc);
+            }
+            client->ta.resp_fd = KITSERV_FD_HEAD;
+        } else if ((kitserv_filecache_enabled(cache) && cached_body_hit(client, &key)) ||
+                   cached_body_fill(client, &key, rc)) {
+            // sent from memory (without a file cache, the lookup already missed above, so only a fill was tried)
+            if (!entry) {
+                close(rc);
+            }
+        } else {
+            if (entry) {
+                kitserv_filecache_acquire(entry);
+                client->ta.resp_file = entry;
+            }
+            client->ta.resp_fd = rc;
+        }
+    } else {
+        client->ta.resp_fd = KITSERV_FD_HEAD;
+    }
+    return static_file_response(client, st.st_size, st.st_mtim.tv_sec, headers, headers_len);
+
+err_release_miss:
+    if (direct_miss) {
+        kitserv_filecache_release(direct_miss);
+    }
+    return -1;
+}
+
+/**
+ * Route a request for client through the API tree, writing their handler if any is found (otherwise unchanged).
+ * Return 0 if routing either succeeded or found no matches.
+ * Return -1 if routing found a match for the path, but not the method.
+ */
+static int route_api_request(struct kitserv_client* client, const char* path)
+{
+    const struct router_route* route;
+    int allowed;
+
+    route = kitserv_router_match(&api_router, client->req_headers, path, client->ta.req_method,
+                                 client->ta_cold.api_params, &allowed);
+    if (route) {
+        kitserv_http_ta_cold(client)->api_endpoint_hit = route->handler;
+        client->ta_cold.api_route = route;
+        client->ta_cold.api_compress = route->compress;
+        return 0;
+    }
+    if (allowed) {
+        // we hit an endpoint but didn't match any of its methods
+        kitserv_http_ta_cold(client)->api_allow_flags = allowed;
+        client->ta.resp_status = HTTP_405_METHOD_NOT_ALLOWED;
+        return -1;
     }
     return 0;
 }
 
+/**
+ * Find a response header that was added already, by its key (of length key_len, in any case).
+ * Returns its value, which runs until CRLF, or NULL if there is none.
+ */
+static const char* find_response_header(struct kitserv_client* client, const char* key, size_t key_len)
+{
+    const char* line = client->resp_headers;
+    const char* end = &client->resp_headers[client->ta.resp_bufs[1].iov_len];
+
+    while (line && line < end) {
+        if ((size_t)(end - line) > key_len && line[key_len] == ':' && !strncasecmp(line, key, key_len)) {
+            for (line += key_len + 1; *line == ' '; line++)
+                ;
+            return line;
+        }
+        line = memchr(line, '\n', end - line);
+        line = line ? line + 1 : NULL;
+    }
+    return NULL;
+}
+
+/**
+ * Compress the body that an API handler produced on the fly, if its endpoint asked for that, the client accepts it,
+ * and it is worth it. Anything that goes wrong leaves the body as it was.
+ */
+static void compress_api_response(struct kitserv_client* client)
+{
+    const struct http_worker_config* config = client->worker->config;
+    enum content_encoding encoding;
+    char headers[HEADER_BLOCK_MAX];
+    const char* type;
+    int headers_len;
+    buffer_t out;
+
+    if (!client->ta_cold.api_compress || client->ta.resp_status != HTTP_200_OK || client->ta.resp_fd ||
+        client->ta.resp_cached || client->ta.resp_body_pos || !config->compress_level ||
+        (size_t)client->resp_body.len < config->compress_min_size ||
+        (encoding = accepted_compression(client)) == ENCODING_IDENTITY) {
+        return;
+    }
+    type = find_response_header(client, "content-type", 12);
+    if (!type || !kitserv_compress_mime_type(type) || find_response_header(client, "content-encoding", 16)) {
+        return;
+    }
+    if (kitserv_compress_buffer(encoding, config->compress_level, client->resp_body.buf, client->resp_body.len, &out)) {
+        return;
+    }
+    headers_len = snprintf(headers, sizeof(headers), "content-encoding: %s\r\nvary: accept-encoding\r\n",
+                           kitserv_encoding_name(encoding));
+    // no smaller, no point (and the compressed body always fits where the original was)
+    if (out.len < client->resp_body.len && !http_header_add_block(client, headers, headers_len)) {
+        client->resp_body.len = 0;
+        kitserv_buffer_append(&client->resp_body, out.buf, out.len);
+    }
+    kitserv_buffer_free(&out);
+}
+
 int kitserv_http_serve_request(struct kitserv_client* client)
 {
     char* p;
 
-    if (api_tree) {
-        // haven't been here yet, parse the tree and see if we hit it
-        if (!client->ta.api_endpoint_hit) {
-            assert(client->ta.api_internal_data == NULL);
-            assert(client->ta.api_allow_flags == 0);
+    if (acquire_response_buffers(client)) {
+        client->ta.resp_status = HTTP_X_HANGUP;
+        return -1;
+    }
+
+    if (kitserv_router_enabled(&api_router)) {
+        // haven't been here yet, route through the tree and see if we hit it
+        if (!client->ta_cold.api_endpoint_hit) {
+            assert(client->ta_cold.api_internal_data == NULL);
+            assert(client->ta_cold.api_allow_flags == 0);
             // cut off leading /, if it exists
             for (p = client->ta.req_path; *p == '/'; p++)
                 ;
-            if (parse_api_tree(client, p, api_tree)) {
+            if (route_api_request(client, p)) {
                 goto cont;
             }
         }
 
         // hit an endpoint, call to it
-        if (client->ta.api_endpoint_hit) {
-            client->ta.api_endpoint_hit(client, client->ta.api_internal_data);
+        if (client->ta_cold.api_endpoint_hit) {
+            client->ta_cold.api_endpoint_hit(client, client->ta_cold.api_internal_data);
             // they must set resp_status to indicate advancement
             if (client->ta.resp_status == HTTP_X_RESP_STATUS_UNSET) {
-                return 0;
+                if (!client->ta_cold.timed_out) {
+                    return 0;
+                }
+                // that was their last chance
+                client->ta.resp_status = HTTP_408_REQUEST_TIMEOUT;
             }
+            compress_api_response(client);
             goto cont;
         }
     }
@@ -1093,6 +2186,9 @@ cont:
     return 0;
 }
 
+// every version string has this length
+#define VERSION_STRING_LEN (sizeof("HTTP/1.1 ") - 1)
+
 static inline const char* get_version_string(enum http_version version)
 {
     // space at the end is relevant for easy append to status
@@ -1108,65 +2204,75 @@ static inline const char* get_version_string(enum http_version version)
     }
 }
 
-static const char* get_status_string(enum kitserv_http_response_status status)
+/**
+ * A status line without the version, with its length so that it can be copied as is.
+ */
+struct status_line {
+    const char* str;
+    int len;
+};
+
+// \r\n since we're always going to add it anyway
+#define STATUS_LINE(s) ((struct status_line){s "\r\n", sizeof(s "\r\n") - 1})
+
+static struct status_line get_status_line(enum kitserv_http_response_status status)
 {
-    // \r\n since we're always going to add it anyway
     switch (status) {
         case HTTP_200_OK:
-            return "200 OK\r\n";
+            return STATUS_LINE("200 OK");
         case HTTP_204_NO_CONTENT:
-            return "204 No Content\r\n";
+            return STATUS_LINE("204 No Content");
         case HTTP_206_PARTIAL_CONTENT:
-            return "206 Partial Content\r\n";
+            return STATUS_LINE("206 Partial Content");
         case HTTP_304_NOT_MODIFIED:
-            return "304 Not Modified\r\n";
+            return STATUS_LINE("304 Not Modified");
         case HTTP_400_BAD_REQUEST:
-            return "400 Bad Request\r\n";
+            return STATUS_LINE("400 Bad Request");
         case HTTP_403_PERMISSION_DENIED:
-            return "403 Permission Denied\r\n";
+            return STATUS_LINE("403 Permission Denied");
         case HTTP_404_NOT_FOUND:
-            return "404 Not Found\r\n";
+            return STATUS_LINE("404 Not Found");
         case HTTP_405_METHOD_NOT_ALLOWED:
-            return "405 Method Not Allowed\r\n";
+            return STATUS_LINE("405 Method Not Allowed");
         case HTTP_408_REQUEST_TIMEOUT:
-            return "408 Request Timeout\r\n";
+            return STATUS_LINE("408 Request Timeout");
         case HTTP_413_CONTENT_TOO_LARGE:
-            return "413 Content Too Large\r\n";
+            return STATUS_LINE("413 Content Too Large");
         case HTTP_414_URI_TOO_LONG:
-            return "414 URI Too Long\r\n";
+            return STATUS_LINE("414 URI Too Long");
         case HTTP_416_RANGE_NOT_SATISFIABLE:
-            return "416 Range Not Satisfiable\r\n";
+            return STATUS_LINE("416 Range Not Satisfiable");
         case HTTP_431_REQUEST_HEADER_FIELDS_TOO_LARGE:
-            return "431 Request Header Fields Too Large\r\n";
+            return STATUS_LINE("431 Request Header Fields Too Large");
         case HTTP_501_NOT_IMPLEMENTED:
-            return "501 Not Implemented\r\n";
+            return STATUS_LINE("501 Not Implemented");
         case HTTP_503_SERVICE_UNAVAILABLE:
-            return "503 Service Unavailable\r\n";
+            return STATUS_LINE("503 Service Unavailable");
         case HTTP_505_VERSION_NOT_SUPPORTED:
-            return "505 Version Not Supported\r\n";
+            return STATUS_LINE("505 Version Not Supported");
         case HTTP_507_INSUFFICIENT_STORAGE:
-            return "507 Insufficient Storage\r\n";
+            return STATUS_LINE("507 Insufficient Storage");
         case HTTP_X_RESP_STATUS_UNSET:
             fprintf(stderr, "Status missing while getting status string\n");
             /* fallthrough */
         case HTTP_500_INTERNAL_ERROR:
-            return "500 Internal Server Error\r\n";
+            return STATUS_LINE("500 Internal Server Error");
         default:
             if (!kitserv_silent_mode) {
                 fprintf(stderr, "Unsupported status number: %d\n", status);
             }
-            return "500 Internal Server Error\r\n";
+            return STATUS_LINE("500 Internal Server Error");
     }
 }
 
 static inline void prepare_resp_start(struct kitserv_client* client)
 {
+    struct status_line status = get_status_line(client->ta.resp_status);
+
     // should always fit, unless some idiot changed the buffer size to be too small
-    client->ta.resp_bufs[0].iov_len = 0;
-    str_append(client->resp_start, &client->ta.resp_bufs[0].iov_len, HTTP_BUFSZ_SMALL, "%s",
-               get_version_string(client->ta.req_version));
-    str_append(client->resp_start, &client->ta.resp_bufs[0].iov_len, HTTP_BUFSZ_SMALL, "%s",
-               get_status_string(client->ta.resp_status));
+    memcpy(client->resp_start, get_version_string(client->ta.req_version), VERSION_STRING_LEN);
+    memcpy(&client->resp_start[VERSION_STRING_LEN], status.str, status.len);
+    client->ta.resp_bufs[0].iov_len = VERSION_STRING_LEN + status.len;
 }
 
 /**
@@ -1191,9 +2297,10 @@ static int prepare_error_response_body(struct kitserv_client* client)
     client->ta.resp_body_pos = 0;
     client->ta.resp_body_end = 0;
     client->resp_body.len = 0;
-    close_fd_to_zero(&client->ta.resp_fd);
+    client->ta_cold.resp_num_parts = 0;
+    kitserv_http_release_resp_fd(client);
 
-    if (kitserv_http_header_add_content_type(client, "text/plain")) {
+    if (kitserv_http_header_add_content_type(client, "text/plain") || kitserv_http_acquire_body(client)) {
         return -1;
     }
 
@@ -1242,11 +2349,40 @@ static int prepare_error_response_body(struct kitserv_client* client)
     return 0;
 }
 
+/**
+ * Get the length of a multipart response: the delimiters and headers of every part, and their ranges.
+ */
+static off_t multipart_length(struct kitserv_client* client)
+{
+    off_t length = 0;
+    int i;
+
+    for (i = 0; i < client->ta_cold.resp_num_parts; i++) {
+        length += client->resp_ranges[i].head_len + client->resp_ranges[i].to - client->resp_ranges[i].from + 1;
+    }
+    return length;
+}
+
+/**
+ * Start sending the given part of a multipart response: its delimiter and headers through resp_bufs, then its range.
+ */
+static void start_part(struct kitserv_client* client, int part)
+{
+    struct http_range* range = &client->resp_ranges[part];
+
+    client->ta_cold.resp_part = part;
+    client->ta.resp_bufs[2].iov_base = &client->resp_body.buf[range->head_off];
+    client->ta.resp_bufs[2].iov_len = range->head_len;
+    client->ta.resp_body_pos = range->from;
+    client->ta.resp_body_end = range->to;
+}
+
 int kitserv_http_prepare_response(struct kitserv_client* client)
 {
     bool already_errored = false;
+    off_t length;
 
-    if (client->ta.resp_status == HTTP_X_HANGUP) {
+    if (client->ta.resp_status == HTTP_X_HANGUP || acquire_response_buffers(client)) {
         return -1;
     }
 
@@ -1261,29 +2397,30 @@ success:
     // others should have been set already
 
     // different measurements based on whether we're sending a file or the body buffer
-    if (client->ta.resp_fd) {
-        if (http_header_add_content_length(client, client->ta.resp_body_end - client->ta.resp_body_pos + 1)) {
-            goto error_response;
-        }
+    if (client->ta_cold.resp_num_parts) {
+        length = multipart_length(client);
+    } else if (client->ta.resp_fd || client->ta.resp_cached) {
+        length = client->ta.resp_body_end - client->ta.resp_body_pos + 1;
     } else {
-        if (http_header_add_content_length(client, client->resp_body.len - client->ta.resp_body_pos)) {
-            goto error_response;
-        }
+        length = client->resp_body.len - client->ta.resp_body_pos;
     }
-
-    if (kitserv_http_header_add(client, "server", "%s", SERVER_NAME)) {
-        goto error_response;
-    }
-
-    if (str_append(client->resp_headers, &client->ta.resp_bufs[1].iov_len, HTTP_BUFSZ, "\r\n")) {
-        client->ta.resp_fd = HTTP_507_INSUFFICIENT_STORAGE;
+    if (http_header_add_final(client, length)) {
         goto error_response;
     }
 
     // update the bases, since we're going to use them
     client->ta.resp_bufs[0].iov_base = client->resp_start;
     client->ta.resp_bufs[1].iov_base = client->resp_headers;
-    if (client->ta.resp_fd == 0 && client->ta.req_method != HTTP_HEAD) {
+    if (client->ta_cold.resp_num_parts) {
+        if (client->ta.req_method != HTTP_HEAD) {
+            // the first part's headers go out with the response's, then its range follows (see send_response_file)
+            start_part(client, 0);
+        }
+    } else if (client->ta.resp_cached && client->ta.req_method != HTTP_HEAD) {
+        // the whole response goes out in one writev
+        client->ta.resp_bufs[2].iov_base = &client->ta.resp_cached->data[client->ta.resp_body_pos];
+        client->ta.resp_bufs[2].iov_len = client->ta.resp_body_end - client->ta.resp_body_pos + 1;
+    } else if (client->ta.resp_fd == 0 && client->ta.req_method != HTTP_HEAD && client->resp_body.buf) {
         // rely on memset zeroing in the case that we aren't sending this buf
         client->ta.resp_bufs[2].iov_base = &client->resp_body.buf[client->ta.resp_body_pos];
         client->ta.resp_bufs[2].iov_len = client->resp_body.len - client->ta.resp_body_pos;
@@ -1300,8 +2437,8 @@ error_response:
         }
         return -1;
     }
-    if (!client->ta.preserve_body_on_error) {
-        if (!client->ta.preserve_headers_on_error && prepare_error_response_headers(client)) {
+    if (!client->ta_cold.preserve_body_on_error) {
+        if (!client->ta_cold.preserve_headers_on_error && prepare_error_response_headers(client)) {
             return -1;
         }
         if (prepare_error_response_body(client)) {
@@ -1314,6 +2451,7 @@ error_response:
 
 int kitserv_http_send_response(struct kitserv_client* client)
 {
+    struct iovec* buf;
     ssize_t rc = 0;
     int i;
 
@@ -1321,19 +2459,21 @@ int kitserv_http_send_response(struct kitserv_client* client)
         // writev will ignore 0-length iovecs - very convenient
         rc = writev(client->sockfd, client->ta.resp_bufs, 3);
         if (rc < 0) {
-            return errno = EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
         }
 
         for (i = 0; i < 3; i++) {
-            // always increment the base - either we sent that or that base is/becoming irrelevant
-            // wacky += because void* is not addable under -Wpedantic - but it's literally a char* anyway
-            client->ta.resp_bufs[i].iov_base = (char*)(client->ta.resp_bufs[i].iov_base) + rc;
-
-            if (client->ta.resp_bufs[i].iov_len <= (size_t)rc) {
-                client->ta.resp_bufs[i].iov_len = 0;
+            buf = &client->ta.resp_bufs[i];
+            if (buf->iov_len <= (size_t)rc) {
+                // sent all of this buf, the rest of rc went to the next ones
+                rc -= buf->iov_len;
+                // wacky cast because void* is not addable under -Wpedantic - but it's literally a char* anyway
+                buf->iov_base = (char*)(buf->iov_base) + buf->iov_len;
+                buf->iov_len = 0;
             } else {
                 // rc falls within this buf
-                client->ta.resp_bufs[i].iov_len -= rc;
+                buf->iov_base = (char*)(buf->iov_base) + rc;
+                buf->iov_len -= rc;
                 break;
             }
         }
@@ -1393,22 +2533,39 @@ int kitserv_http_send_response_file(struct kitserv_client* client)
 {
     ssize_t rc = 0;
 
-    if (client->ta.resp_fd > 0 && client->ta.req_method != HTTP_HEAD) {
-        do {
+    if ((client->ta.resp_fd > 0 || client->ta_cold.resp_num_parts) && client->ta.req_method != HTTP_HEAD) {
+        while (rc >= 0 && client->ta.resp_body_pos <= client->ta.resp_body_end) {
+            if (client->ta.resp_cached) {
+                // only for the parts of a multipart response, a whole body goes out with the headers
+                rc = write(client->sockfd, &client->ta.resp_cached->data[client->ta.resp_body_pos],
+                           client->ta.resp_body_end - client->ta.resp_body_pos + 1);
+                if (rc > 0) {
+                    client->ta.resp_body_pos += rc;
+                }
+            } else {
 #ifdef KITSERV_HAVE_SENDFILE
-            rc = sendfile(client->sockfd, client->ta.resp_fd, &client->ta.resp_body_pos,
-                          client->ta.resp_body_end - client->ta.resp_body_pos + 1);
+                rc = sendfile(client->sockfd, client->ta.resp_fd, &client->ta.resp_body_pos,
+                              client->ta.resp_body_end - client->ta.resp_body_pos + 1);
 #else
-            rc = sendfile_emulation(client->sockfd, client->ta.resp_fd, &client->ta.resp_body_pos,
-                                    client->ta.resp_body_end - client->ta.resp_body_pos + 1);
+                rc = sendfile_emulation(client->sockfd, client->ta.resp_fd, &client->ta.resp_body_pos,
+                                        client->ta.resp_body_end - client->ta.resp_body_pos + 1);
 #endif
-        } while (rc > 0 && client->ta.resp_body_pos <= client->ta.resp_body_end);
-        if (client->ta.resp_body_pos > client->ta.resp_body_end) {
-            // finished sending the file - pos should be one greater than end here
-            close_fd_to_zero(&client->ta.resp_fd);
-        } else if (rc < 0) {
+            }
+            if (rc == 0) {
+                break;  // the file came up short, there is nothing more to send
+            }
+        }
+        if (rc < 0) {
             return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
         }
+        if (rc > 0 && client->ta_cold.resp_part + 1 < client->ta_cold.resp_num_parts) {
+            // on to the next part of a multipart response, starting with its headers
+            start_part(client, client->ta_cold.resp_part + 1);
+            client->ta.state = HTTP_STATE_SEND;
+            return 0;
+        }
+        // finished sending the file - pos should be one greater than end here
+        kitserv_http_release_resp_fd(client);
     }
 
     client->ta.state = HTTP_STATE_DONE;
@@ -1484,6 +2641,8 @@ prep_response:
                     return -1;
                 } else if (*state == HTTP_STATE_SEND_FILE) {
                     return 0;
+                } else if (*state == HTTP_STATE_SEND) {
+                    continue;  // the next part of a multipart response
                 }
                 /* fallthrough */
             case HTTP_STATE_DONE:
@@ -1495,3 +2654,63 @@ prep_response:
         }
     }
 }
+
+enum http_client_phase kitserv_http_client_phase(struct kitserv_client* client)
+{
+    switch (client->ta.state) {
+        case HTTP_STATE_READ:
+            // a fresh connection is expected to send its first request promptly, so it is not idle yet
+            if (client->req_headers_len == 0 && client->num_transactions > 0) {
+                return HTTP_PHASE_IDLE;
+            }
+            return HTTP_PHASE_HEADERS;
+        case HTTP_STATE_SERVE:
+            return HTTP_PHASE_BODY;
+        default:
+            return HTTP_PHASE_SEND;
+    }
+}
+
+int kitserv_http_expire_client(struct kitserv_client* client)
+{
+    switch (kitserv_http_client_phase(client)) {
+        case HTTP_PHASE_HEADERS:
+            if (client->req_headers_len == 0) {
+                // never sent us anything, so there is nobody to tell
+                return -1;
+            }
+            client->ta.resp_status = HTTP_408_REQUEST_TIMEOUT;
+            client->ta.state = HTTP_STATE_PREPARE_RESPONSE;
+            break;
+        case HTTP_PHASE_BODY:
+            // call the handler once more, reads will fail with ETIMEDOUT so that it can clean up
+            kitserv_http_ta_cold(client)->timed_out = true;
+            break;
+        case HTTP_PHASE_IDLE:
+        case HTTP_PHASE_SEND:
+        default:
+            return -1;
+    }
+    return kitserv_http_serve_client(client);
+}
+
+void kitserv_http_reject_socket(int sockfd)
+{
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                   "retry-after: " RETRY_AFTER_SECONDS "\r\n"
+                                   "connection: close\r\n"
+                                   "content-length: 0\r\n"
+                                   "server: kitserv\r\n"
+                                   "\r\n";
+    char discard[HTTP_BUFSZ];
+
+    // swallow the request if it already arrived, since closing with unread data resets the connection
+    // (and the client would likely never see the response)
+    if (read(sockfd, discard, sizeof(discard)) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return;
+    }
+    // the socket is fresh and nonblocking, this either fits in the send buffer or it doesn't
+    if (write(sockfd, response, sizeof(response) - 1) < 0 && !kitserv_silent_mode) {
+        perror("reject_socket (write)");
+    }
+}
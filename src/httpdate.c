@@ -0,0 +1,136 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#include "httpdate.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define SECONDS_PER_DAY (86400)
+#define HTTPDATE_MAX ((time_t)253402300799)  // Fri, 31 Dec 9999 23:59:59 GMT
+
+static const char day_names[] = "ThuFriSatSunMonTueWed";  // starting from the first day of 1970
+static const char month_names[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+/**
+ * Get the number of days from 1970-01-01 to the given date (month from 1, day from 1) in the proleptic Gregorian
+ * calendar, which may be negative.
+ * Counts in eras of 400 years, each starting on the first of March, so that leap days fall at the end of their year.
+ */
+static int64_t days_from_civil(int64_t year, int month, int day)
+{
+    int64_t era, year_of_era, day_of_year, day_of_era;
+
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    year_of_era = year - era * 400;
+    day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+/**
+ * Get the date (month from 1, day from 1) that is the given number of days after 1970-01-01, the reverse of
+ * days_from_civil (for days that aren't negative).
+ */
+static void civil_from_days(uint64_t days, unsigned int* year, unsigned int* month, unsigned int* day)
+{
+    uint64_t era, day_of_era, year_of_era, day_of_year, month_from_march;
+
+    days += 719468;
+    era = days / 146097;
+    day_of_era = days - era * 146097;
+    year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    month_from_march = (5 * day_of_year + 2) / 153;
+    *day = day_of_year - (153 * month_from_march + 2) / 5 + 1;
+    *month = month_from_march < 10 ? month_from_march + 3 : month_from_march - 9;
+    *year = year_of_era + era * 400 + (*month <= 2);
+}
+
+/**
+ * Write n (below 100) as two digits.
+ */
+static inline void format_two_digits(char* buf, unsigned int n)
+{
+    buf[0] = '0' + n / 10;
+    buf[1] = '0' + n % 10;
+}
+
+/**
+ * Read two digits.
+ * Returns their value, or -1 if they aren't both digits.
+ */
+static inline int parse_two_digits(const char* str)
+{
+    if (str[0] < '0' || str[0] > '9' || str[1] < '0' || str[1] > '9') {
+        return -1;
+    }
+    return (str[0] - '0') * 10 + (str[1] - '0');
+}
+
+void kitserv_httpdate_format(char* buf, time_t time)
+{
+    unsigned int year, month, day, seconds;
+    uint64_t days;
+
+    if (time < 0) {
+        time = 0;
+    } else if (time > HTTPDATE_MAX) {
+        time = HTTPDATE_MAX;
+    }
+    days = time / SECONDS_PER_DAY;
+    seconds = time % SECONDS_PER_DAY;
+    civil_from_days(days, &year, &month, &day);
+
+    // Sun, 06 Nov 1994 08:49:37 GMT
+    memcpy(buf, &day_names[days % 7 * 3], 3);
+    memcpy(&buf[3], ", ", 2);
+    format_two_digits(&buf[5], day);
+    buf[7] = ' ';
+    memcpy(&buf[8], &month_names[(month - 1) * 3], 3);
+    buf[11] = ' ';
+    format_two_digits(&buf[12], year / 100);
+    format_two_digits(&buf[14], year % 100);
+    buf[16] = ' ';
+    format_two_digits(&buf[17], seconds / 3600);
+    buf[19] = ':';
+    format_two_digits(&buf[20], seconds / 60 % 60);
+    buf[22] = ':';
+    format_two_digits(&buf[23], seconds % 60);
+    memcpy(&buf[25], " GMT", 4);
+}
+
+int kitserv_httpdate_parse(const char* str, time_t* time)
+{
+    int weekday = 0;
+    int month = 0;
+    int day, century, year, hour, minute, second;
+
+    // every field is at a fixed offset, so check that there are enough characters for all of them first
+    if (strnlen(str, HTTPDATE_LEN) < HTTPDATE_LEN || memcmp(&str[3], ", ", 2) || str[7] != ' ' || str[11] != ' ' ||
+        str[16] != ' ' || str[19] != ':' || str[22] != ':' || memcmp(&str[25], " GMT", 4)) {
+        return -1;
+    }
+    while (weekday < 7 && memcmp(str, &day_names[weekday * 3], 3)) {
+        weekday++;
+    }
+    while (month < 12 && memcmp(&str[8], &month_names[month * 3], 3)) {
+        month++;
+    }
+    day = parse_two_digits(&str[5]);
+    century = parse_two_digits(&str[12]);
+    year = parse_two_digits(&str[14]);
+    hour = parse_two_digits(&str[17]);
+    minute = parse_two_digits(&str[20]);
+    second = parse_two_digits(&str[23]);
+    // the day of the week is redundant, so like strptime, don't hold it against the date if they disagree
+    if (weekday == 7 || month == 12 || day < 1 || day > 31 || century < 0 || year < 0 || hour < 0 || hour > 23 ||
+        minute < 0 || minute > 59 || second < 0 || second > 60) {
+        return -1;
+    }
+
+    *time = days_from_civil(century * 100 + year, month + 1, day) * SECONDS_PER_DAY + hour * 3600 + minute * 60 +
+            second;
+    return 0;
+}
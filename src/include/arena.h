@@ -0,0 +1,61 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_ARENA_H
+#define KITSERV_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * How the memory of an arena ended up being backed.
+ */
+enum arena_backing {
+    ARENA_HUGETLB = 0,  // explicit huge pages
+    ARENA_THP,          // regular pages, with transparent huge pages requested
+    ARENA_PAGES,        // regular pages
+};
+
+/**
+ * Fixed-size region of memory that is carved up once and never freed piecemeal.
+ * Not thread-safe: each worker keeps its own arena, mapped from its own thread so that the memory is local to it.
+ */
+typedef struct {
+    char* base;
+    size_t size;
+    size_t used;
+    enum arena_backing backing;
+} arena_t;
+
+/**
+ * Map an arena of at least `size` bytes, preferring huge pages. Pages are faulted in up front if `prefault` is set,
+ * which places them on the calling thread's NUMA node (the first toucher) under the default memory policy. Nothing
+ * binds them there, or keeps the thread on that node.
+ * Returns 0 on success, -1 on error.
+ */
+int kitserv_arena_init(arena_t* arena, size_t size, bool prefault);
+
+/**
+ * Unmap the given arena, invalidating everything allocated from it.
+ */
+void kitserv_arena_free(arena_t* arena);
+
+/**
+ * Allocate `size` bytes from the arena, aligned to `align` (a power of two).
+ * Returns NULL if the arena is exhausted.
+ */
+void* kitserv_arena_alloc(arena_t* arena, size_t size, size_t align);
+
+/**
+ * Returns true if the given pointer was allocated from the arena.
+ */
+static inline bool kitserv_arena_contains(arena_t* arena, const void* ptr)
+{
+    return arena->base && (const char*)ptr >= arena->base && (const char*)ptr < arena->base + arena->size;
+}
+
+/**
+ * Get a printable name for an arena backing.
+ */
+const char* kitserv_arena_backing_name(enum arena_backing backing);
+
+#endif
@@ -0,0 +1,105 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_BODYCACHE_H
+#define KITSERV_BODYCACHE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * Identifies one version of a file: a change to its contents is assumed to change its size or modification time.
+ */
+struct body_key {
+    dev_t dev;
+    ino_t ino;
+    off_t size;             // of the file itself
+    struct timespec mtime;
+    int encoding;           // content coding the body is sent in, as stored or compressed on the fly (see encoding.h)
+};
+
+/**
+ * The body of a small file, optionally followed by the response headers that go with it.
+ * Reference counted, so that one that is evicted stays valid while it is being sent.
+ */
+struct body_entry {
+    struct body_entry* hash_next;
+    struct body_key key;
+    unsigned int hash;
+    unsigned int clock_index;  // position in the clock
+    int refs;                  // one for the cache while it's cached, one per transaction sending it
+    bool referenced;           // used since the clock hand last passed
+    size_t len;                // of data
+    const char* headers;       // stored after data, NULL if none
+    int headers_len;
+    char data[];
+};
+
+/**
+ * Per-worker cache of small file bodies, evicted by CLOCK once they exceed the budget.
+ * Not thread-safe: each worker keeps its own cache (although the counters may be read from anywhere).
+ */
+typedef struct {
+    struct body_entry** buckets;
+    unsigned int mask;
+    struct body_entry** clock;  // every cached entry, in no particular order
+    unsigned int count;
+    unsigned int clock_max;
+    unsigned int hand;
+    size_t used;
+    size_t budget;    // total bytes of bodies, 0 if the cache is disabled
+    size_t max_size;  // largest body that is cached
+    atomic_ulong hits;
+    atomic_ulong misses;
+} bodycache_t;
+
+/**
+ * Initialize a cache of up to budget bytes (0 to disable it), for files of up to max_size bytes.
+ * Returns 0 on success, -1 on error.
+ */
+int kitserv_bodycache_init(bodycache_t* cache, size_t budget, size_t max_size);
+
+/**
+ * Returns true if the given file is small enough to be cached (which the cache must be enabled for).
+ */
+static inline bool kitserv_bodycache_eligible(bodycache_t* cache, const struct body_key* key)
+{
+    return cache->budget > 0 && (size_t)key->size <= cache->max_size;
+}
+
+/**
+ * Look up the body of an eligible file, counting a hit or a miss.
+ * Returns the entry, or NULL if it is not cached. The entry is not referenced.
+ */
+struct body_entry* kitserv_bodycache_lookup(bodycache_t* cache, const struct body_key* key);
+
+/**
+ * Read the body of an eligible file from fd into the cache, evicting others as needed.
+ * Returns the new entry (not referenced), or NULL if it couldn't be read in full.
+ */
+struct body_entry* kitserv_bodycache_fill(bodycache_t* cache, const struct body_key* key, int fd);
+
+/**
+ * Copy len bytes of data into the cache as the body of an eligible file, along with headers_len bytes of response
+ * headers (headers may be NULL), evicting others as needed.
+ * Returns the new entry (not referenced), or NULL on error.
+ */
+struct body_entry* kitserv_bodycache_insert(bodycache_t* cache, const struct body_key* key, const char* data,
+                                            size_t len, const char* headers, int headers_len);
+
+/**
+ * Take a reference to an entry, to keep using its data.
+ */
+static inline void kitserv_bodycache_acquire(struct body_entry* entry)
+{
+    entry->refs++;
+}
+
+/**
+ * Drop a reference to an entry taken with kitserv_bodycache_acquire.
+ */
+void kitserv_bodycache_release(struct body_entry* entry);
+
+#endif
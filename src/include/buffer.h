@@ -4,12 +4,14 @@
 #define KITSERV_BUFFER_H
 
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
 typedef struct {
     char* buf;
     off_t len;
     off_t max;
+    bool borrowed;  // buf belongs to someone else (e.g. a pool), so it is copied out when growing and never freed
 } buffer_t;
 
 /**
@@ -19,7 +21,12 @@ typedef struct {
 int kitserv_buffer_init(buffer_t* buffer, off_t initial_size);
 
 /**
- * Free the given buffer.
+ * Use memory that belongs to someone else as the buffer, until it needs to grow.
+ */
+void kitserv_buffer_borrow(buffer_t* buffer, char* buf, off_t size);
+
+/**
+ * Free the given buffer (unless it is borrowed).
  */
 void kitserv_buffer_free(buffer_t* buffer);
 
@@ -0,0 +1,51 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_BUFPOOL_H
+#define KITSERV_BUFPOOL_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+/**
+ * Cache of fixed-size buffers, for buffers that are only needed while a transaction is active.
+ * Not thread-safe: each worker keeps its own pools.
+ */
+typedef struct {
+    void* first_free;      // free buffers are linked through their first bytes, NULL if none
+    size_t size;           // size of each buffer
+    unsigned int num_free;
+    unsigned int max_free;  // free buffers beyond this are given back to the system
+    unsigned int num_out;   // buffers currently handed out
+    arena_t* arena;         // buffers seeded from here are always kept, NULL if none
+} bufpool_t;
+
+/**
+ * Initialize an empty pool of `size` byte buffers, keeping up to `max_free` of them around while unused.
+ */
+void kitserv_bufpool_init(bufpool_t* pool, size_t size, unsigned int max_free);
+
+/**
+ * Free the given pool. Buffers that are still handed out are not freed.
+ */
+void kitserv_bufpool_free(bufpool_t* pool);
+
+/**
+ * Add `count` buffers carved from the given arena to the pool. These are never given back to the system.
+ * A pool can only be seeded from one arena.
+ * Returns 0 on success, -1 if the arena ran out (some buffers may have been added).
+ */
+int kitserv_bufpool_seed(bufpool_t* pool, arena_t* arena, unsigned int count);
+
+/**
+ * Take a buffer from the pool, allocating one if none are free.
+ * Returns NULL on error.
+ */
+void* kitserv_bufpool_get(bufpool_t* pool);
+
+/**
+ * Return a buffer taken with kitserv_bufpool_get. Does nothing if buf is NULL.
+ */
+void kitserv_bufpool_put(bufpool_t* pool, void* buf);
+
+#endif
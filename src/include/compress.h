@@ -0,0 +1,37 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_COMPRESS_H
+#define KITSERV_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "buffer.h"
+#include "encoding.h"
+
+/**
+ * Returns true if responses can be compressed on the fly (kitserv was built with zlib, see KITSERV_ZLIB).
+ */
+bool kitserv_compress_available(void);
+
+/**
+ * Returns true if a response of the given MIME type (as in Content-Type, optionally followed by parameters) is worth
+ * compressing, i.e. is not already compressed like most image, audio and video formats.
+ */
+bool kitserv_compress_mime_type(const char* mime_type);
+
+/**
+ * Compress len bytes of data with the given encoding (gzip or deflate) and zlib level into out, which is initialized
+ * to the right size and must be freed by the caller on success.
+ * Returns 0 on success, -1 on error.
+ */
+int kitserv_compress_buffer(enum content_encoding encoding, int level, const char* data, size_t len, buffer_t* out);
+
+/**
+ * Compress the first size bytes of the file open at fd as above, reading it a chunk at a time.
+ * Returns 0 on success, -1 on error (including if the file is shorter than size).
+ */
+int kitserv_compress_fd(enum content_encoding encoding, int level, int fd, off_t size, buffer_t* out);
+
+#endif
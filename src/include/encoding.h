@@ -0,0 +1,45 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_ENCODING_H
+#define KITSERV_ENCODING_H
+
+#include <stddef.h>
+
+/**
+ * Content codings that static files may be stored in, next to the original (as name.br, name.gz, ...), or that
+ * responses may be compressed in on the fly (gzip and deflate, see compress.h).
+ * In order of preference, when the client accepts several.
+ */
+enum content_encoding {
+    ENCODING_BR = 0,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,  // only on the fly: there are no .deflate files to look for
+    ENCODING_COUNT,
+    ENCODING_IDENTITY = -1,  // none, the file is sent as is
+};
+
+#define ENCODING_BIT(encoding) (1u << (encoding))
+
+/**
+ * Get the name of an encoding, as in Content-Encoding.
+ */
+static inline const char* kitserv_encoding_name(enum content_encoding encoding)
+{
+    return encoding == ENCODING_BR ? "br" : encoding == ENCODING_GZIP ? "gzip" : "deflate";
+}
+
+/**
+ * Get the suffix that a precompressed file has in this encoding, or NULL if files aren't stored in it.
+ */
+static inline const char* kitserv_encoding_suffix(enum content_encoding encoding)
+{
+    return encoding == ENCODING_BR ? ".br" : encoding == ENCODING_GZIP ? ".gz" : NULL;
+}
+
+/**
+ * Parse the value of an Accept-Encoding header.
+ * Returns the set of ENCODING_BITs that the client accepts (q > 0), either by name or through *.
+ */
+unsigned int kitserv_encoding_parse_accept(const char* value);
+
+#endif
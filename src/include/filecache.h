@@ -0,0 +1,159 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_FILECACHE_H
+#define KITSERV_FILECACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/**
+ * A cached file: its metadata, and an open read-only fd that any number of transactions may send from at once.
+ * Entries are reference counted, so that one dropped from the cache stays valid until the last transaction is done.
+ * A missing entry instead records that there is no regular file at its path (and has no fd or metadata).
+ */
+struct file_entry {
+    struct file_entry* hash_next;
+    struct file_entry* lru_prev;    // towards the least recently used
+    struct file_entry* lru_next;
+    struct file_entry* watch_prev;  // other entries in the same directory
+    struct file_entry* watch_next;
+    unsigned int hash;
+    int refs;             // one for the cache while it's cached, one per transaction using fd
+    bool cached;          // still in the cache (otherwise, freed once refs reaches zero)
+    int fd;               // -1 if missing
+    struct stat st;
+    long validated_ms;    // when st was last known to be correct (only kept with a TTL)
+    int resolved;         // for missing entries: see kitserv_filecache_get_resolved
+    unsigned int resolved_generation;
+    char* headers;        // for files: response headers preformatted by the caller (malloc'd, freed with the entry)
+    int headers_len;
+    int headers_variant;  // whatever the caller formatted headers for
+    int watch;            // inotify watch descriptor of the deepest existing directory, -1 if not watched
+    int name_off;         // start of the path component below that directory (for files, the file name)
+    int name_len;
+    int path_len;
+    char path[];
+};
+
+/**
+ * Least recently used order of one kind of entry.
+ */
+struct filecache_lru {
+    struct file_entry* head;  // least recently used
+    struct file_entry* tail;  // most recently used
+    unsigned int count;
+};
+
+/**
+ * Per-worker cache of open files, keyed on their full path.
+ * Paths that turned out not to be regular files are cached as well, apart from the files so that a stream of misses
+ * can't evict them.
+ * Changes are noticed through inotify watches on the directories of cached files, and/or by re-checking entries that
+ * are older than a TTL (for filesystems that inotify can't watch, such as network mounts).
+ * Not thread-safe: each worker keeps its own cache.
+ */
+typedef struct {
+    struct file_entry** buckets;
+    unsigned int mask;
+    unsigned int max_entries;     // of each kind, 0 if the cache is disabled
+    struct filecache_lru files;
+    struct filecache_lru missing;
+    unsigned int generation;      // bumped whenever a change on disk drops entries, or a missing one is evicted
+    int ttl_ms;                   // 0 to trust inotify alone
+    int inotify_fd;               // -1 if not using inotify
+    struct file_entry** watches;  // entries in each watched directory, indexed by watch descriptor
+    int num_watches;              // size of watches
+} filecache_t;
+
+/**
+ * Initialize a cache holding up to max_entries files and as many missing paths (0 to disable it), re-checking entries
+ * every ttl_ms (0 to rely on inotify alone). If inotify is not available, a TTL is required for the cache to be
+ * enabled.
+ * Returns 0 on success, -1 on error.
+ */
+int kitserv_filecache_init(filecache_t* cache, unsigned int max_entries, int ttl_ms);
+
+/**
+ * Returns true if the cache is enabled.
+ */
+static inline bool kitserv_filecache_enabled(filecache_t* cache)
+{
+    return cache->max_entries > 0;
+}
+
+/**
+ * Get the fd to wait on for invalidation events, or -1 if there is none.
+ */
+static inline int kitserv_filecache_event_fd(filecache_t* cache)
+{
+    return cache->inotify_fd;
+}
+
+/**
+ * Invalidate cached entries according to any pending events on the event fd.
+ */
+void kitserv_filecache_process_events(filecache_t* cache);
+
+/**
+ * Look up a path (of length len).
+ * Returns the entry, which may be missing, or NULL if it is not cached (or is no longer valid).
+ * The entry is not referenced.
+ */
+struct file_entry* kitserv_filecache_lookup(filecache_t* cache, const char* path, int len);
+
+/**
+ * Returns true if the entry records that there is no regular file at its path.
+ */
+static inline bool kitserv_filecache_missing(struct file_entry* entry)
+{
+    return entry->fd < 0;
+}
+
+/**
+ * Cache an open file at the given path (of length len), taking ownership of fd if successful.
+ * root_len is the length of the prefix of path that the server is rooted at: every directory below it is watched, so
+ * that renaming any of them invalidates the entry.
+ * Returns the new entry, or NULL if it wasn't cached (in which case the fd still belongs to the caller).
+ */
+struct file_entry* kitserv_filecache_insert(filecache_t* cache, const char* path, int len, int root_len, int fd,
+                                            const struct stat* st);
+
+/**
+ * Cache that there is no regular file at the given path (of length len), with root_len as above.
+ * Returns the new entry, or NULL if it wasn't cached.
+ */
+struct file_entry* kitserv_filecache_insert_missing(filecache_t* cache, const char* path, int len, int root_len);
+
+/**
+ * Get what the caller recorded with kitserv_filecache_set_resolved for a missing entry, or -1 if that may be outdated.
+ * Any change on disk that drops entries from the cache also forgets every recorded value.
+ */
+static inline int kitserv_filecache_get_resolved(filecache_t* cache, struct file_entry* entry)
+{
+    return entry->resolved_generation == cache->generation ? entry->resolved : -1;
+}
+
+/**
+ * Record a non-negative value on a missing entry, such as which alternative path was served in its place.
+ */
+static inline void kitserv_filecache_set_resolved(filecache_t* cache, struct file_entry* entry, int resolved)
+{
+    entry->resolved = resolved;
+    entry->resolved_generation = cache->generation;
+}
+
+/**
+ * Take a reference to an entry, to keep using its fd.
+ */
+static inline void kitserv_filecache_acquire(struct file_entry* entry)
+{
+    entry->refs++;
+}
+
+/**
+ * Drop a reference to an entry taken with kitserv_filecache_acquire.
+ */
+void kitserv_filecache_release(struct file_entry* entry);
+
+#endif
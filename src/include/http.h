@@ -7,13 +7,24 @@
 #include <stdbool.h>
 #include <sys/uio.h>
 
+#include "arena.h"
+#include "bodycache.h"
 #include "buffer.h"
+#include "bufpool.h"
+#include "filecache.h"
 #include "kitserv.h"
+#include "manifest.h"
+#include "query.h"
+#include "router.h"
 
 #define HTTP_BUFSZ (4096)
 #define HTTP_BUFSZ_SMALL (256)
 
 #define HTTP_MAX_COOKIES (50)
+#define HTTP_MAX_RANGES KITSERV_MAX_RANGES  // per request, the most that http_worker_config.max_ranges may allow
+
+#define HTTP_BUFPOOL_MAX_FREE (1024)  // per worker and buffer size
+#define HTTP_HEADERS_TAIL_MAX (64)
 
 enum http_transaction_state {
     HTTP_STATE_READ = 0,
@@ -34,6 +45,17 @@ enum http_parse_state {
     HTTP_PS_REQ_HEAD_LF,  // reading header, unterminated CR
 };
 
+/**
+ * What a connection is currently waiting on, used to pick its timeout.
+ */
+enum http_client_phase {
+    HTTP_PHASE_IDLE = 0,  // keep-alive connection waiting for its next request
+    HTTP_PHASE_HEADERS,   // receiving a request's headers
+    HTTP_PHASE_BODY,      // API handler waiting on the request payload
+    HTTP_PHASE_SEND,      // sending the response
+    HTTP_PHASE_COUNT,
+};
+
 enum http_version {
     HTTP_1_1 = 0,
     HTTP_1_0,
@@ -45,6 +67,20 @@ struct http_cookie {
     int keylen;
 };
 
+/**
+ * A part of a multipart/byteranges response: its delimiter and headers, followed by a range of the file.
+ */
+struct http_range {
+    off_t from;
+    off_t to;      // inclusive, or from - 1 for the closing delimiter (which has no range)
+    int head_off;  // where the delimiter and headers are in client.resp_body
+    int head_len;
+};
+
+/**
+ * Transaction state that every request goes through: parsing progress, the response, and send progress.
+ * Kept compact, and wiped in full between transactions.
+ */
 struct http_transaction {
     enum http_transaction_state state;
     enum http_parse_state parse_state;
@@ -55,43 +91,65 @@ struct http_transaction {
     char* req_payload;    // pointer past the end of the headers (same buffer), where overread payload info will be
     int req_payload_pos;  // index consumed past req_payload
     int req_payload_len;  // number of bytes to available to read past req_payload
-    off_t req_content_len;
     char* req_parse_blk;
     char* req_parse_iter;
-    // for the following: NULL if not found, or null-terminated string inside req_headers
-    char* req_path;
-    char* req_query;
-    char* req_mimetype;
-    char* req_range;
-    char* req_disposition;
-    char* req_modified_since;
-    char* req_fresh_cookies;
-    int req_num_cookies;
+    char* req_path;              // null-terminated string inside req_headers
+    unsigned int req_encodings;  // ENCODING_BITs accepted by the client (see encoding.h)
 
     /* Response fields */
     enum kitserv_http_response_status resp_status;
-    /**
-     * Start line, header, and body io information (in that order).
-     * Lengths should always be kept up to date, representing unsent information.
-     * Exception to the above: the body is tracked by resp_body_{pos,end} until sending begins.
-     * The base is only relevant when sending - do not use otherwise.
-     */
-    struct iovec resp_bufs[3];
     /**
      * content-length header:
-     *      if resp_fd == 0, set to `client.resp_body.len - client.ta.resp_body_pos`
+     *      if resp_fd == 0 and there is no resp_cached, set to `client.resp_body.len - client.ta.resp_body_pos`
      *      otherwise, set to `client.ta.resp_body_end - client.ta.resp_body_pos + 1`
+     *      for multipart responses, set to the total of every part's headers and range
      *
      * sending:
+     *      if resp_cached is set, send its data from client.ta.resp_body_pos to client.ta.resp_body_end
      *      if resp_fd == 0, send the contents of client.resp_body.buf from client.ta.resp_body_pos to its end
      *      otherwise, send from client.ta.resp_body_pos to client.ta.resp_body_end in the file
+     *      for multipart responses, the above applies to each part in turn, after sending its headers from resp_body
      *
      * hint: for HEAD requests on an fd, use a negative resp_fd
      */
     int resp_fd;
     off_t resp_body_pos;  // send progress, initial value of range start, always used
     off_t resp_body_end;  // final offset when sending fd, end of range or content length
+    /**
+     * Start line, header, and body io information (in that order).
+     * Lengths should always be kept up to date, representing unsent information.
+     * Exception to the above: the body is tracked by resp_body_{pos,end} until sending begins.
+     * The base is only relevant when sending - do not use otherwise.
+     */
+    struct iovec resp_bufs[3];
+
+    struct file_entry* resp_file;         // the cache entry that resp_fd belongs to, if any
+    struct snapshot_hold* resp_snapshot;  // the snapshot that resp_fd belongs to, if any
+    struct body_entry* resp_cached;       // the file's body, when sent from memory (resp_fd is then 0)
+
+    bool cold_dirty;  // something was written to the client's ta_cold, which must be wiped too
+};
+
+/**
+ * Transaction state that most requests never touch: optional headers, and bookkeeping for API handlers.
+ * Only wiped between transactions if it was written to, so write to it through kitserv_http_ta_cold.
+ */
+struct http_transaction_cold {
+    off_t req_content_len;
+    // for the following: NULL if not found, or null-terminated string inside req_headers
+    char* req_query;  // still URL-encoded, see kitserv_http_parse_query and kitserv_http_decode_query
+    char* req_mimetype;
+    char* req_range;
+    char* req_disposition;
+    char* req_modified_since;
+    char* req_if_none_match;
+    char* req_if_range;
+    char* req_fresh_cookies;
+    int req_num_cookies;
+
     bool range_requested;
+    int resp_num_parts;  // in client.resp_ranges, counting the closing delimiter, or 0 if the response isn't multipart
+    int resp_part;       // the part being sent
     /**
      * Preserve the headers or body (resp_body or resp_fd) for sending the result. Normally, both are wiped.
      * Note that some headers are added when the body is discarded, and should not be set by preserved headers:
@@ -104,38 +162,124 @@ struct http_transaction {
     kitserv_api_handler_t
         api_endpoint_hit;     // for re-calling API functions without re-parsing tree, and tracking if run at all
     void* api_internal_data;  // data pointer for API requests - NULL on first call
+    const struct router_route* api_route;                // the endpoint hit, for the names of its parameters
+    struct router_capture api_params[ROUTER_MAX_PARAMS];  // what they captured of the path, inside req_headers
     int api_allow_flags;      // http_method bits, used in case parsing matched an endpoint but not method(s)
+    bool api_compress;        // the endpoint hit wants its responses compressed
+    bool timed_out;           // the API handler is being called one last time to clean up after a timeout
 };
 
-struct kitserv_client {
-    char* req_headers;                // persistent request header information (HTTP_BUFSZ)
-    struct http_cookie* req_cookies;  // number of cookies is stored in ta - this is here to be a reusable buffer
+/**
+ * A worker's reference to a snapshot, counted without atomics: one use for the worker while it is current, and one
+ * per transaction sending one of its files.
+ */
+struct snapshot_hold {
+    manifest_t* manifest;
+    int users;
+};
 
-    char* resp_start;    // response start buffer (HTTP_BUFSZ_SMALL)
-    char* resp_headers;  // response headers buffer (HTTP_BUFZ)
-    buffer_t resp_body;  // response body buffer (at least HTTP_BUFZ, may grow)
+/**
+ * Sizes of a worker's caches, and how it compresses responses (see kitserv_config).
+ */
+struct http_worker_config {
+    unsigned int file_cache_entries;  // static files kept open (see filecache.h)
+    int file_cache_ttl_ms;            // how often they are re-checked, 0 to trust inotify alone
+    size_t body_cache_bytes;          // small static files kept in memory (see bodycache.h)
+    size_t body_cache_max_file;       // largest of them
+    int compress_level;               // zlib level to compress responses at on the fly, 0 not to (see compress.h)
+    size_t compress_min_size;         // smallest body worth compressing
+    size_t compress_cache_bytes;      // compressed static files kept in memory, 0 to only compress API responses
+    size_t compress_max_file;         // largest static file compressed
+    int max_ranges;                   // most ranges a request may ask for at once, or it is sent the whole file
+};
 
-    struct http_transaction ta;
+/**
+ * HTTP state belonging to one worker, shared by all of its clients (and only ever used from that worker's thread).
+ */
+struct http_worker {
+    const struct http_worker_config* config;
+    bufpool_t bufs_small;              // HTTP_BUFSZ_SMALL buffers
+    bufpool_t bufs;                    // HTTP_BUFSZ buffers
+    filecache_t files;                 // open static files
+    bodycache_t bodies;                // contents of small static files
+    bodycache_t compressed;            // static files compressed on the fly, with their headers
+    struct snapshot_hold* snapshot;    // what the default context is served from, NULL if not in snapshot mode
+    unsigned int snapshot_generation;  // see kitserv_manifest_generation
+    uint64_t boundary_seed;            // for the boundaries of multipart responses, bumped for each of them
+    time_t date;                       // second that headers_tail is dated (see kitserv_http_update_date)
+    char headers_tail[HTTP_HEADERS_TAIL_MAX];  // what the headers of every response end with, after content-length
+};
+
+/**
+ * The buffers of a client are taken from its worker's pools only while they are needed, and are NULL otherwise.
+ * An idle keep-alive connection holds none of them.
+ *
+ * Everything that a typical request touches comes first, starting on its own cache line.
+ */
+struct kitserv_client {
+    _Alignas(64) struct http_transaction ta;
+    int sockfd;
     /**
      * req_headers_len is stored here because it may persist across transactions
      * note that it is not always up-to-date: it is only up to date between request start and the beginning of the last
      * call to parse headers (as there is no need to update it after that, until a new transaction begins)
      */
     int req_headers_len;
+    char* req_headers;  // persistent request header information (HTTP_BUFSZ), kept for pipelined data
+    char* resp_start;   // response start buffer (HTTP_BUFSZ_SMALL)
+    char* resp_headers;  // response headers buffer (HTTP_BUFSZ)
+    buffer_t resp_body;  // response body buffer (borrows resp_body_block, may grow past it)
+    char* resp_body_block;  // HTTP_BUFSZ pool buffer backing resp_body
+    struct http_worker* worker;  // serving this connection, whose pools and caches it uses (set again on each accept)
+    unsigned int num_transactions;  // completed on this connection
 
-    int sockfd;
+    struct http_transaction_cold ta_cold;
+    struct http_cookie* req_cookies;  // number of cookies is stored in ta_cold - taken when cookies are first parsed
+    query_index_t* req_query_index;   // the query split into parameters - taken when they are first looked up
+    char* req_query_decoded;          // the query decoded as a whole - taken when it is first asked for
+    struct http_range* resp_ranges;   // number of parts is stored in ta_cold - taken when a range has several parts
 };
 
 /**
- * Initalize HTTP system. Use NULL to disable API endpoints.
+ * Get the cold part of a client's transaction for writing, marking it to be wiped once the transaction is over.
+ */
+static inline struct http_transaction_cold* kitserv_http_ta_cold(struct kitserv_client* client)
+{
+    client->ta.cold_dirty = true;
+    return &client->ta_cold;
+}
+
+/**
+ * Initalize HTTP system, compiling the API tree. Use NULL to disable API endpoints.
  */
 void kitserv_http_init(struct kitserv_request_context* http_default_context, struct kitserv_api_tree* http_api_list);
 
 /**
- * Allocate the internal structures of a client and its associated transaction.
+ * Build a snapshot of the default context's root, and serve it from there instead of the filesystem.
+ * Replaces any previous snapshot, which is released once no transaction is using it.
+ * Returns 0 on success, -1 on failure (keeping any previous snapshot).
+ */
+int kitserv_http_load_snapshot(void);
+
+/**
+ * Initialize the HTTP state of a worker, with caches sized according to config (which must outlive the worker).
+ * If an arena is given, num_buffers buffers of each size are preallocated from it (NULL for none).
+ * Returns 0 on success, -1 on failure.
+ */
+int kitserv_http_create_worker(struct http_worker* worker, arena_t* arena, unsigned int num_buffers,
+                               const struct http_worker_config* config);
+
+/**
+ * Refresh the Date header that a worker sends, if the second has changed since.
+ * Called from the event loop before serving each batch of events, so that responses never read the clock themselves.
+ */
+void kitserv_http_update_date(struct http_worker* worker);
+
+/**
+ * Initialize a client and its associated transaction, to be served by the given worker.
  * Returns 0 on success, -1 on failure.
  */
-int kitserv_http_create_client_struct(struct kitserv_client*);
+int kitserv_http_create_client_struct(struct kitserv_client*, struct http_worker* worker);
 
 /*
  * Reset a client to serve a new transaction on the same connection.
@@ -156,12 +300,38 @@ void kitserv_http_reset_client(struct kitserv_client*);
  */
 int kitserv_http_parse_range(struct kitserv_client*, off_t* out_from, off_t* out_to);
 
+/**
+ * Make sure that the client has a response body buffer to write into, taking one from its worker if it has none.
+ * Returns 0 on success, -1 on failure.
+ */
+int kitserv_http_acquire_body(struct kitserv_client* client);
+
+/**
+ * Close the response fd, or return it to the file cache if it came from there, and set it to zero.
+ * If the fd is already zero or negative, do nothing. Also drops the cached body being sent, if any.
+ */
+void kitserv_http_release_resp_fd(struct kitserv_client* client);
+
 /**
  * Parse the cookies for a request. Must be done before cookies can be used.
  * Returns 0 on success, -1 on parse error or no cookies.
  */
 int kitserv_http_parse_cookies(struct kitserv_client* client);
 
+/**
+ * Split the query of a request into its parameters, if that hasn't been done yet. Must be done before they can be
+ * looked up in client.req_query_index.
+ * Returns 0 on success, -1 on error.
+ */
+int kitserv_http_parse_query(struct kitserv_client* client);
+
+/**
+ * Decode the query of a request as a whole into client.req_query_decoded, if there is one and that hasn't been done
+ * yet.
+ * Returns 0 on success, -1 on error.
+ */
+int kitserv_http_decode_query(struct kitserv_client* client);
+
 /**
  * The following functions process a request.
  *
@@ -181,4 +351,22 @@ int kitserv_http_send_response_file(struct kitserv_client* client);
  */
 int kitserv_http_serve_client(struct kitserv_client* client);
 
+/**
+ * Best-effort: answer a socket that we have no room to serve with a canned 503 response (with retry-after).
+ * Does not close the socket.
+ */
+void kitserv_http_reject_socket(int sockfd);
+
+/**
+ * Get what the given connection is currently waiting on.
+ */
+enum http_client_phase kitserv_http_client_phase(struct kitserv_client* client);
+
+/**
+ * Handle a connection whose timeout for its current phase has passed.
+ * Partial requests are answered with a 408 response, otherwise the connection is simply dropped.
+ * Returns 0 if the connection is still alive (i.e. still sending the 408 response), -1 if it should be closed.
+ */
+int kitserv_http_expire_client(struct kitserv_client* client);
+
 #endif
@@ -0,0 +1,22 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_HTTPDATE_H
+#define KITSERV_HTTPDATE_H
+
+#include <time.h>
+
+#define HTTPDATE_LEN (29)  // as in "Sun, 06 Nov 1994 08:49:37 GMT"
+
+/**
+ * Format a time as an HTTP date (IMF-fixdate) into buf, writing exactly HTTPDATE_LEN bytes and no terminator.
+ * Times outside of years 1970 to 9999 are clamped to them.
+ */
+void kitserv_httpdate_format(char* buf, time_t time);
+
+/**
+ * Parse the HTTP date (IMF-fixdate) at the start of str into *time. Anything after it is ignored.
+ * Returns 0 on success, -1 if it is malformed.
+ */
+int kitserv_httpdate_parse(const char* str, time_t* time);
+
+#endif
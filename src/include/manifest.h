@@ -0,0 +1,125 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_MANIFEST_H
+#define KITSERV_MANIFEST_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "bodycache.h"
+#include "encoding.h"
+
+/**
+ * A precompressed sibling of a file, to send in its place.
+ */
+struct manifest_variant {
+    int entry;            // -1 if there is none in this encoding
+    const char* headers;  // as for the entry, but with the type of the original and content-encoding and vary added
+    int headers_len;
+};
+
+/**
+ * A file in a manifest, with everything needed to serve it.
+ */
+struct manifest_entry {
+    int fd;  // kept open for the life of the manifest, -1 if there weren't enough fds (reopen it from path)
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    const char* path;     // full path, as opened
+    const char* headers;  // preformatted content-type, accept-ranges, last-modified and etag headers (and vary)
+    int headers_len;
+    struct manifest_variant variants[ENCODING_COUNT];  // only with the precompressed option
+};
+
+/**
+ * A name that resolves to an entry.
+ */
+struct manifest_key {
+    uint64_t hash;
+    const char* name;
+    int name_len;
+    int entry;
+};
+
+/**
+ * Immutable snapshot of every regular file under a web root, looked up through a perfect hash.
+ * Shared between threads, and reference counted so that it outlives its replacement while still in use.
+ */
+typedef struct {
+    atomic_int refs;
+    struct manifest_entry* entries;
+    int num_entries;
+    struct manifest_key* keys;
+    int num_keys;
+    uint32_t* slots;          // key index + 1 at each position of the table, 0 if empty
+    uint32_t slot_mask;
+    uint32_t* displacements;  // per bucket, chosen so that no two keys share a slot
+    uint32_t bucket_mask;
+    int root_entry;      // what a request for / resolves to, -1 for the fallback
+    int fallback_entry;  // what any other name resolves to, -1 for none
+    char* strings;       // names, paths, and headers, all in one block
+    size_t memory;       // bytes allocated for all of the above
+} manifest_t;
+
+/**
+ * Names that a manifest resolves on top of the files themselves, as with a request context.
+ */
+struct manifest_options {
+    const char* root;
+    const char* root_fallback;  // file served for /, NULL for none
+    const char* fallback;       // file served for any other missing name, NULL for none
+    bool append_html;           // resolve name to name.html, if name itself isn't a file
+    bool precompressed;         // link name to name.br and name.gz, as variants of it
+    // formats the headers of a version of a file into buf (of size max), returning their length or -1 if they don't
+    // fit (see format_file_headers in http.c)
+    int (*format_headers)(char* buf, int max, const char* extension, const struct body_key* key, bool vary);
+};
+
+/**
+ * Walk the root and build a manifest of everything in it, with a reference for the caller.
+ * Returns the manifest, or NULL on error.
+ */
+manifest_t* kitserv_manifest_build(const struct manifest_options* options);
+
+/**
+ * Look up a name, relative to the root and without a leading slash (of length len).
+ * Returns the entry, or NULL if there is no file by that name.
+ */
+const struct manifest_entry* kitserv_manifest_lookup(const manifest_t* manifest, const char* name, int len);
+
+/**
+ * Take a reference to a manifest.
+ */
+static inline void kitserv_manifest_acquire(manifest_t* manifest)
+{
+    atomic_fetch_add_explicit(&manifest->refs, 1, memory_order_relaxed);
+}
+
+/**
+ * Drop a reference to a manifest, closing its files and freeing it once there are none left.
+ */
+void kitserv_manifest_release(manifest_t* manifest);
+
+/**
+ * Replace the current manifest, dropping the reference that was held on the old one.
+ * Takes over the caller's reference to the new one.
+ */
+void kitserv_manifest_publish(manifest_t* manifest);
+
+/**
+ * Get a reference to the current manifest (NULL if none has been published), and the generation it belongs to.
+ */
+manifest_t* kitserv_manifest_get_current(unsigned int* generation);
+
+/**
+ * Get the generation of the current manifest, which changes whenever a new one is published. Cheap to call often.
+ */
+unsigned int kitserv_manifest_generation(void);
+
+#endif
@@ -0,0 +1,33 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_MIME_H
+#define KITSERV_MIME_H
+
+#include <stdbool.h>
+
+#define MIME_EXTENSION_MAX (32)  // longest extension that can be registered, without its dot
+#define MIME_TYPE_MAX (128)      // longest type that can be registered
+
+/**
+ * A registered MIME type.
+ */
+struct mime_type {
+    const char* name;   // as sent in Content-Type
+    bool compressible;  // see kitserv_compress_mime_type, decided once when it is registered
+};
+
+/**
+ * Register the built-in types, unless that was done already.
+ * Returns 0 on success, -1 on error.
+ */
+int kitserv_mime_init(void);
+
+/**
+ * Look up the type of files with the given extension (including its dot, as found by strrchr), ignoring case.
+ * Returns the registered type, or application/octet-stream if there is none (or extension is NULL). The type stays
+ * valid, and may be kept per file, for as long as no more types are registered.
+ * Registering types is not thread-safe, but once that is done, any number of threads may look them up.
+ */
+const struct mime_type* kitserv_mime_lookup(const char* extension);
+
+#endif
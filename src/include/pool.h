@@ -0,0 +1,41 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_POOL_H
+#define KITSERV_POOL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * Lock-free multi-producer/multi-consumer stack of object indices in [0, capacity).
+ * Callers map indices to their own objects. Each index may be in the pool at most once.
+ */
+typedef struct {
+    _Alignas(64) atomic_uint_least64_t top;  // (ABA tag << 32) | (index + 1), with 0 as the empty index
+    _Alignas(64) atomic_uint* next;          // link below each index, (index + 1) as in top
+    unsigned int capacity;
+} pool_t;
+
+/**
+ * Initialize an empty pool for indices below `capacity`.
+ * Returns 0 on success, -1 on error.
+ */
+int kitserv_pool_init(pool_t* pool, unsigned int capacity);
+
+/**
+ * Free the given pool.
+ */
+void kitserv_pool_free(pool_t* pool);
+
+/**
+ * Push an index onto the pool. Safe to call from any thread.
+ */
+void kitserv_pool_push(pool_t* pool, unsigned int index);
+
+/**
+ * Pop an index from the pool into *index. Safe to call from any thread.
+ * Returns 0 on success, -1 if the pool is empty.
+ */
+int kitserv_pool_pop(pool_t* pool, unsigned int* index);
+
+#endif
@@ -0,0 +1,46 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_QUERY_H
+#define KITSERV_QUERY_H
+
+#include <stddef.h>
+
+#define QUERY_MAX_PARAMS (64)
+#define QUERY_SLOTS (QUERY_MAX_PARAMS * 2)  // a power of two, so the table is never over half full
+
+/**
+ * A parameter of a query string, decoded. Points into the query itself, unless decoding changed it.
+ * Neither key nor value is null-terminated.
+ */
+struct query_param {
+    const char* key;
+    const char* value;  // empty (but not NULL) if the parameter had no '='
+    int keylen;
+    int len;
+};
+
+/**
+ * A query string split into its parameters, which is built inside a buffer of some size: whatever room the
+ * parameters leave is used for the decoded copies of those with escapes in them.
+ */
+typedef struct {
+    int num_params;
+    unsigned char slots[QUERY_SLOTS];  // open addressing by key hash: the index of a parameter + 1, 0 if free
+    struct query_param params[QUERY_MAX_PARAMS];  // in query order
+    char decoded[];
+} query_index_t;
+
+/**
+ * Split a URL-encoded query ("key=value&key=value", without its '?') into an index built in a buffer of size bytes.
+ * Each key and value is decoded on its own, with '+' standing for a space, so escaped '&' and '=' are kept.
+ * Parameters with an empty key are skipped. Those past QUERY_MAX_PARAMS, or that don't fit, are dropped.
+ */
+void kitserv_query_index(query_index_t* index, size_t size, const char* query);
+
+/**
+ * Find the first parameter with a key (of keylen bytes).
+ * Returns the parameter, or NULL if there is none.
+ */
+const struct query_param* kitserv_query_find(const query_index_t* index, const char* key, int keylen);
+
+#endif
@@ -25,9 +25,10 @@ int kitserv_queue_init(void);
 
 /**
  * Wait for up to n events on the given queue. Returns the number of actual events, written to out_events.
+ * Gives up after timeout_ms milliseconds (returning 0), or waits indefinitely if timeout_ms is -1.
  * Returns nevents on success, -1 on error.
  */
-ssize_t kitserv_queue_wait(int qfd, queue_event* out_events, int n);
+ssize_t kitserv_queue_wait(int qfd, queue_event* out_events, int n, int timeout_ms);
 
 /**
  * Add a new file descriptor and associated data to the queue with the given condition.
@@ -47,6 +48,24 @@ int kitserv_queue_rearm(int qfd, int fd, void* data, queue_wait_cond, int shared
  */
 int kitserv_queue_remove(int qfd, int fd);
 
+/**
+ * Create a notifier: an fd that can be added to a queue (as QUEUE_IN) and woken from another thread.
+ * Returns fd on success, -1 on error.
+ */
+int kitserv_queue_notifier_init(void);
+
+/**
+ * Wake up the queue(s) waiting on the given notifier.
+ * Returns 0 on success, -1 on error.
+ */
+int kitserv_queue_notify(int nfd);
+
+/**
+ * Consume pending notifications so that the notifier can trigger again.
+ * Returns 0 on success, -1 on error.
+ */
+int kitserv_queue_notifier_drain(int nfd);
+
 /**
  * Returns the data pointer associated with an event.
  */
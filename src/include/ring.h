@@ -0,0 +1,43 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_RING_H
+#define KITSERV_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/**
+ * Lock-free single-producer/single-consumer ring of file descriptors.
+ * Exactly one thread may push and exactly one (other) thread may pop.
+ */
+typedef struct {
+    _Alignas(64) atomic_uint head;  // next index to pop, written only by the consumer
+    _Alignas(64) atomic_uint tail;  // next index to push, written only by the producer
+    _Alignas(64) unsigned int mask;
+    int* fds;
+} ring_t;
+
+/**
+ * Initialize the given ring to hold at least `capacity` fds.
+ * Returns 0 on success, -1 on error.
+ */
+int kitserv_ring_init(ring_t* ring, unsigned int capacity);
+
+/**
+ * Free the given ring.
+ */
+void kitserv_ring_free(ring_t* ring);
+
+/**
+ * Push an fd onto the ring (producer only).
+ * Returns 0 on success, -1 if the ring is full.
+ */
+int kitserv_ring_push(ring_t* ring, int fd);
+
+/**
+ * Pop an fd from the ring into *fd (consumer only).
+ * Returns 0 on success, -1 if the ring is empty.
+ */
+int kitserv_ring_pop(ring_t* ring, int* fd);
+
+#endif
@@ -0,0 +1,92 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_ROUTER_H
+#define KITSERV_ROUTER_H
+
+#include <stdbool.h>
+
+#include "kitserv.h"
+
+#define ROUTER_MAX_PARAMS (8)  // ":name" and "*" components on the way to one route
+
+/**
+ * An API endpoint, as copied from its kitserv_api_entry.
+ */
+struct router_route {
+    kitserv_api_handler_t handler;
+    int methods;                // enum kitserv_http_method bits
+    bool finishes_path;
+    bool compress;
+    int num_params;
+    const char* const* params;  // names of its captures, in path order ("*" for an unnamed wildcard)
+};
+
+/**
+ * A node of the trie, which matches its label (a run of path bytes) after those of its parent.
+ * Routes end at a node if their prefixes, joined with '/', spell out the labels from the root down to it.
+ * Parameter and wildcard nodes have no label: they match one path component, or the rest of the path.
+ */
+struct router_node {
+    int label_off;       // into labels
+    int label_len;
+    int first_child;     // children are contiguous, in order of the first byte of their label
+    int num_children;
+    int param_child;     // matches any one component that starts where this node ends, 0 if none
+    int wildcard_child;  // matches the rest of the path from where this node ends, 0 if none
+    int first_route;     // routes ending here are contiguous, in the order they were declared
+    int num_routes;
+    int methods;         // of every route ending here
+    int open_methods;    // of the routes ending here that don't have to finish the path
+};
+
+/**
+ * A part of a request path that a route captured.
+ */
+struct router_capture {
+    int off;  // from the base given to kitserv_router_match
+    int len;
+};
+
+/**
+ * An API tree compiled into a compressed radix trie over request paths, so that routing takes time proportional to
+ * the length of the path, whatever the number of routes.
+ * Immutable once compiled, so any number of threads may route through it at once.
+ */
+typedef struct {
+    struct router_node* nodes;   // the root first, NULL if there are no routes
+    unsigned char* first_bytes;  // first byte of the label of each node, to pick children by
+    char* labels;
+    struct router_route* routes;
+    const char** params;         // every route's parameter names
+    char* names;                 // which they point into
+    int num_nodes;
+    int num_routes;
+} router_t;
+
+/**
+ * Compile an API tree. The tree itself is not referenced afterwards.
+ * Returns 0 on success, -1 on error (EINVAL if a prefix contains '/' or NUL, has a negative length, is a "*" that
+ * isn't an entry's, or a route has more than ROUTER_MAX_PARAMS parameters).
+ */
+int kitserv_router_compile(router_t* router, const struct kitserv_api_tree* tree);
+
+/**
+ * Returns true if the router has any routes.
+ */
+static inline bool kitserv_router_enabled(const router_t* router)
+{
+    return router->num_routes > 0;
+}
+
+/**
+ * Find the route for a request, given its path (without leading slashes, somewhere after base) and method.
+ * Matches the path one '/'-separated component at a time, like iterating the tree. At each level, its entries are
+ * tried before its subtrees, exact prefixes before ":name" ones. A subtree that matches no entry (nor any method)
+ * falls back to the next kind of prefix, and "*" entries are tried once there is none left.
+ * Returns the route, with its captures (as offsets from base) written to captures. Otherwise, returns NULL and sets
+ * *allowed to the methods that the path did match endpoints for (for a 405 response), or 0 if it matched none.
+ */
+const struct router_route* kitserv_router_match(const router_t* router, const char* base, const char* path,
+                                                int method, struct router_capture* captures, int* allowed);
+
+#endif
@@ -0,0 +1,24 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_SCAN_H
+#define KITSERV_SCAN_H
+
+/**
+ * Byte scanning kernels for the request parser.
+ * These use AVX2 or SSE2 when the build targets them, falling back to plain loops otherwise.
+ * None of them read outside of [p, end).
+ */
+
+/**
+ * Find the first occurrence of c in [p, end).
+ * Returns a pointer to it, or end if there is none.
+ */
+char* kitserv_scan_char(char* p, char* end, char c);
+
+/**
+ * Find the first byte in [p, end) that is not printable ASCII (i.e. outside of ' ' to '~').
+ * Returns a pointer to it, or end if there is none.
+ */
+char* kitserv_scan_nonprint(char* p, char* end);
+
+#endif
@@ -7,9 +7,10 @@
 
 /**
  * Set up a listen socket on the given port. Bind IPv6 and enable nonblocking accepts if indicated.
+ * With reuse_port, SO_REUSEPORT is set so that several sockets can share the port (the kernel balances between them).
  * Returns socket fd on success, or -1 on error.
  */
-int kitserv_socket_prepare(const char* port_string, bool use_ipv6, bool nonblocking_accepts);
+int kitserv_socket_prepare(const char* port_string, bool use_ipv6, bool nonblocking_accepts, bool reuse_port);
 
 /**
  * Accept a new client on the given socket.
@@ -0,0 +1,93 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#ifndef KITSERV_TIMER_H
+#define KITSERV_TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS (100)
+#define TIMER_WHEEL_BITS (6)
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS (4)  // 64^4 ticks of 100ms, about 19 days
+
+/**
+ * Get the struct containing a given timer.
+ */
+#define timer_entry(ptr, type, member) ((type*)((char*)(ptr)-offsetof(type, member)))
+
+/**
+ * A timer, to be embedded in whatever it times out.
+ * Must be initialized with kitserv_timer_init before use.
+ */
+struct timer {
+    struct timer* next;  // NULL if not scheduled
+    struct timer* prev;
+    uint64_t expires;  // tick at which this timer fires
+};
+
+/**
+ * Hierarchical timer wheel. All operations on scheduled timers are O(1).
+ * Not thread safe - each wheel should belong to a single thread.
+ */
+typedef struct {
+    uint64_t now;    // last tick that has been processed
+    uint64_t clock;  // current tick, as of the last update (timers are scheduled relative to this)
+    int count;       // number of scheduled timers
+    struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // list sentinels
+} timer_wheel_t;
+
+typedef void (*timer_expire_t)(struct timer* timer, void* data);
+
+/**
+ * Get the current monotonic time in milliseconds.
+ */
+uint64_t kitserv_timer_now(void);
+
+/**
+ * Initialize a wheel with no timers, starting at the given time (from kitserv_timer_now).
+ */
+void kitserv_timer_wheel_init(timer_wheel_t* wheel, uint64_t now_ms);
+
+/**
+ * Initialize a timer as unscheduled.
+ */
+void kitserv_timer_init(struct timer* timer);
+
+/**
+ * Returns true if the timer is currently scheduled.
+ */
+static inline bool kitserv_timer_pending(const struct timer* timer)
+{
+    return timer->next != NULL;
+}
+
+/**
+ * Schedule (or reschedule) a timer to fire after timeout_ms (rounded up to the next tick).
+ */
+void kitserv_timer_schedule(timer_wheel_t* wheel, struct timer* timer, int timeout_ms);
+
+/**
+ * Unschedule a timer. Does nothing if it is not scheduled.
+ */
+void kitserv_timer_cancel(timer_wheel_t* wheel, struct timer* timer);
+
+/**
+ * Tell the wheel the current time (from kitserv_timer_now), without firing anything yet.
+ */
+void kitserv_timer_update(timer_wheel_t* wheel, uint64_t now_ms);
+
+/**
+ * Advance the wheel to the time of the last update, calling expire for each timer that has come due.
+ * Timers are unscheduled before expire is called, so expire may freely reschedule them.
+ */
+void kitserv_timer_advance(timer_wheel_t* wheel, timer_expire_t expire, void* data);
+
+/**
+ * Get the timeout to wait for (e.g. for kitserv_queue_wait) before the wheel needs to advance.
+ * Returns -1 if there are no timers scheduled.
+ */
+int kitserv_timer_wait_timeout(const timer_wheel_t* wheel);
+
+#endif
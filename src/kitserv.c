@@ -14,40 +14,93 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 
+#include "arena.h"
+#include "compress.h"
 #include "http.h"
+#include "mime.h"
+#include "pool.h"
 #include "queue.h"
+#include "ring.h"
 #include "socket.h"
+#include "timer.h"
 
 #define MAX_EVENTS (64)
+#define MAGAZINE_SIZE (16)       // free connections a worker keeps at hand, see connection_accept
+#define HANDOFF_RING_MAX (4096)  // most connections in flight from one accept thread to one worker
 
 bool kitserv_silent_mode = false;
 
-static int slots;
+static int slots_per_worker;  // connections each worker allocates at startup
+static enum kitserv_accept_mode accept_mode;
+static int phase_timeouts[HTTP_PHASE_COUNT];  // in ms, 0 if disabled
+static int reap_watermark;
+static bool use_arena;
+static bool prefault_arena;
+static int arena_buffers;
+static struct http_worker_config worker_config;
 static pthread_barrier_t startup_barrier;
 
+struct lru_link {
+    struct lru_link* prev;  // towards the least recently active
+    struct lru_link* next;  // NULL if not linked
+};
+
 struct connection {
-    struct connection* next_conn;
+    unsigned int pool_index;            // position in connection_table
+    struct timer timer;                 // deadline for the current phase
+    struct lru_link idle_link;          // position in the worker's idle list (only while idle)
+    enum http_client_phase phase;       // phase the timer was armed for
+    unsigned int phase_transactions;    // client.num_transactions when the phase was entered
+    bool in_batch;                      // has an event further along in the worker's current batch
     struct kitserv_client client;
 };
 
-struct connection_container {
-    pthread_mutex_t conn_lock;  // protects freelist and count, active connections should not be shared
-    int freelist_count;
-    struct connection* first_free_conn;  // NULL if no free connections
-    struct connection* connections;      // all connections, should not be directly iterated
+#define idle_link_to_connection(link) ((struct connection*)((char*)(link)-offsetof(struct connection, idle_link)))
+
+/**
+ * Each worker allocates an equal share of the connections (from its arena, if it has one) and serves its own first:
+ * it caches a few free ones in its magazine, and trades them with its depot in batches. Only once both have run dry
+ * does it borrow a connection from another worker's depot, which goes straight back there when it closes. So slots
+ * still go to whichever worker needs them, but a worker keeps to its own memory unless the load is skewed onto it.
+ *
+ * Admission is counted separately from the connections themselves. Workers allocate MAGAZINE_SIZE more connections
+ * each than there are slots, so whenever a worker's magazine runs dry with a slot reserved, the depots still hold at
+ * least MAGAZINE_SIZE connections between them, no matter what the other workers have cached (magazines only ever
+ * hold their own worker's connections).
+ */
+static struct connection** connection_table;  // every connection, by pool index
+static pool_t* connection_depots;             // free connections of each worker not in its magazine, by index - base
+static int num_depots;
+static _Alignas(64) atomic_int free_slots;    // slots that have not been promised to anyone, may be read by anyone
+
+struct listener {
+    int fd;  // -1 if not bound
 };
 
 struct worker {
     pthread_t tid;
-    struct connection_container conn_container;
+    int index;
+    atomic_int num_active;  // connections being served, published for accept threads to balance on
+    struct http_worker http;
+    arena_t arena;  // backs the connections and buffers of this worker, if use_arena is set
     int queuefd;
+    int notifyfd;                  // woken when a new connection is handed off through the rings
+    timer_wheel_t timers;          // connection deadlines
+    struct lru_link idle_lru;      // idle keep-alive connections, least recently active first
+    ring_t handoff[2];             // accepted sockets from the accept threads, slot 0 = ipv4, slot 1 = ipv6
+    struct listener listeners[2];  // listen sockets (not in THREAD mode), slot 0 = ipv4, slot 1 = ipv6
+    int magazine_count;
+    struct connection* magazine[MAGAZINE_SIZE];  // free connections private to this worker
 };
 
 struct accepter {
@@ -55,103 +108,194 @@ struct accepter {
     struct worker* workers_list;
     int num_workers;
     int acceptfd;
+    int ring_index;  // which of each worker's handoff rings this accepter produces into
 };
 
 /**
- * Initialize a connection container and all of its sub-connections.
+ * Map this worker's arena, sized for its connections and preallocated buffers.
+ * Called from the worker's own thread, so that the memory is first touched (and placed) where it is used most.
  * Aborts on failure.
  */
-static void connection_init(struct connection_container* container, int container_slots)
+static void worker_arena_init(struct worker* self)
 {
-    int i, rc;
+    size_t size;
 
-    if ((rc = pthread_mutex_init(&container->conn_lock, NULL))) {
-        errno = rc;
-        perror("connection_init (pthread_mutex_init)");
+    size = slots_per_worker * sizeof(struct connection) + _Alignof(struct connection);
+    size += (size_t)arena_buffers * (HTTP_BUFSZ + HTTP_BUFSZ_SMALL);
+    if (kitserv_arena_init(&self->arena, size, prefault_arena)) {
+        perror("arena_init");
         abort();
     }
+    if (self->index == 0 && !kitserv_silent_mode) {
+        printf("Worker arenas: %zu bytes each, using %s.\n", self->arena.size,
+               kitserv_arena_backing_name(self->arena.backing));
+    }
+}
 
-    container->connections = malloc(container_slots * sizeof(struct connection));
-    if (!container->connections) {
+/**
+ * Get the index of the worker that allocated the given connection, whose depot it belongs in.
+ */
+static inline int connection_owner(const struct connection* connection)
+{
+    return connection->pool_index / slots_per_worker;
+}
+
+/**
+ * Allocate this worker's share of the connections, and stock its magazine and depot with them.
+ * Called from the worker's own thread, so that the memory is first touched (and placed) where it is used most.
+ * Aborts on failure.
+ */
+static void connection_init(struct worker* self)
+{
+    struct connection* connections;
+    unsigned int base = self->index * slots_per_worker;
+    int i;
+
+    if (use_arena) {
+        connections = kitserv_arena_alloc(&self->arena, slots_per_worker * sizeof(struct connection),
+                                          _Alignof(struct connection));
+    } else {
+        // clients start on a cache line boundary, which plain malloc doesn't promise
+        connections = aligned_alloc(_Alignof(struct connection), slots_per_worker * sizeof(struct connection));
+    }
+    if (!connections) {
         perror("connection_init (malloc)");
         abort();
     }
 
-    container->freelist_count = container_slots;
-    container->first_free_conn = container->connections;
-    for (i = 0; i < container_slots - 1; i++) {
-        container->connections[i].next_conn = &container->connections[i + 1];
-    }
-
-    for (i = 0; i < container_slots; i++) {
-        if (kitserv_http_create_client_struct(&container->connections[i].client)) {
+    self->magazine_count = 0;
+    for (i = 0; i < slots_per_worker; i++) {
+        connections[i].pool_index = base + i;
+        kitserv_timer_init(&connections[i].timer);
+        connections[i].idle_link.next = NULL;
+        connections[i].in_batch = false;
+        if (kitserv_http_create_client_struct(&connections[i].client, &self->http)) {
             perror("connection_init (http_create_client_struct)");
             abort();
         }
+        connection_table[base + i] = &connections[i];
+        if (self->magazine_count < MAGAZINE_SIZE / 2) {
+            self->magazine[self->magazine_count++] = &connections[i];
+        } else {
+            kitserv_pool_push(&connection_depots[self->index], i);
+        }
     }
 }
 
 /**
- * Allocate a connection struct using the given socket.
- * Returns the connection to be served, or NULL on error (i.e. no slots).
+ * Reserve a free slot on behalf of a connection that is about to be handed to a worker.
+ * Safe to call from any thread.
+ * Returns 0 on success, -1 if there are no free slots.
  */
-static struct connection* connection_accept(struct connection_container* container, int socket)
+static int connection_reserve(void)
 {
-    struct connection* conn;
-
-    pthread_mutex_lock(&container->conn_lock);
-    conn = container->first_free_conn;
-    if (conn) {
-        assert(container->freelist_count > 0);
+    int available = atomic_load_explicit(&free_slots, memory_order_relaxed);
 
-        container->first_free_conn = conn->next_conn;
-        container->freelist_count--;
+    do {
+        if (available <= 0) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&free_slots, &available, available - 1, memory_order_relaxed,
+                                                    memory_order_relaxed));
+    return 0;
+}
 
-        conn->client.sockfd = socket;
+/**
+ * Release a slot reserved with connection_reserve that will not be used after all.
+ */
+static inline void connection_unreserve(void)
+{
+    atomic_fetch_add_explicit(&free_slots, 1, memory_order_relaxed);
+}
 
-        // ensure that this connection is fresh
-        // this doesn't ensure everything is reset, but is good enough to detect blatant mistakes
-        assert(conn->client.req_headers_len == 0);
-        assert(conn->client.resp_body.len == 0);
-        assert(conn->client.ta.resp_fd == 0);
-        assert(conn->client.ta.resp_fd == KITSERV_FD_DISABLE);  // since it is assumed 0 in http.c
-        assert(conn->client.ta.state == 0);
-        assert(conn->client.ta.parse_state == 0);
-        assert(conn->client.ta.resp_status == 0);
+/**
+ * Allocate a connection struct using the given socket. Only the calling worker may serve it.
+ * The slot must have been reserved beforehand (see connection_reserve).
+ * Returns the connection to be served, or NULL on error (i.e. no slots).
+ */
+static struct connection* connection_accept(struct worker* self, int socket)
+{
+    unsigned int base = self->index * slots_per_worker;
+    struct connection* conn = NULL;
+    unsigned int index;
+    int owner, i;
+
+    // refill half a magazine at a time, leaving room to take back a few closed connections without a trip to the depot
+    while (self->magazine_count < MAGAZINE_SIZE / 2 && !kitserv_pool_pop(&connection_depots[self->index], &index)) {
+        self->magazine[self->magazine_count++] = connection_table[base + index];
     }
-    pthread_mutex_unlock(&container->conn_lock);
+    if (self->magazine_count) {
+        conn = self->magazine[--self->magazine_count];
+    }
+    // out of our own, so borrow one (and only one) from the next worker that has some to spare
+    for (i = 1; !conn && i < num_depots; i++) {
+        owner = (self->index + i) % num_depots;
+        if (!kitserv_pool_pop(&connection_depots[owner], &index)) {
+            conn = connection_table[owner * slots_per_worker + index];
+        }
+    }
+    if (!conn) {
+        return NULL;
+    }
+
+    conn->client.sockfd = socket;
+    // it may have last been served by another worker, whose pools and caches are not ours to touch
+    conn->client.worker = &self->http;
+    atomic_fetch_add_explicit(&self->num_active, 1, memory_order_relaxed);
+
+    // ensure that this connection is fresh
+    // this doesn't ensure everything is reset, but is good enough to detect blatant mistakes
+    // (a closed connection holds nothing of its worker's, which is what makes moving it safe)
+    assert(conn->client.req_headers == NULL);
+    assert(conn->client.resp_body_block == NULL);
+    assert(conn->client.ta.resp_file == NULL);
+    assert(conn->client.ta.resp_cached == NULL);
+    assert(conn->client.ta.resp_snapshot == NULL);
+    assert(conn->client.req_headers_len == 0);
+    assert(conn->client.resp_body.len == 0);
+    assert(conn->client.ta.resp_fd == 0);
+    assert(conn->client.ta.resp_fd == KITSERV_FD_DISABLE);  // since it is assumed 0 in http.c
+    assert(conn->client.ta.state == 0);
+    assert(conn->client.ta.parse_state == 0);
+    assert(conn->client.ta.resp_status == 0);
 
     return conn;
 }
 
 /**
- * Shut down the given connection struct, marking it as vacant and adding it to the free list.
+ * Shut down the given connection struct, marking it as vacant and returning its slot.
+ * Only the worker serving it may call this.
  */
-static void connection_close(struct connection_container* container, struct connection* connection)
+static void connection_close(struct worker* self, struct connection* connection)
 {
+    unsigned int base = self->index * slots_per_worker;
+    int owner = connection_owner(connection);
+    struct connection* spare;
+
     kitserv_http_reset_client(&connection->client);
-    pthread_mutex_lock(&container->conn_lock);
-    connection->next_conn = container->first_free_conn;
-    container->first_free_conn = connection;
-    container->freelist_count++;
-    pthread_mutex_unlock(&container->conn_lock);
+    if (owner != self->index) {
+        // borrowed, so give it back to its own worker
+        kitserv_pool_push(&connection_depots[owner], connection->pool_index - owner * slots_per_worker);
+    } else {
+        if (self->magazine_count == MAGAZINE_SIZE) {
+            while (self->magazine_count > MAGAZINE_SIZE / 2) {
+                spare = self->magazine[--self->magazine_count];
+                kitserv_pool_push(&connection_depots[self->index], spare->pool_index - base);
+            }
+        }
+        self->magazine[self->magazine_count++] = connection;
+    }
+    atomic_fetch_sub_explicit(&self->num_active, 1, memory_order_relaxed);
+    connection_unreserve();
 }
 
 /**
  * Score a given worker - lower = worse (prioritize high scores for new connections)
- * Always >= 0
  */
 static inline int score_worker(struct worker* worker)
 {
-    int score;
-
-    pthread_mutex_lock(&worker->conn_container.conn_lock);
-    // easy scoring system is just the number of free slots - doesn't spread *load*, but approximately good enough
-    score = worker->conn_container.freelist_count;
-    pthread_mutex_unlock(&worker->conn_container.conn_lock);
-
-    assert(score >= 0);
-    return score;
+    // slots are shared, so just spread the connections themselves
+    return -atomic_load_explicit(&worker->num_active, memory_order_relaxed);
 }
 
 /**
@@ -160,12 +304,12 @@ static inline int score_worker(struct worker* worker)
 static inline struct worker* select_client_worker(struct accepter* self)
 {
     struct worker* best_worker;
-    int best_score = -1;
+    int best_score;
     int curr_score, i;
 
-    best_worker = NULL;
-    best_score = -1;
-    for (i = 0; i < self->num_workers; i++) {
+    best_worker = &self->workers_list[0];
+    best_score = score_worker(best_worker);
+    for (i = 1; i < self->num_workers; i++) {
         curr_score = score_worker(&self->workers_list[i]);
         if (curr_score > best_score) {
             best_worker = &self->workers_list[i];
@@ -175,39 +319,277 @@ static inline struct worker* select_client_worker(struct accepter* self)
     return best_worker;
 }
 
+/**
+ * Returns true if the event data belongs to an fd owned by the worker itself (e.g. a listener).
+ * Such events always point inside the worker struct, while connections live in the connection container.
+ */
+static inline bool is_worker_event(struct worker* self, void* data)
+{
+    return (char*)data >= (char*)self && (char*)data < (char*)(self + 1);
+}
+
+/**
+ * Track what the connection is now waiting on: arm its timer, and keep it in the idle list while idle.
+ * Header and idle deadlines run from the start of that phase (so trickling bytes can't extend them),
+ * body and send deadlines restart on every bit of activity.
+ */
+static void connection_update_phase(struct worker* self, struct connection* conn)
+{
+    enum http_client_phase phase = kitserv_http_client_phase(&conn->client);
+    struct lru_link* link = &conn->idle_link;
+
+    if (phase == conn->phase && conn->client.num_transactions == conn->phase_transactions &&
+        (phase == HTTP_PHASE_HEADERS || phase == HTTP_PHASE_IDLE)) {
+        return;
+    }
+
+    if (link->next) {
+        link->prev->next = link->next;
+        link->next->prev = link->prev;
+        link->next = NULL;
+    }
+    if (phase == HTTP_PHASE_IDLE) {
+        // most recently active goes to the back
+        link->next = &self->idle_lru;
+        link->prev = self->idle_lru.prev;
+        self->idle_lru.prev->next = link;
+        self->idle_lru.prev = link;
+    }
+
+    conn->phase = phase;
+    conn->phase_transactions = conn->client.num_transactions;
+    if (phase_timeouts[phase] > 0) {
+        kitserv_timer_schedule(&self->timers, &conn->timer, phase_timeouts[phase]);
+    } else {
+        kitserv_timer_cancel(&self->timers, &conn->timer);
+    }
+}
+
+/**
+ * Hang up on a connection and return its slot.
+ */
+static void worker_drop_connection(struct worker* self, struct connection* conn)
+{
+    struct lru_link* link = &conn->idle_link;
+
+    if (link->next) {
+        link->prev->next = link->next;
+        link->next->prev = link->prev;
+        link->next = NULL;
+    }
+    kitserv_timer_cancel(&self->timers, &conn->timer);
+    kitserv_queue_remove(self->queuefd, conn->client.sockfd);
+    kitserv_socket_close(conn->client.sockfd);  // ignore errors like ENOTCONN
+    connection_close(self, conn);
+}
+
+/**
+ * Close idle keep-alive connections, least recently active first, until at least `want` slots are free.
+ * Returns the number of connections closed.
+ */
+static int worker_reap_idle(struct worker* self, int want)
+{
+    struct lru_link* link = self->idle_lru.next;
+    struct connection* conn;
+    int reaped = 0;
+
+    while (link != &self->idle_lru && atomic_load_explicit(&free_slots, memory_order_relaxed) < want) {
+        conn = idle_link_to_connection(link);
+        link = link->next;
+        // its event would find it closed, or by then serving someone else (maybe on another worker)
+        if (conn->in_batch) {
+            continue;
+        }
+        worker_drop_connection(self, conn);
+        reaped++;
+    }
+    return reaped;
+}
+
+/**
+ * Timer callback for a connection that has outstayed its current phase.
+ */
+static void worker_expire_connection(struct timer* timer, void* data)
+{
+    struct worker* self = (struct worker*)data;
+    struct connection* conn = timer_entry(timer, struct connection, timer);
+
+    if (kitserv_http_expire_client(&conn->client)) {
+        worker_drop_connection(self, conn);
+    } else {
+        connection_update_phase(self, conn);
+    }
+}
+
+/**
+ * Start serving a freshly accepted socket on this worker, whose slot has already been reserved.
+ */
+static void worker_add_connection(struct worker* self, int sockfd)
+{
+    struct connection* new_conn;
+
+    new_conn = connection_accept(self, sockfd);
+    if (!new_conn) {
+        // should not happen, the reservation guarantees that the depot can back it
+        if (!kitserv_silent_mode) {
+            fprintf(stderr, "Worker has no free slots!\n");
+        }
+        kitserv_socket_close(sockfd);
+        connection_unreserve();
+        return;
+    }
+    if (kitserv_queue_add(self->queuefd, sockfd, new_conn, QUEUE_IN | QUEUE_OUT, false)) {
+        if (!kitserv_silent_mode) {
+            perror("queue_add");
+        }
+        kitserv_socket_close(sockfd);
+        connection_close(self, new_conn);
+        return;
+    }
+    new_conn->phase = HTTP_PHASE_COUNT;  // force arming
+    connection_update_phase(self, new_conn);
+
+    // running low on slots, so make room for the next clients while we still can
+    if (reap_watermark > 0 && worker_reap_idle(self, reap_watermark) && !kitserv_silent_mode) {
+        fprintf(stderr, "Worker is low on slots, closed idle connections.\n");
+    }
+}
+
+/**
+ * Pick up every connection that the accept threads have handed to this worker.
+ */
+static void worker_take_handoffs(struct worker* self)
+{
+    int sockfd, i;
+
+    // drain the notifier first, so that a handoff racing with the loop below triggers another wakeup
+    kitserv_queue_notifier_drain(self->notifyfd);
+    for (i = 0; i < 2; i++) {
+        while (!kitserv_ring_pop(&self->handoff[i], &sockfd)) {
+            worker_add_connection(self, sockfd);
+        }
+    }
+}
+
+/**
+ * Accept every pending connection on one of this worker's own listeners and serve them from this worker.
+ */
+static void worker_accept(struct worker* self, struct listener* listener)
+{
+    int sockfd;
+
+    while (1) {
+        sockfd = kitserv_socket_accept(listener->fd);
+        if (sockfd < 0) {
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            if (errno != EWOULDBLOCK && errno != EAGAIN && !kitserv_silent_mode) {
+                perror("accept");
+            }
+            return;
+        }
+
+        if (connection_reserve() && (!worker_reap_idle(self, 1) || connection_reserve())) {
+            if (!kitserv_silent_mode) {
+                fprintf(stderr, "Worker has no free slots!\n");
+            }
+            kitserv_http_reject_socket(sockfd);
+            kitserv_socket_close(sockfd);
+            continue;
+        }
+        worker_add_connection(self, sockfd);
+    }
+}
+
 static void* client_worker(void* data)
 {
     struct worker* self = (struct worker*)data;
     struct connection* conn;
     queue_event events[MAX_EVENTS];
+    void* event_data;
     int nevents, i;
 
-    connection_init(&self->conn_container, slots);
+    if (use_arena) {
+        worker_arena_init(self);
+    }
+    // connections first, so that they sit together at the start of the arena
+    connection_init(self);
+    if (kitserv_http_create_worker(&self->http, use_arena ? &self->arena : NULL, arena_buffers, &worker_config)) {
+        perror("http_create_worker");
+        abort();
+    }
+    kitserv_timer_wheel_init(&self->timers, kitserv_timer_now());
+    self->idle_lru.next = &self->idle_lru;
+    self->idle_lru.prev = &self->idle_lru;
     self->queuefd = kitserv_queue_init();
     if (self->queuefd < 0) {
         perror("queue_init");
         abort();
     }
 
+    // shared listeners are woken exclusively (only one of the waiting workers gets each connection)
+    for (i = 0; i < 2; i++) {
+        if (self->listeners[i].fd >= 0 &&
+            kitserv_queue_add(self->queuefd, self->listeners[i].fd, &self->listeners[i], QUEUE_IN,
+                              accept_mode == KITSERV_ACCEPT_EXCLUSIVE)) {
+            perror("queue_add (listener)");
+            abort();
+        }
+    }
+    if (kitserv_queue_add(self->queuefd, self->notifyfd, &self->notifyfd, QUEUE_IN, false)) {
+        perror("queue_add (notifier)");
+        abort();
+    }
+    if (kitserv_filecache_event_fd(&self->http.files) >= 0 &&
+        kitserv_queue_add(self->queuefd, kitserv_filecache_event_fd(&self->http.files), &self->http.files, QUEUE_IN,
+                          false)) {
+        perror("queue_add (file cache)");
+        abort();
+    }
+
     pthread_barrier_wait(&startup_barrier);
 
     while (1) {
-        nevents = kitserv_queue_wait(self->queuefd, events, MAX_EVENTS);
+        nevents = kitserv_queue_wait(self->queuefd, events, MAX_EVENTS, kitserv_timer_wait_timeout(&self->timers));
         if (nevents < 0) {
             if (!kitserv_silent_mode) {
                 perror("queue_wait");
             }
             continue;
         }
+        kitserv_timer_update(&self->timers, kitserv_timer_now());
+        kitserv_http_update_date(&self->http);
+        // accepting may reap idle connections along the way, which must leave alone those with events still to come
+        for (i = 0; i < nevents; i++) {
+            event_data = kitserv_queue_event_to_data(&events[i]);
+            if (!is_worker_event(self, event_data)) {
+                ((struct connection*)event_data)->in_batch = true;
+            }
+        }
         for (i = 0; i < nevents; i++) {
-            conn = kitserv_queue_event_to_data(&events[i]);
+            event_data = kitserv_queue_event_to_data(&events[i]);
+            if (is_worker_event(self, event_data)) {
+                if (event_data == &self->notifyfd) {
+                    worker_take_handoffs(self);
+                } else if (event_data == &self->http.files) {
+                    kitserv_filecache_process_events(&self->http.files);
+                } else {
+                    worker_accept(self, event_data);
+                }
+                continue;
+            }
+            conn = event_data;
+            conn->in_batch = false;
             if (kitserv_http_serve_client(&conn->client)) {
                 // that transaction was the last one on this connection, so drop it
-                kitserv_queue_remove(self->queuefd, conn->client.sockfd);
-                kitserv_socket_close(conn->client.sockfd);  // ignore errors like ENOTCONN
-                connection_close(&self->conn_container, conn);
+                worker_drop_connection(self, conn);
+            } else {
+                connection_update_phase(self, conn);
             }
         }
+        // only fire timers after the events, so that no connection in the batch is closed from under it
+        kitserv_timer_advance(&self->timers, worker_expire_connection, self);
     }
 
     return NULL;
@@ -216,7 +598,6 @@ static void* client_worker(void* data)
 static void* accept_worker(void* data)
 {
     struct accepter* self = (struct accepter*)data;
-    struct connection* new_conn;
     struct worker* victim_worker;
     int sockfd;
 
@@ -231,18 +612,26 @@ static void* accept_worker(void* data)
             continue;
         }
 
-        victim_worker = select_client_worker(self);
-
-        // give the new connection to that worker
-        new_conn = connection_accept(&victim_worker->conn_container, sockfd);
-        if (!new_conn) {
+        // reserve a slot and give the new connection to the least busy worker, which picks it up on its own thread
+        if (connection_reserve()) {
+            // workers reap their idle connections as they pass the watermark, so there really is no room
             if (!kitserv_silent_mode) {
-                fprintf(stderr, "Target worker has no free slots!\n");
+                fprintf(stderr, "No free slots!\n");
             }
+            kitserv_http_reject_socket(sockfd);
             kitserv_socket_close(sockfd);
-            // TODO: when this happens, we should tell workers to close extranneous connections (e.g. DoS prevention)
-        } else {
-            kitserv_queue_add(victim_worker->queuefd, sockfd, new_conn, QUEUE_IN | QUEUE_OUT, false);
+            continue;
+        }
+        victim_worker = select_client_worker(self);
+        if (kitserv_ring_push(&victim_worker->handoff[self->ring_index], sockfd)) {
+            // that worker is far behind on picking up its handoffs, so don't pile any more onto it
+            connection_unreserve();
+            kitserv_http_reject_socket(sockfd);
+            kitserv_socket_close(sockfd);
+            continue;
+        }
+        if (kitserv_queue_notify(victim_worker->notifyfd) && !kitserv_silent_mode) {
+            perror("queue_notify");
         }
     }
 
@@ -251,17 +640,40 @@ static void* accept_worker(void* data)
 
 void kitserv_server_start(struct kitserv_config* config)
 {
-    int v4sock = 0;
-    int v6sock = 0;
-    bool bind_ipv4, bind_ipv6;
+    int v4sock = -1;
+    int v6sock = -1;
+    bool bind_ipv4, bind_ipv6, reuse_port, worker_listeners;
+    bool accept_ipv4, accept_ipv6;
     sigset_t sigset;
     int sig = 0;
+    int ring_capacity;
     int i;
+    unsigned long hits = 0, misses = 0;
     struct worker* workers;
     struct accepter* accepters;
     struct sigaction sigact_ign;
 
     kitserv_silent_mode = config->silent_mode;
+    accept_mode = config->accept_mode;
+    phase_timeouts[HTTP_PHASE_IDLE] = config->idle_timeout_ms;
+    phase_timeouts[HTTP_PHASE_HEADERS] = config->header_timeout_ms;
+    phase_timeouts[HTTP_PHASE_BODY] = config->body_timeout_ms;
+    phase_timeouts[HTTP_PHASE_SEND] = config->send_timeout_ms;
+    reap_watermark = config->reap_watermark;
+    use_arena = config->use_arena;
+    prefault_arena = config->prefault_arena;
+    arena_buffers = config->arena_buffers;
+    worker_config = (struct http_worker_config){
+        .file_cache_entries = config->file_cache_entries,
+        .file_cache_ttl_ms = config->file_cache_ttl_ms,
+        .body_cache_bytes = config->body_cache_bytes,
+        .body_cache_max_file = config->body_cache_max_file,
+        .compress_level = config->compress_level,
+        .compress_min_size = config->compress_min_size,
+        .compress_cache_bytes = config->compress_cache_bytes,
+        .compress_max_file = config->compress_max_file,
+        .max_ranges = config->max_ranges > 0 ? config->max_ranges : 1,
+    };
 
     if (config->num_slots <= 0) {
         fprintf(stderr, "Invalid slot count: %d <= 0\n", config->num_slots);
@@ -271,18 +683,92 @@ void kitserv_server_start(struct kitserv_config* config)
         fprintf(stderr, "Invalid worker count: %d <= 0\n", config->num_workers);
         exit(1);
     }
-    if (config->num_slots < config->num_workers) {
-        fprintf(stderr, "Invalid slot/worker count: %d < %d\n", config->num_slots, config->num_workers);
+    if ((long long)config->num_slots + (long long)config->num_workers * (MAGAZINE_SIZE + 1) > INT_MAX) {
+        fprintf(stderr, "Invalid slot/worker count: %d slots, %d workers is too many\n", config->num_slots,
+                config->num_workers);
+        exit(1);
+    }
+    if (config->arena_buffers < 0) {
+        fprintf(stderr, "Invalid arena buffer count: %d < 0\n", config->arena_buffers);
+        exit(1);
+    }
+    if (config->file_cache_entries < 0 || config->file_cache_ttl_ms < 0) {
+        fprintf(stderr, "Invalid file cache: %d entries, %d ms TTL\n", config->file_cache_entries,
+                config->file_cache_ttl_ms);
+        exit(1);
+    }
+    if (config->body_cache_bytes < 0 || config->body_cache_max_file < 0) {
+        fprintf(stderr, "Invalid body cache: %d bytes, %d bytes per file\n", config->body_cache_bytes,
+                config->body_cache_max_file);
+        exit(1);
+    }
+    if (config->compress_level < 0 || config->compress_level > 9 || config->compress_min_size < 0 ||
+        config->compress_cache_bytes < 0 || config->compress_max_file < 0) {
+        fprintf(stderr, "Invalid compression: level %d, %d bytes minimum, %d bytes cached, %d bytes per file\n",
+                config->compress_level, config->compress_min_size, config->compress_cache_bytes,
+                config->compress_max_file);
+        exit(1);
+    }
+    if (config->max_ranges < 0 || config->max_ranges > HTTP_MAX_RANGES) {
+        fprintf(stderr, "Invalid range count: %d not in [0, %d]\n", config->max_ranges, HTTP_MAX_RANGES);
+        exit(1);
+    }
+    if (config->compress_level > 0 && !kitserv_compress_available()) {
+        if (!kitserv_silent_mode) {
+            fprintf(stderr, "Not built with zlib (KITSERV_ZLIB), responses will not be compressed.\n");
+        }
+        worker_config.compress_level = 0;
+    }
+    if (accept_mode != KITSERV_ACCEPT_THREAD && accept_mode != KITSERV_ACCEPT_REUSEPORT &&
+        accept_mode != KITSERV_ACCEPT_EXCLUSIVE) {
+        fprintf(stderr, "Invalid accept mode: %d\n", accept_mode);
         exit(1);
     }
 
-    // share slots between workers, round up to nearest multiple
-    slots = (config->num_slots + config->num_workers - 1) / config->num_workers;
+    // every worker allocates an equal share of the connections, plus the headroom for its magazine
+    slots_per_worker = (config->num_slots + config->num_workers - 1) / config->num_workers + MAGAZINE_SIZE;
+    connection_table = malloc((size_t)slots_per_worker * config->num_workers * sizeof(struct connection*));
+    if (!connection_table) {
+        perror("malloc");
+        abort();
+    }
+    connection_depots = aligned_alloc(_Alignof(pool_t), config->num_workers * sizeof(pool_t));
+    if (!connection_depots) {
+        perror("malloc");
+        abort();
+    }
+    for (i = 0; i < config->num_workers; i++) {
+        if (kitserv_pool_init(&connection_depots[i], slots_per_worker)) {
+            perror("pool_init");
+            abort();
+        }
+    }
+    num_depots = config->num_workers;
+    atomic_init(&free_slots, config->num_slots);
+    if (!kitserv_silent_mode) {
+        // buffers are only taken from the workers' pools during a transaction, so this is all an idle connection costs
+        printf("Memory per idle connection: %zu bytes.\n",
+               sizeof(struct connection) + sizeof(struct connection*) + sizeof(atomic_uint));
+    }
 
+    // the snapshot's headers name types, so they must all be registered first
+    if (kitserv_mime_init()) {
+        perror("mime_init");
+        abort();
+    }
+    if (config->mime_types && kitserv_mime_load(config->mime_types)) {
+        fprintf(stderr, "Could not load MIME types from %s: %s\n", config->mime_types, strerror(errno));
+        exit(1);
+    }
     kitserv_http_init(config->http_root_context, config->api_tree);
+    if (config->snapshot_root && kitserv_http_load_snapshot()) {
+        perror("http_load_snapshot");
+        exit(1);
+    }
 
-    // block INT and TERM so that helper threads don't receive them
-    if (sigemptyset(&sigset) || sigaddset(&sigset, SIGINT) || sigaddset(&sigset, SIGTERM)) {
+    // block INT and TERM (and HUP, to rebuild the snapshot) so that helper threads don't receive them
+    if (sigemptyset(&sigset) || sigaddset(&sigset, SIGINT) || sigaddset(&sigset, SIGTERM) ||
+        (config->snapshot_root && sigaddset(&sigset, SIGHUP))) {
         perror("sigset");
         abort();
     }
@@ -308,8 +794,13 @@ void kitserv_server_start(struct kitserv_config* config)
     bind_ipv4 = config->bind_ipv4;
     bind_ipv6 = config->bind_ipv6;
 
+    // in REUSEPORT mode, these first sockets belong to worker 0 and the rest of the workers get their own copies
+    // in EXCLUSIVE mode, every worker shares these sockets
+    reuse_port = accept_mode == KITSERV_ACCEPT_REUSEPORT;
+    worker_listeners = accept_mode != KITSERV_ACCEPT_THREAD;
+
     if (bind_ipv6) {
-        v6sock = kitserv_socket_prepare(config->port_string, true, false);
+        v6sock = kitserv_socket_prepare(config->port_string, true, worker_listeners, reuse_port);
         if (v6sock < 0) {
             perror("socket_prepare (ipv6)");
             if (errno == EAFNOSUPPORT) {
@@ -322,7 +813,7 @@ void kitserv_server_start(struct kitserv_config* config)
         }
     }
     if (bind_ipv4) {
-        v4sock = kitserv_socket_prepare(config->port_string, false, false);
+        v4sock = kitserv_socket_prepare(config->port_string, false, worker_listeners, reuse_port);
         if (v4sock < 0) {
             perror("socket_prepare (ipv4)");
             if (errno == EADDRINUSE && bind_ipv6) {
@@ -334,6 +825,52 @@ void kitserv_server_start(struct kitserv_config* config)
         }
     }
 
+    ring_capacity = config->num_slots < HANDOFF_RING_MAX ? config->num_slots : HANDOFF_RING_MAX;
+    for (i = 0; i < config->num_workers; i++) {
+        // handoff state is set up here, since accept threads may use it as soon as they pass the barrier
+        workers[i].notifyfd = kitserv_queue_notifier_init();
+        if (workers[i].notifyfd < 0) {
+            perror("queue_notifier_init");
+            abort();
+        }
+        workers[i].index = i;
+        atomic_init(&workers[i].num_active, 0);
+        if (kitserv_ring_init(&workers[i].handoff[0], ring_capacity) ||
+            kitserv_ring_init(&workers[i].handoff[1], ring_capacity)) {
+            perror("ring_init");
+            abort();
+        }
+
+        workers[i].listeners[0].fd = -1;
+        workers[i].listeners[1].fd = -1;
+        if (!worker_listeners) {
+            continue;
+        }
+        if (i == 0 || !reuse_port) {
+            workers[i].listeners[0].fd = bind_ipv4 ? v4sock : -1;
+            workers[i].listeners[1].fd = bind_ipv6 ? v6sock : -1;
+            continue;
+        }
+        if (bind_ipv4) {
+            workers[i].listeners[0].fd = kitserv_socket_prepare(config->port_string, false, true, true);
+            if (workers[i].listeners[0].fd < 0) {
+                perror("socket_prepare (ipv4, reuseport)");
+                exit(1);
+            }
+        }
+        if (bind_ipv6) {
+            workers[i].listeners[1].fd = kitserv_socket_prepare(config->port_string, true, true, true);
+            if (workers[i].listeners[1].fd < 0) {
+                perror("socket_prepare (ipv6, reuseport)");
+                exit(1);
+            }
+        }
+    }
+
+    // workers accept for themselves in REUSEPORT and EXCLUSIVE mode, so only spawn accept threads otherwise
+    accept_ipv4 = bind_ipv4 && !worker_listeners;
+    accept_ipv6 = bind_ipv6 && !worker_listeners;
+
     // slot 0 = ipv4, slot 1 = ipv6
     accepters = malloc(2 * sizeof(struct accepter));
     if (!accepters) {
@@ -342,7 +879,7 @@ void kitserv_server_start(struct kitserv_config* config)
     }
 
     //  info -->                                     workers               accept threads              self
-    if (pthread_barrier_init(&startup_barrier, NULL, config->num_workers + !!bind_ipv4 + !!bind_ipv6 + 1)) {
+    if (pthread_barrier_init(&startup_barrier, NULL, config->num_workers + !!accept_ipv4 + !!accept_ipv6 + 1)) {
         perror("pthread_barrier_init");
         abort();
     }
@@ -352,19 +889,21 @@ void kitserv_server_start(struct kitserv_config* config)
             abort();
         }
     }
-    if (bind_ipv4) {
+    if (accept_ipv4) {
         accepters[0].acceptfd = v4sock;
         accepters[0].workers_list = workers;
         accepters[0].num_workers = config->num_workers;
+        accepters[0].ring_index = 0;
         if (pthread_create(&accepters[0].tid, NULL, accept_worker, &accepters[0])) {
             perror("pthread_create");
             abort();
         }
     }
-    if (bind_ipv6) {
+    if (accept_ipv6) {
         accepters[1].acceptfd = v6sock;
         accepters[1].workers_list = workers;
         accepters[1].num_workers = config->num_workers;
+        accepters[1].ring_index = 1;
         if (pthread_create(&accepters[1].tid, NULL, accept_worker, &accepters[1])) {
             perror("pthread_create");
             abort();
@@ -379,9 +918,33 @@ void kitserv_server_start(struct kitserv_config* config)
     }
 
     // TODO: proper signal handling and joining (and cleanup...)
-    while (sigwait(&sigset, &sig)) {
-        perror("sigwait");
-        abort();
+    while (1) {
+        if (sigwait(&sigset, &sig)) {
+            perror("sigwait");
+            abort();
+        }
+        if (sig != SIGHUP) {
+            break;
+        }
+        // workers move over to the new snapshot as they serve from it, the old one goes once they all have
+        if (kitserv_http_load_snapshot() && !kitserv_silent_mode) {
+            perror("http_load_snapshot (keeping the previous snapshot)");
+        }
     }
     printf("Caught signal %d.\n", sig);
+    if (worker_config.body_cache_bytes && !kitserv_silent_mode) {
+        for (i = 0; i < config->num_workers; i++) {
+            hits += atomic_load_explicit(&workers[i].http.bodies.hits, memory_order_relaxed);
+            misses += atomic_load_explicit(&workers[i].http.bodies.misses, memory_order_relaxed);
+        }
+        printf("Body cache: %lu hits, %lu misses.\n", hits, misses);
+    }
+    if (worker_config.compress_level && worker_config.compress_cache_bytes && !kitserv_silent_mode) {
+        hits = misses = 0;
+        for (i = 0; i < config->num_workers; i++) {
+            hits += atomic_load_explicit(&workers[i].http.compressed.hits, memory_order_relaxed);
+            misses += atomic_load_explicit(&workers[i].http.compressed.misses, memory_order_relaxed);
+        }
+        printf("Compressed file cache: %lu hits, %lu misses.\n", hits, misses);
+    }
 }
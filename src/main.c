@@ -14,6 +14,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "kitserv.h"
 
@@ -22,22 +23,53 @@
 #define DEFAULT_FALLBACK_ROOT_PATH ("index.html")
 #define DEFAULT_NUM_WORKERS (2)
 #define DEFAULT_NUM_SLOTS (128)
+#define DEFAULT_HEADER_TIMEOUT_MS (20000)
+#define DEFAULT_BODY_TIMEOUT_MS (30000)
+#define DEFAULT_IDLE_TIMEOUT_MS (60000)
+#define DEFAULT_SEND_TIMEOUT_MS (60000)
+#define DEFAULT_REAP_WATERMARK (4)
+#define DEFAULT_FILE_CACHE_ENTRIES (256)
+#define DEFAULT_BODY_CACHE_BYTES (4 << 20)
+#define DEFAULT_BODY_CACHE_MAX_FILE (64 << 10)
+#ifdef KITSERV_HAVE_ZLIB
+#define DEFAULT_COMPRESS_LEVEL (6)
+#else
+#define DEFAULT_COMPRESS_LEVEL (0)
+#endif
+#define DEFAULT_COMPRESS_MIN_SIZE (256)
+#define DEFAULT_COMPRESS_CACHE_BYTES (4 << 20)
+#define DEFAULT_COMPRESS_MAX_FILE (1 << 20)
+#define DEFAULT_MAX_RANGES (16)
 
 static void usage(const char* prog_name)
 {
     fprintf(stderr,
-            "Usage: %s -w webdir [-p port] [-s slots] [-t threads] [-f fallback] [-r root_fb] [-4] [-6] [-h]\n"
+            "Usage: %s -w webdir [-p port] [-s slots] [-t threads] [-f fallback] [-r root_fb] [-a accept] [-m buffers] "
+            "[-c files] [-T ttl] [-b bytes] [-B bytes] [-z level] [-Z bytes] [-R ranges] [-M types] [-i] [-4] [-6] "
+            "[-h]\n"
             "\t-w webdir     Root directory from which to serve files.\n"
             "\t-p port       Port to run on (default: %s).\n"
             "\t-s slots      Number of connection slots to allocate (default: %d).\n"
             "\t-t threads    Number of worker threads to use for serving clients (default: %d).\n"
             "\t-f fallback   Path to fallback resource (default: %s).\n"
             "\t-r root_fb    Path to fallback resource when the path is / (default: %s).\n"
+            "\t-a accept     Accept mode: thread, reuseport, or exclusive (default: thread).\n"
+            "\t-m buffers    Preallocate each worker's memory in a huge page arena, with this many buffers per size.\n"
+            "\t-c files      Number of open files each worker caches, 0 to disable (default: %d).\n"
+            "\t-T ttl        Re-check cached files after this many ms, 0 to rely on inotify (default: 0).\n"
+            "\t-b bytes      Bytes of small files each worker keeps in memory, 0 to disable (default: %d).\n"
+            "\t-B bytes      Size of the largest file kept in memory (default: %d).\n"
+            "\t-z level      Compress responses on the fly at this zlib level, 0 to disable (default: %d).\n"
+            "\t-Z bytes      Bytes of compressed files each worker keeps in memory (default: %d).\n"
+            "\t-R ranges     Most ranges a request may ask for at once, or it gets the whole file (default: %d).\n"
+            "\t-M types      Serve files as the types listed in this mime.types file, on top of the built-in ones.\n"
+            "\t-i            Serve the web directory from a snapshot taken at startup, and again on SIGHUP.\n"
             "\t-4            Bind IPv4 only.\n"
             "\t-6            Bind IPv6 only, or both when dual binding is enabled (falls back to IPv4 if no IPv6).\n"
             "\t-h            Show this help.\n",
             prog_name, DEFAULT_PORT_STRING, DEFAULT_NUM_SLOTS, DEFAULT_NUM_WORKERS, DEFAULT_FALLBACK_PATH,
-            DEFAULT_FALLBACK_ROOT_PATH);
+            DEFAULT_FALLBACK_ROOT_PATH, DEFAULT_FILE_CACHE_ENTRIES, DEFAULT_BODY_CACHE_BYTES,
+            DEFAULT_BODY_CACHE_MAX_FILE, DEFAULT_COMPRESS_LEVEL, DEFAULT_COMPRESS_CACHE_BYTES, DEFAULT_MAX_RANGES);
     exit(1);
 }
 
@@ -52,6 +84,7 @@ int main(int argc, char* argv[])
         .root_fallback = DEFAULT_FALLBACK_ROOT_PATH,
         .fallback = DEFAULT_FALLBACK_PATH,
         .use_http_append_fallback = true,
+        .use_precompressed = true,
     };
 
     config = (struct kitserv_config){
@@ -61,11 +94,31 @@ int main(int argc, char* argv[])
         .bind_ipv4 = true,
         .bind_ipv6 = true,
         .silent_mode = false,
+        .accept_mode = KITSERV_ACCEPT_THREAD,
+        .header_timeout_ms = DEFAULT_HEADER_TIMEOUT_MS,
+        .body_timeout_ms = DEFAULT_BODY_TIMEOUT_MS,
+        .idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS,
+        .send_timeout_ms = DEFAULT_SEND_TIMEOUT_MS,
+        .reap_watermark = DEFAULT_REAP_WATERMARK,
+        .use_arena = false,
+        .prefault_arena = false,
+        .arena_buffers = 0,
+        .file_cache_entries = DEFAULT_FILE_CACHE_ENTRIES,
+        .file_cache_ttl_ms = 0,
+        .body_cache_bytes = DEFAULT_BODY_CACHE_BYTES,
+        .body_cache_max_file = DEFAULT_BODY_CACHE_MAX_FILE,
+        .compress_level = DEFAULT_COMPRESS_LEVEL,
+        .compress_min_size = DEFAULT_COMPRESS_MIN_SIZE,
+        .compress_cache_bytes = DEFAULT_COMPRESS_CACHE_BYTES,
+        .compress_max_file = DEFAULT_COMPRESS_MAX_FILE,
+        .max_ranges = DEFAULT_MAX_RANGES,
+        .snapshot_root = false,
+        .mime_types = NULL,
         .http_root_context = &root_context,
         .api_tree = NULL,
     };
 
-    while ((opt = getopt(argc, argv, "w:p:s:t:f:r:46h")) != -1) {
+    while ((opt = getopt(argc, argv, "w:p:s:t:f:r:a:m:c:T:b:B:z:Z:R:M:i46h")) != -1) {
         switch (opt) {
             case 'w':
                 root_context.root = optarg;
@@ -93,6 +146,82 @@ int main(int argc, char* argv[])
             case 'r':
                 root_context.root_fallback = optarg;
                 break;
+            case 'a':
+                if (!strcmp(optarg, "thread")) {
+                    config.accept_mode = KITSERV_ACCEPT_THREAD;
+                } else if (!strcmp(optarg, "reuseport")) {
+                    config.accept_mode = KITSERV_ACCEPT_REUSEPORT;
+                } else if (!strcmp(optarg, "exclusive")) {
+                    config.accept_mode = KITSERV_ACCEPT_EXCLUSIVE;
+                } else {
+                    fprintf(stderr, "Invalid accept mode (%s).\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                config.use_arena = true;
+                config.prefault_arena = true;
+                config.arena_buffers = atoi(optarg);
+                if (config.arena_buffers < 0) {
+                    fprintf(stderr, "Invalid arena buffer count (%d).\n", config.arena_buffers);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                config.file_cache_entries = atoi(optarg);
+                if (config.file_cache_entries < 0) {
+                    fprintf(stderr, "Invalid file cache size (%d).\n", config.file_cache_entries);
+                    exit(1);
+                }
+                break;
+            case 'T':
+                config.file_cache_ttl_ms = atoi(optarg);
+                if (config.file_cache_ttl_ms < 0) {
+                    fprintf(stderr, "Invalid file cache TTL (%d).\n", config.file_cache_ttl_ms);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                config.body_cache_bytes = atoi(optarg);
+                if (config.body_cache_bytes < 0) {
+                    fprintf(stderr, "Invalid body cache size (%d).\n", config.body_cache_bytes);
+                    exit(1);
+                }
+                break;
+            case 'B':
+                config.body_cache_max_file = atoi(optarg);
+                if (config.body_cache_max_file < 0) {
+                    fprintf(stderr, "Invalid body cache file size (%d).\n", config.body_cache_max_file);
+                    exit(1);
+                }
+                break;
+            case 'z':
+                config.compress_level = atoi(optarg);
+                if (config.compress_level < 0 || config.compress_level > 9) {
+                    fprintf(stderr, "Invalid compression level (%d).\n", config.compress_level);
+                    exit(1);
+                }
+                break;
+            case 'Z':
+                config.compress_cache_bytes = atoi(optarg);
+                if (config.compress_cache_bytes < 0) {
+                    fprintf(stderr, "Invalid compression cache size (%d).\n", config.compress_cache_bytes);
+                    exit(1);
+                }
+                break;
+            case 'R':
+                config.max_ranges = atoi(optarg);
+                if (config.max_ranges < 0 || config.max_ranges > KITSERV_MAX_RANGES) {
+                    fprintf(stderr, "Invalid range count (%d).\n", config.max_ranges);
+                    exit(1);
+                }
+                break;
+            case 'M':
+                config.mime_types = optarg;
+                break;
+            case 'i':
+                config.snapshot_root = true;
+                break;
             case '4':
                 config.bind_ipv4 = true;
                 config.bind_ipv6 = false;
@@ -0,0 +1,631 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#define _DEFAULT_SOURCE
+
+#include "manifest.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer.h"
+
+#define MAX_DEPTH (32)                // stops symlink loops
+#define MAX_DISPLACEMENTS (1u << 16)  // tried per bucket before growing the table
+#define MAX_TABLE_GROWTH (4)          // times the table may double before giving up
+#define DISPLACEMENT_MULT (0x9E3779B97F4A7C15ull)
+#define HEADERS_MAX (512)             // preformatted headers of one file
+
+static pthread_mutex_t current_lock = PTHREAD_MUTEX_INITIALIZER;
+static manifest_t* current;
+static atomic_uint current_generation;
+
+struct build_header_block {
+    size_t off;
+    int len;
+};
+
+struct build_file {
+    int fd;
+    struct stat st;
+    size_t path_off;
+    struct build_header_block headers;
+    size_t name_off;  // within the path, or 0 if the file is only reachable as a fallback
+    int name_len;
+    int variants[ENCODING_COUNT];  // index of the file's precompressed siblings, -1 for none
+    struct build_header_block variant_headers[ENCODING_COUNT];
+};
+
+/**
+ * State while building a manifest. Strings are kept as offsets until the string block stops moving.
+ */
+struct build {
+    const struct manifest_options* options;
+    size_t root_len;
+    buffer_t strings;
+    struct build_file* files;
+    int num_files;
+    int max_files;
+    rlim_t open_budget;  // files that may still be kept open
+};
+
+static uint64_t hash_name(const char* name, int len)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static inline uint32_t slot_of(uint64_t hash, uint32_t displacement, uint32_t mask)
+{
+    // splitmix64 finalizer, so that every displacement scatters the bucket's keys anew
+    uint64_t x = hash ^ (displacement * DISPLACEMENT_MULT);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return (uint32_t)(x ^ (x >> 31)) & mask;
+}
+
+static inline uint32_t bucket_of(uint64_t hash, uint32_t mask)
+{
+    return (uint32_t)(hash >> 32) & mask;
+}
+
+/**
+ * Add the regular file at path (of length len) to the build, naming it relative to the root if named.
+ * Returns the index of the file, or -1 on error.
+ */
+static int add_file(struct build* b, const char* path, int len, const struct stat* st, bool named)
+{
+    struct build_file* file;
+    struct build_file* new_files;
+    int i;
+
+    if (b->num_files == b->max_files) {
+        new_files = realloc(b->files, (b->max_files * 2 + 16) * sizeof(struct build_file));
+        if (!new_files) {
+            return -1;
+        }
+        b->files = new_files;
+        b->max_files = b->max_files * 2 + 16;
+    }
+    file = &b->files[b->num_files];
+
+    // running out of fds is no reason not to serve the file, it just has to be opened for every request
+    file->fd = -1;
+    if (b->open_budget > 0) {
+        file->fd = open(path, O_RDONLY | O_CLOEXEC);
+        b->open_budget -= file->fd >= 0;
+    }
+    file->st = *st;
+    file->path_off = b->strings.len;
+    if (kitserv_buffer_append(&b->strings, path, len + 1)) {
+        goto err;
+    }
+    file->name_off = named ? file->path_off + b->root_len + 1 : 0;
+    file->name_len = named ? len - (int)b->root_len - 1 : 0;
+    for (i = 0; i < ENCODING_COUNT; i++) {
+        file->variants[i] = -1;
+    }
+    return b->num_files++;
+
+err:
+    if (file->fd >= 0) {
+        close(file->fd);
+    }
+    return -1;
+}
+
+static int compare_keys(const void* a, const void* b)
+{
+    const struct manifest_key* x = a;
+    const struct manifest_key* y = b;
+    int rc = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+
+    return rc ? rc : x->name_len - y->name_len;
+}
+
+/**
+ * Format the headers of file (as served in place of the one at type_path) into the strings.
+ * Returns 0 on success, -1 on error.
+ */
+static int format_headers(struct build* b, const struct build_file* file, const char* type_path,
+                          enum content_encoding encoding, bool vary, struct build_header_block* block)
+{
+    const char* extension;
+    char buf[HEADERS_MAX];
+    struct body_key key = {
+        .dev = file->st.st_dev,
+        .ino = file->st.st_ino,
+        .size = file->st.st_size,
+        .mtime = file->st.st_mtim,
+        .encoding = encoding,
+    };
+    int len;
+
+    extension = strrchr(type_path, '.');
+    if (extension && strchr(extension, '/')) {
+        extension = NULL;
+    }
+    len = b->options->format_headers(buf, sizeof(buf), extension, &key, vary);
+    block->off = b->strings.len;
+    block->len = len;
+    return len < 0 || kitserv_buffer_append(&b->strings, buf, len) ? -1 : 0;
+}
+
+/**
+ * Link every named file to the siblings that hold it precompressed (name.br, name.gz, ...).
+ * Returns 0 on success, -1 on error.
+ */
+static int link_variants(struct build* b)
+{
+    struct manifest_key *names, *base, key;
+    const char* suffix;
+    int i, e, num_names = 0, suffix_len;
+
+    names = malloc(b->num_files * sizeof(struct manifest_key) + 1);
+    if (!names) {
+        return -1;
+    }
+    for (i = 0; i < b->num_files; i++) {
+        if (b->files[i].name_off) {
+            names[num_names++] = (struct manifest_key){
+                .name = &b->strings.buf[b->files[i].name_off],
+                .name_len = b->files[i].name_len,
+                .entry = i,
+            };
+        }
+    }
+    qsort(names, num_names, sizeof(struct manifest_key), compare_keys);
+    for (i = 0; i < num_names; i++) {
+        for (e = 0; e < ENCODING_COUNT; e++) {
+            suffix = kitserv_encoding_suffix(e);
+            if (!suffix) {
+                continue;
+            }
+            suffix_len = strlen(suffix);
+            key = names[i];
+            key.name_len -= suffix_len;
+            if (key.name_len > 0 && !memcmp(&key.name[key.name_len], suffix, suffix_len) &&
+                (base = bsearch(&key, names, num_names, sizeof(struct manifest_key), compare_keys))) {
+                b->files[base->entry].variants[e] = names[i].entry;
+            }
+        }
+    }
+    free(names);
+    return 0;
+}
+
+/**
+ * Format the headers of every file, and of every file as a variant of another.
+ * Returns 0 on success, -1 on error.
+ */
+static int format_all_headers(struct build* b)
+{
+    struct build_file* file;
+    bool vary;
+    int i, e;
+
+    for (i = 0; i < b->num_files; i++) {
+        file = &b->files[i];
+        vary = false;
+        for (e = 0; e < ENCODING_COUNT; e++) {
+            vary |= file->variants[e] >= 0;
+        }
+        // the file itself varies too, since a client that accepted a sibling would have been sent that instead
+        if (format_headers(b, file, &b->strings.buf[file->path_off], ENCODING_IDENTITY, vary, &file->headers)) {
+            return -1;
+        }
+        for (e = 0; e < ENCODING_COUNT; e++) {
+            if (file->variants[e] >= 0 &&
+                format_headers(b, &b->files[file->variants[e]], &b->strings.buf[file->path_off], e, true,
+                               &file->variant_headers[e])) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Add every regular file below the directory at path (of length len, in a PATH_MAX buffer).
+ * Returns 0 on success, -1 on error.
+ */
+static int walk(struct build* b, char* path, int len, int depth)
+{
+    struct dirent* dirent;
+    struct stat st;
+    DIR* dir;
+    int n;
+
+    dir = opendir(path);
+    if (!dir) {
+        // below the root, directories that are unreadable (or already gone) can't be served from anyway
+        return depth > 0 ? 0 : -1;
+    }
+    while ((dirent = readdir(dir))) {
+        if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..")) {
+            continue;
+        }
+        n = snprintf(&path[len], PATH_MAX - len, "/%s", dirent->d_name);
+        if (n >= PATH_MAX - len || stat(path, &st)) {
+            // too long to be requested, or gone already
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (depth < MAX_DEPTH && walk(b, path, len + n, depth + 1)) {
+                goto err;
+            }
+        } else if (S_ISREG(st.st_mode) && add_file(b, path, len + n, &st, true) < 0) {
+            goto err;
+        }
+    }
+    path[len] = '\0';
+    closedir(dir);
+    return 0;
+
+err:
+    path[len] = '\0';
+    closedir(dir);
+    return -1;
+}
+
+/**
+ * Find the file that a request for name (relative to the root) would be served, adding it if the walk didn't.
+ * Returns the index of the file, -1 if there is none, or -2 on error.
+ */
+static int resolve_file(struct build* b, const char* name)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int len, i;
+
+    len = strlen(name);
+    for (i = 0; i < b->num_files; i++) {
+        if (b->files[i].name_len == len &&
+            !memcmp(&b->strings.buf[b->files[i].name_off], name, len)) {
+            return i;
+        }
+    }
+    // outside the root, or not quite spelled the way the walk would have
+    len = snprintf(path, PATH_MAX, "%s/%s", b->options->root, name);
+    if (len >= PATH_MAX || stat(path, &st) || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    i = add_file(b, path, len, &st, false);
+    return i < 0 ? -2 : i;
+}
+
+/**
+ * Find displacements that put every key of the manifest in a slot of its own.
+ * Returns 0 on success, -1 on error.
+ */
+static int build_table(manifest_t* m)
+{
+    uint32_t num_buckets = 1, num_slots = 1, bucket, d, i, j, s;
+    uint32_t *bucket_start = NULL, *order = NULL, *by_size = NULL, *size_start = NULL;
+    uint32_t growth;
+
+    while (num_buckets < (uint32_t)m->num_keys / 4) {
+        num_buckets <<= 1;
+    }
+    while (num_slots < (uint32_t)m->num_keys * 2) {
+        num_slots <<= 1;
+    }
+    m->bucket_mask = num_buckets - 1;
+    m->displacements = calloc(num_buckets, sizeof(uint32_t));
+    bucket_start = calloc(num_buckets + 1, sizeof(uint32_t));
+    order = malloc((m->num_keys + 1) * sizeof(uint32_t));
+    by_size = malloc(num_buckets * sizeof(uint32_t));
+    size_start = calloc(m->num_keys + 2, sizeof(uint32_t));
+    if (!m->displacements || !bucket_start || !order || !by_size || !size_start) {
+        goto err;
+    }
+
+    // group the keys by bucket
+    for (i = 0; i < (uint32_t)m->num_keys; i++) {
+        bucket_start[bucket_of(m->keys[i].hash, m->bucket_mask) + 1]++;
+    }
+    for (i = 0; i < num_buckets; i++) {
+        bucket_start[i + 1] += bucket_start[i];
+    }
+    for (i = 0; i < (uint32_t)m->num_keys; i++) {
+        bucket = bucket_of(m->keys[i].hash, m->bucket_mask);
+        order[bucket_start[bucket]++] = i;
+    }
+    for (i = num_buckets; i > 0; i--) {
+        bucket_start[i] = bucket_start[i - 1];
+    }
+    bucket_start[0] = 0;
+
+    // place the largest buckets first, while there is the most room
+    for (i = 0; i < num_buckets; i++) {
+        size_start[m->num_keys - (bucket_start[i + 1] - bucket_start[i]) + 1]++;
+    }
+    for (i = 0; i <= (uint32_t)m->num_keys; i++) {
+        size_start[i + 1] += size_start[i];
+    }
+    for (i = 0; i < num_buckets; i++) {
+        by_size[size_start[m->num_keys - (bucket_start[i + 1] - bucket_start[i])]++] = i;
+    }
+
+    for (growth = 0; growth <= MAX_TABLE_GROWTH; growth++, num_slots <<= 1) {
+        free(m->slots);
+        m->slots = calloc(num_slots, sizeof(uint32_t));
+        if (!m->slots) {
+            goto err;
+        }
+        m->slot_mask = num_slots - 1;
+
+        for (i = 0; i < num_buckets; i++) {
+            bucket = by_size[i];
+            for (d = 0; d < MAX_DISPLACEMENTS; d++) {
+                // claim the slots as we go, and give them back if one is taken
+                for (j = bucket_start[bucket]; j < bucket_start[bucket + 1]; j++) {
+                    s = slot_of(m->keys[order[j]].hash, d, m->slot_mask);
+                    if (m->slots[s]) {
+                        break;
+                    }
+                    m->slots[s] = order[j] + 1;
+                }
+                if (j == bucket_start[bucket + 1]) {
+                    break;
+                }
+                while (j-- > bucket_start[bucket]) {
+                    m->slots[slot_of(m->keys[order[j]].hash, d, m->slot_mask)] = 0;
+                }
+            }
+            if (d == MAX_DISPLACEMENTS) {
+                break;
+            }
+            m->displacements[bucket] = d;
+        }
+        if (i == num_buckets) {
+            free(bucket_start);
+            free(order);
+            free(by_size);
+            free(size_start);
+            m->memory += num_buckets * sizeof(uint32_t) + num_slots * sizeof(uint32_t);
+            return 0;
+        }
+    }
+    errno = EOVERFLOW;
+
+err:
+    free(bucket_start);
+    free(order);
+    free(by_size);
+    free(size_start);
+    return -1;
+}
+
+manifest_t* kitserv_manifest_build(const struct manifest_options* options)
+{
+    struct build b = {.options = options};
+    struct manifest_key* key;
+    struct rlimit limit;
+    char path[PATH_MAX];
+    manifest_t* m;
+    int len, i, e;
+
+    m = calloc(1, sizeof(manifest_t));
+    if (!m) {
+        return NULL;
+    }
+    atomic_init(&m->refs, 1);
+    m->root_entry = -1;
+    m->fallback_entry = -1;
+    if (kitserv_buffer_init(&b.strings, 4096)) {
+        free(m);
+        return NULL;
+    }
+
+    // files stay open, so take as many fds as we're allowed, and leave room for connections and the next snapshot
+    if (getrlimit(RLIMIT_NOFILE, &limit)) {
+        goto err;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit)) {
+            getrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+    b.open_budget = limit.rlim_cur == RLIM_INFINITY ? INT_MAX : limit.rlim_cur / 4;
+
+    b.root_len = strlen(options->root);
+    len = snprintf(path, PATH_MAX, "%s", options->root);
+    if (len >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        goto err;
+    }
+    if (walk(&b, path, len, 0)) {
+        goto err;
+    }
+
+    // resolve the fallbacks the same way a request would: the file itself, then with .html appended for /
+    if (options->root_fallback && (m->root_entry = resolve_file(&b, options->root_fallback)) == -2) {
+        goto err;
+    }
+    if (m->root_entry == -1 && options->append_html && (m->root_entry = resolve_file(&b, ".html")) == -2) {
+        goto err;
+    }
+    if (options->fallback && (m->fallback_entry = resolve_file(&b, options->fallback)) == -2) {
+        goto err;
+    }
+    if ((options->precompressed && link_variants(&b)) || format_all_headers(&b)) {
+        goto err;
+    }
+
+    // the strings are complete, so they can be pointed into from here on
+    m->strings = b.strings.buf;
+    m->entries = malloc(b.num_files * sizeof(struct manifest_entry) + 1);
+    m->keys = malloc(b.num_files * 2 * sizeof(struct manifest_key) + 1);
+    if (!m->entries || !m->keys) {
+        goto err_strings;
+    }
+    for (i = 0; i < b.num_files; i++) {
+        m->entries[i] = (struct manifest_entry){
+            .fd = b.files[i].fd,
+            .dev = b.files[i].st.st_dev,
+            .ino = b.files[i].st.st_ino,
+            .size = b.files[i].st.st_size,
+            .mtime = b.files[i].st.st_mtim,
+            .path = &m->strings[b.files[i].path_off],
+            .headers = &m->strings[b.files[i].headers.off],
+            .headers_len = b.files[i].headers.len,
+        };
+        for (e = 0; e < ENCODING_COUNT; e++) {
+            m->entries[i].variants[e] = (struct manifest_variant){.entry = -1};
+            if (b.files[i].variants[e] >= 0) {
+                m->entries[i].variants[e] = (struct manifest_variant){
+                    .entry = b.files[i].variants[e],
+                    .headers = &m->strings[b.files[i].variant_headers[e].off],
+                    .headers_len = b.files[i].variant_headers[e].len,
+                };
+            }
+        }
+        b.files[i].fd = -1;
+        if (b.files[i].name_off) {
+            m->keys[m->num_keys++] = (struct manifest_key){
+                .name = &m->strings[b.files[i].name_off],
+                .name_len = b.files[i].name_len,
+                .entry = i,
+            };
+        }
+    }
+    m->num_entries = b.num_files;
+
+    // name.html can also be requested as name, unless that is a file of its own
+    if (options->append_html) {
+        qsort(m->keys, m->num_keys, sizeof(struct manifest_key), compare_keys);
+        len = m->num_keys;
+        for (i = 0; i < len; i++) {
+            key = &m->keys[m->num_keys];
+            *key = m->keys[i];
+            key->name_len -= sizeof(".html") - 1;
+            if (key->name_len >= 0 && !memcmp(&key->name[key->name_len], ".html", sizeof(".html") - 1) &&
+                !bsearch(key, m->keys, len, sizeof(struct manifest_key), compare_keys)) {
+                m->num_keys++;
+            }
+        }
+    }
+    for (i = 0; i < m->num_keys; i++) {
+        m->keys[i].hash = hash_name(m->keys[i].name, m->keys[i].name_len);
+    }
+    m->memory = sizeof(manifest_t) + b.strings.max + m->num_entries * sizeof(struct manifest_entry) +
+                m->num_keys * sizeof(struct manifest_key);
+    if (build_table(m)) {
+        goto err_strings;
+    }
+
+    free(b.files);
+    return m;
+
+err_strings:
+    // the manifest owns the strings and the fds it has taken now, so it cleans those up
+    for (i = 0; i < b.num_files; i++) {
+        if (b.files[i].fd >= 0) {
+            close(b.files[i].fd);
+        }
+    }
+    free(b.files);
+    kitserv_manifest_release(m);
+    return NULL;
+
+err:
+    for (i = 0; i < b.num_files; i++) {
+        if (b.files[i].fd >= 0) {
+            close(b.files[i].fd);
+        }
+    }
+    free(b.files);
+    kitserv_buffer_free(&b.strings);
+    free(m);
+    return NULL;
+}
+
+const struct manifest_entry* kitserv_manifest_lookup(const manifest_t* manifest, const char* name, int len)
+{
+    uint64_t hash = hash_name(name, len);
+    const struct manifest_key* key;
+    uint32_t index;
+
+    index = manifest->slots[slot_of(hash, manifest->displacements[bucket_of(hash, manifest->bucket_mask)],
+                                    manifest->slot_mask)];
+    if (!index) {
+        return NULL;
+    }
+    key = &manifest->keys[index - 1];
+    if (key->hash != hash || key->name_len != len || memcmp(key->name, name, len)) {
+        return NULL;
+    }
+    return &manifest->entries[key->entry];
+}
+
+void kitserv_manifest_release(manifest_t* manifest)
+{
+    int i;
+
+    if (atomic_fetch_sub_explicit(&manifest->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    for (i = 0; i < manifest->num_entries; i++) {
+        if (manifest->entries[i].fd >= 0) {
+            close(manifest->entries[i].fd);
+        }
+    }
+    free(manifest->entries);
+    free(manifest->keys);
+    free(manifest->slots);
+    free(manifest->displacements);
+    free(manifest->strings);
+    free(manifest);
+}
+
+void kitserv_manifest_publish(manifest_t* manifest)
+{
+    manifest_t* old;
+
+    pthread_mutex_lock(&current_lock);
+    old = current;
+    current = manifest;
+    atomic_fetch_add_explicit(&current_generation, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&current_lock);
+
+    if (old) {
+        kitserv_manifest_release(old);
+    }
+}
+
+manifest_t* kitserv_manifest_get_current(unsigned int* generation)
+{
+    manifest_t* manifest;
+
+    // the lock keeps the manifest from being released between reading the pointer and taking a reference
+    pthread_mutex_lock(&current_lock);
+    manifest = current;
+    if (manifest) {
+        kitserv_manifest_acquire(manifest);
+    }
+    *generation = atomic_load_explicit(&current_generation, memory_order_relaxed);
+    pthread_mutex_unlock(&current_lock);
+    return manifest;
+}
+
+unsigned int kitserv_manifest_generation(void)
+{
+    return atomic_load_explicit(&current_generation, memory_order_relaxed);
+}
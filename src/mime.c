@@ -0,0 +1,290 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#define _DEFAULT_SOURCE
+
+#include "mime.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+#include "kitserv.h"
+
+#define INITIAL_CAPACITY (128)  // fits the built-in types at under half load
+
+/**
+ * A slot of the table, free if type.name is NULL.
+ */
+struct mime_entry {
+    unsigned int hash;
+    char extension[MIME_EXTENSION_MAX + 1];  // lowercase, without its dot
+    struct mime_type type;                   // name is malloc'd
+};
+
+static const struct {
+    const char* extension;
+    const char* type;
+} builtin_types[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "text/javascript"},
+    {"mjs", "text/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"jsonld", "application/ld+json"},
+    {"webmanifest", "application/manifest+json"},
+    {"xml", "application/xml"},
+    {"rss", "application/rss+xml"},
+    {"atom", "application/atom+xml"},
+    {"wasm", "application/wasm"},
+    {"txt", "text/plain"},
+    {"md", "text/plain"},
+    {"csv", "text/csv"},
+    {"vtt", "text/vtt"},
+    {"ics", "text/calendar"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"ico", "image/x-icon"},
+    {"bmp", "image/bmp"},
+    {"tif", "image/tiff"},
+    {"tiff", "image/tiff"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+    {"ogv", "video/ogg"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"oga", "audio/ogg"},
+    {"wav", "audio/wav"},
+    {"flac", "audio/flac"},
+    {"m4a", "audio/mp4"},
+    {"pdf", "application/pdf"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tar", "application/x-tar"},
+    {"bz2", "application/x-bzip2"},
+    {"xz", "application/x-xz"},
+    {"zst", "application/zstd"},
+    {"7z", "application/x-7z-compressed"},
+};
+
+static const struct mime_type octet_stream = {"application/octet-stream", false};
+
+static struct mime_entry* table;  // open addressing with linear probing, NULL until kitserv_mime_init
+static unsigned int mask;         // capacity - 1, which is a power of two
+static unsigned int count;
+
+/**
+ * Copy extension (without its dot) into folded in lowercase, and hash it (FNV-1a).
+ * Returns its length, or -1 if it is too long to have been registered.
+ */
+static int fold_extension(char* folded, const char* extension, unsigned int* hash)
+{
+    unsigned int h = 2166136261u;
+    int len;
+
+    for (len = 0; extension[len]; len++) {
+        if (len == MIME_EXTENSION_MAX) {
+            return -1;
+        }
+        folded[len] = extension[len] >= 'A' && extension[len] <= 'Z' ? extension[len] + ('a' - 'A') : extension[len];
+        h = (h ^ (unsigned char)folded[len]) * 16777619u;
+    }
+    folded[len] = '\0';
+    *hash = h;
+    return len;
+}
+
+/**
+ * Find the slot of a folded extension (of length len): either the one holding it, or the free one it would go in.
+ */
+static struct mime_entry* find_slot(const char* folded, int len, unsigned int hash)
+{
+    unsigned int i;
+
+    for (i = hash & mask; table[i].type.name; i = (i + 1) & mask) {
+        if (table[i].hash == hash && !memcmp(table[i].extension, folded, len + 1)) {
+            break;
+        }
+    }
+    return &table[i];
+}
+
+/**
+ * Double the capacity of the table.
+ * Returns 0 on success, -1 on error.
+ */
+static int grow_table(void)
+{
+    struct mime_entry* old = table;
+    unsigned int old_capacity = mask + 1;
+    unsigned int i, j;
+
+    table = calloc(old_capacity * 2, sizeof(*table));
+    if (!table) {
+        table = old;
+        return -1;
+    }
+    mask = old_capacity * 2 - 1;
+    for (i = 0; i < old_capacity; i++) {
+        if (old[i].type.name) {
+            for (j = old[i].hash & mask; table[j].type.name; j = (j + 1) & mask) {
+            }
+            table[j] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * Returns true if type can be sent as a Content-Type: a slash somewhere, and no control characters (besides tabs).
+ */
+static bool valid_type(const char* type)
+{
+    size_t i;
+
+    for (i = 0; type[i]; i++) {
+        if (((unsigned char)type[i] < ' ' && type[i] != '\t') || type[i] == 0x7f || i == MIME_TYPE_MAX) {
+            return false;
+        }
+    }
+    return i > 0 && strchr(type, '/');
+}
+
+/**
+ * Register type for an extension, which has already been checked for a leading dot.
+ * Returns 0 on success, -1 on error.
+ */
+static int add_type(const char* extension, const char* type)
+{
+    char folded[MIME_EXTENSION_MAX + 1];
+    struct mime_entry* entry;
+    unsigned int hash;
+    char* name;
+    int len;
+
+    len = fold_extension(folded, extension, &hash);
+    if (len <= 0 || strpbrk(folded, "./ \t\r\n") || !valid_type(type)) {
+        errno = EINVAL;
+        return -1;
+    }
+    name = strdup(type);
+    if (!name) {
+        return -1;
+    }
+    entry = find_slot(folded, len, hash);
+    if (entry->type.name) {
+        free((char*)entry->type.name);
+    } else {
+        if ((count + 1) * 2 > mask + 1) {
+            if (grow_table()) {
+                free(name);
+                return -1;
+            }
+            entry = find_slot(folded, len, hash);
+        }
+        entry->hash = hash;
+        memcpy(entry->extension, folded, len + 1);
+        count++;
+    }
+    entry->type.name = name;
+    entry->type.compressible = kitserv_compress_mime_type(name);
+    return 0;
+}
+
+int kitserv_mime_init(void)
+{
+    size_t i;
+
+    if (table) {
+        return 0;
+    }
+    table = calloc(INITIAL_CAPACITY, sizeof(*table));
+    if (!table) {
+        return -1;
+    }
+    mask = INITIAL_CAPACITY - 1;
+    for (i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++) {
+        if (add_type(builtin_types[i].extension, builtin_types[i].type)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+const struct mime_type* kitserv_mime_lookup(const char* extension)
+{
+    char folded[MIME_EXTENSION_MAX + 1];
+    struct mime_entry* entry;
+    unsigned int hash;
+    int len;
+
+    if (!extension || !table) {
+        return &octet_stream;
+    }
+    if (extension[0] == '.') {
+        extension++;
+    }
+    len = fold_extension(folded, extension, &hash);
+    if (len <= 0) {
+        return &octet_stream;
+    }
+    entry = find_slot(folded, len, hash);
+    return entry->type.name ? &entry->type : &octet_stream;
+}
+
+int kitserv_mime_register(const char* extension, const char* type)
+{
+    if (kitserv_mime_init()) {
+        return -1;
+    }
+    return add_type(extension[0] == '.' ? &extension[1] : extension, type);
+}
+
+int kitserv_mime_load(const char* path)
+{
+    FILE* file;
+    char* line = NULL;
+    size_t size = 0;
+    char *type, *extension, *save;
+    int ret = 0;
+
+    if (kitserv_mime_init()) {
+        return -1;
+    }
+    file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    while (!ret && getline(&line, &size, file) >= 0) {
+        line[strcspn(line, "#")] = '\0';
+        type = strtok_r(line, " \t\r\n", &save);
+        if (!type) {
+            continue;
+        }
+        while (!ret && (extension = strtok_r(NULL, " \t\r\n", &save))) {
+            // files are looked up by their last extension alone, so ones like "tar.gz" would never match
+            if (!strchr(extension, '.') && strlen(extension) <= MIME_EXTENSION_MAX) {
+                ret = add_type(extension, type);
+            }
+        }
+    }
+    if (!ret && ferror(file)) {
+        ret = -1;
+    }
+    free(line);
+    fclose(file);
+    return ret;
+}
@@ -0,0 +1,59 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#include "pool.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define TOP_INDEX(top) ((unsigned int)((top)&0xFFFFFFFFu))
+#define TOP_MAKE(tag, index) (((uint_least64_t)(tag) << 32) | (index))
+
+int kitserv_pool_init(pool_t* pool, unsigned int capacity)
+{
+    unsigned int i;
+
+    pool->next = malloc(capacity * sizeof(atomic_uint));
+    if (!pool->next) {
+        return -1;
+    }
+    for (i = 0; i < capacity; i++) {
+        atomic_init(&pool->next[i], 0);
+    }
+    pool->capacity = capacity;
+    atomic_init(&pool->top, 0);
+    return 0;
+}
+
+void kitserv_pool_free(pool_t* pool)
+{
+    free(pool->next);
+}
+
+void kitserv_pool_push(pool_t* pool, unsigned int index)
+{
+    uint_least64_t top = atomic_load_explicit(&pool->top, memory_order_relaxed);
+
+    do {
+        atomic_store_explicit(&pool->next[index], TOP_INDEX(top), memory_order_relaxed);
+        // bump the tag on every change, so that a pop holding a stale view of the top fails its exchange
+    } while (!atomic_compare_exchange_weak_explicit(&pool->top, &top, TOP_MAKE((top >> 32) + 1, index + 1),
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+int kitserv_pool_pop(pool_t* pool, unsigned int* index)
+{
+    uint_least64_t top = atomic_load_explicit(&pool->top, memory_order_acquire);
+    unsigned int next;
+
+    do {
+        if (!TOP_INDEX(top)) {
+            return -1;
+        }
+        // may read the link of an index that someone else just took, but then the tag has moved on
+        next = atomic_load_explicit(&pool->next[TOP_INDEX(top) - 1], memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->top, &top, TOP_MAKE((top >> 32) + 1, next),
+                                                    memory_order_acquire, memory_order_acquire));
+    *index = TOP_INDEX(top) - 1;
+    return 0;
+}
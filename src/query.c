@@ -0,0 +1,139 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#include "query.h"
+
+#include <string.h>
+
+/**
+ * Hash a key (FNV-1a).
+ */
+static unsigned int hash_key(const char* key, int keylen)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for (i = 0; i < keylen; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Returns the value of a hex digit, or -1 if c isn't one.
+ */
+static inline int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+ * Decode a component of a query, from p up to end, setting *result and *len to it. If it has no escapes, it is left
+ * where it is. Otherwise, it is written (null-terminated) at *out, which is advanced past it, unless that would pass
+ * out_end.
+ * Returns 0 on success, -1 if there is no room for it.
+ */
+static int decode_component(const char** result, int* len, const char* p, const char* end, char** out,
+                            const char* out_end)
+{
+    char* r = *out;
+    int hi, lo;
+
+    if (!memchr(p, '%', end - p) && !memchr(p, '+', end - p)) {
+        *result = p;
+        *len = end - p;
+        return 0;
+    }
+    // decoding never lengthens it
+    if (out_end - r < end - p + 1) {
+        return -1;
+    }
+    while (p < end) {
+        if (*p == '+') {
+            *r++ = ' ';
+            p++;
+        } else if (*p == '%' && end - p >= 3 && (hi = hex_value(p[1])) >= 0 && (lo = hex_value(p[2])) >= 0) {
+            *r++ = hi << 4 | lo;
+            p += 3;
+        } else {
+            *r++ = *p++;
+        }
+    }
+    *r = '\0';
+    *result = *out;
+    *len = r - *out;
+    *out = r + 1;
+    return 0;
+}
+
+void kitserv_query_index(query_index_t* index, size_t size, const char* query)
+{
+    // key=value&key=value
+    const char* p = query;
+    const char* q;  // & or end
+    const char* r;  // =, or q if there is none
+    char* out = index->decoded;
+    const char* out_end = (const char*)index + size;
+    struct query_param* param;
+    const struct query_param* other;
+    unsigned int i;
+
+    index->num_params = 0;
+    memset(index->slots, 0, sizeof(index->slots));
+    if (!query) {
+        return;
+    }
+
+    for (; *p && index->num_params < QUERY_MAX_PARAMS; p = *q ? q + 1 : q) {
+        q = p + strcspn(p, "&");
+        r = memchr(p, '=', q - p);
+        if (!r) {
+            r = q;
+        }
+        if (r == p) {
+            continue;
+        }
+
+        param = &index->params[index->num_params];
+        if (decode_component(&param->key, &param->keylen, p, r, &out, out_end) ||
+            decode_component(&param->value, &param->len, r == q ? q : r + 1, q, &out, out_end)) {
+            // we're stuffed, keep the ones that fit
+            break;
+        }
+
+        // only the first of several parameters with the same key is found by it
+        for (i = hash_key(param->key, param->keylen) & (QUERY_SLOTS - 1); index->slots[i];
+             i = (i + 1) & (QUERY_SLOTS - 1)) {
+            other = &index->params[index->slots[i] - 1];
+            if (other->keylen == param->keylen && !memcmp(other->key, param->key, param->keylen)) {
+                break;
+            }
+        }
+        if (!index->slots[i]) {
+            index->slots[i] = index->num_params + 1;
+        }
+        index->num_params++;
+    }
+}
+
+const struct query_param* kitserv_query_find(const query_index_t* index, const char* key, int keylen)
+{
+    const struct query_param* param;
+    unsigned int i;
+
+    for (i = hash_key(key, keylen) & (QUERY_SLOTS - 1); index->slots[i]; i = (i + 1) & (QUERY_SLOTS - 1)) {
+        param = &index->params[index->slots[i] - 1];
+        if (param->keylen == keylen && !memcmp(param->key, key, keylen)) {
+            return param;
+        }
+    }
+    return NULL;
+}
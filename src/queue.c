@@ -3,10 +3,13 @@
 #include "queue.h"
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #ifdef __linux__
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #else
 #error No non-Linux setup has been created!
 // TODO: make a kqueue wrapper as well
@@ -24,11 +27,11 @@ int kitserv_queue_init()
     return qfd;
 }
 
-ssize_t kitserv_queue_wait(int qfd, queue_event* out_events, int n)
+ssize_t kitserv_queue_wait(int qfd, queue_event* out_events, int n, int timeout_ms)
 {
     ssize_t nready;
 #ifdef __linux__
-    if ((nready = epoll_wait(qfd, out_events, n, -1)) < 0) {
+    if ((nready = epoll_wait(qfd, out_events, n, timeout_ms)) < 0) {
         return -1;
     }
 #else
@@ -95,3 +98,39 @@ int kitserv_queue_remove(int qfd, int fd)
 #endif
     return 0;
 }
+
+int kitserv_queue_notifier_init()
+{
+    int nfd;
+#ifdef __linux__
+    if ((nfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        return -1;
+    }
+#else
+#endif
+    return nfd;
+}
+
+int kitserv_queue_notify(int nfd)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    if (write(nfd, &one, sizeof(one)) != sizeof(one)) {
+        return -1;
+    }
+#else
+#endif
+    return 0;
+}
+
+int kitserv_queue_notifier_drain(int nfd)
+{
+#ifdef __linux__
+    uint64_t count;
+    if (read(nfd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+#else
+#endif
+    return 0;
+}
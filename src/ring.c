@@ -0,0 +1,57 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#include "ring.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+int kitserv_ring_init(ring_t* ring, unsigned int capacity)
+{
+    unsigned int size = 1;
+
+    // round up to a power of two so that indices can be masked instead of divided
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    ring->fds = malloc(size * sizeof(int));
+    if (!ring->fds) {
+        return -1;
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+void kitserv_ring_free(ring_t* ring)
+{
+    free(ring->fds);
+}
+
+int kitserv_ring_push(ring_t* ring, int fd)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    // indices are free-running, so this works across wraparound
+    if (tail - head > ring->mask) {
+        return -1;
+    }
+    ring->fds[tail & ring->mask] = fd;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+int kitserv_ring_pop(ring_t* ring, int* fd)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head == tail) {
+        return -1;
+    }
+    *fd = ring->fds[head & ring->mask];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 0;
+}
@@ -0,0 +1,627 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#include "router.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// stand-ins for ":name" and "*" components in route keys, which valid prefixes can't contain
+#define PARAM_MARKER '\x01'
+#define WILDCARD_MARKER '\x02'
+#define is_marker(c) ((c) == PARAM_MARKER || (c) == WILDCARD_MARKER)
+
+static const char param_marker[] = {PARAM_MARKER};
+static const char wildcard_name[] = "*";
+
+enum prefix_kind {
+    PREFIX_INVALID,
+    PREFIX_EXACT,
+    PREFIX_PARAM,     // ":name"
+    PREFIX_WILDCARD,  // "*" or "*name"
+};
+
+/**
+ * A route, keyed on its full path: the prefixes of the subtrees it is in and its own, joined with '/'.
+ */
+struct route_key {
+    char* path;  // malloc'd, not terminated
+    int len;
+    int order;   // in which it was declared, to keep routes on the same path in it
+    struct router_route route;
+    const char* params[ROUTER_MAX_PARAMS];  // names of its parameters, pointing into the tree
+    int param_lens[ROUTER_MAX_PARAMS];
+};
+
+/**
+ * A subtree's prefix, to find siblings that share it.
+ */
+struct sibling_prefix {
+    const char* prefix;
+    int len;
+    int index;
+};
+
+/**
+ * State while compiling a tree.
+ */
+struct compiler {
+    struct route_key* keys;
+    int num_keys;
+    int max_keys;
+    char* path;  // of the subtree being walked, ending in '/' (unless it's the root)
+    int path_len;
+    int path_max;
+    const char* params[ROUTER_MAX_PARAMS];  // names of the parameters of the subtree being walked
+    int param_lens[ROUTER_MAX_PARAMS];
+    int num_params;
+    router_t* router;
+    int labels_len;  // laid out so far
+    int params_len;
+    int names_len;
+};
+
+/**
+ * State while matching a path.
+ */
+struct match_state {
+    const router_t* router;
+    const char* base;
+    int method;
+    struct router_capture* captures;
+    int num_captures;
+    int allowed;
+};
+
+/**
+ * Tell what kind of path component a prefix (of length len) matches, if it could ever match one.
+ */
+static enum prefix_kind classify_prefix(const char* prefix, int len)
+{
+    int i;
+
+    if (len == 0) {
+        return PREFIX_EXACT;
+    }
+    if (len < 0 || !prefix) {
+        return PREFIX_INVALID;
+    }
+    for (i = 0; i < len; i++) {
+        if (prefix[i] == '/' || prefix[i] == '\0' || is_marker(prefix[i])) {
+            return PREFIX_INVALID;
+        }
+    }
+    if (prefix[0] == ':') {
+        return len > 1 ? PREFIX_PARAM : PREFIX_INVALID;
+    }
+    return prefix[0] == '*' ? PREFIX_WILDCARD : PREFIX_EXACT;
+}
+
+/**
+ * Append bytes to the path of the subtree being walked.
+ * Returns 0 on success, -1 on error.
+ */
+static int append_path(struct compiler* c, const char* bytes, int len)
+{
+    char* path;
+
+    if (!len) {
+        return 0;
+    }
+    if (c->path_len + len > c->path_max) {
+        path = realloc(c->path, c->path_len + len + 64);
+        if (!path) {
+            return -1;
+        }
+        c->path = path;
+        c->path_max = c->path_len + len + 64;
+    }
+    memcpy(&c->path[c->path_len], bytes, len);
+    c->path_len += len;
+    return 0;
+}
+
+/**
+ * Add a parameter name (of length len) to those of the subtree being walked.
+ * Returns 0 on success, -1 if there are too many.
+ */
+static int push_param(struct compiler* c, const char* name, int len)
+{
+    if (c->num_params == ROUTER_MAX_PARAMS) {
+        errno = EINVAL;
+        return -1;
+    }
+    c->params[c->num_params] = name;
+    c->param_lens[c->num_params] = len;
+    c->num_params++;
+    return 0;
+}
+
+/**
+ * Add a key for an entry of the subtree being walked.
+ * Returns 0 on success, -1 on error.
+ */
+static int add_key(struct compiler* c, const struct kitserv_api_entry* entry, enum prefix_kind kind)
+{
+    struct route_key* keys;
+    struct route_key* key;
+    int num_params = c->num_params;
+
+    if (kind == PREFIX_PARAM || (kind == PREFIX_WILDCARD && entry->prefix_length > 1)) {
+        if (push_param(c, &entry->prefix[1], entry->prefix_length - 1)) {
+            return -1;
+        }
+    } else if (kind == PREFIX_WILDCARD && push_param(c, wildcard_name, 1)) {
+        return -1;
+    }
+    if (c->num_keys == c->max_keys) {
+        keys = realloc(c->keys, (c->max_keys * 2 + 16) * sizeof(*keys));
+        if (!keys) {
+            return -1;
+        }
+        c->keys = keys;
+        c->max_keys = c->max_keys * 2 + 16;
+    }
+    key = &c->keys[c->num_keys];
+    key->len = c->path_len + (kind == PREFIX_EXACT ? entry->prefix_length : 1);
+    key->path = malloc(key->len + 1);
+    if (!key->path) {
+        return -1;
+    }
+    if (c->path_len) {
+        memcpy(key->path, c->path, c->path_len);
+    }
+    if (kind == PREFIX_PARAM) {
+        key->path[c->path_len] = PARAM_MARKER;
+    } else if (kind == PREFIX_WILDCARD) {
+        key->path[c->path_len] = WILDCARD_MARKER;
+    } else if (entry->prefix_length) {
+        memcpy(&key->path[c->path_len], entry->prefix, entry->prefix_length);
+    }
+    key->order = c->num_keys;
+    key->route = (struct router_route){
+        .handler = entry->handler,
+        .methods = entry->method,
+        .finishes_path = entry->finishes_path,
+        .compress = entry->compress,
+        .num_params = c->num_params,
+    };
+    memcpy(key->params, c->params, c->num_params * sizeof(*c->params));
+    memcpy(key->param_lens, c->param_lens, c->num_params * sizeof(*c->param_lens));
+    c->num_params = num_params;
+    c->num_keys++;
+    return 0;
+}
+
+static int compare_prefixes(const void* a, const void* b)
+{
+    const struct sibling_prefix* x = a;
+    const struct sibling_prefix* y = b;
+    int cmp;
+
+    if (x->len != y->len) {
+        return x->len - y->len;
+    }
+    cmp = x->len ? memcmp(x->prefix, y->prefix, x->len) : 0;
+    return cmp ? cmp : x->index - y->index;
+}
+
+/**
+ * Find the subtrees of a tree that can't be reached, because an earlier sibling matches the same components (only
+ * the first subtree that matches a component is ever descended into, and every ":name" one matches them all).
+ * Returns an array of flags to free, or NULL on error.
+ */
+static bool* find_shadowed_subtrees(const struct kitserv_api_tree* tree)
+{
+    struct sibling_prefix* siblings;
+    const struct kitserv_api_tree* subtree;
+    bool* shadowed;
+    int i;
+
+    shadowed = calloc(tree->num_subtrees + 1, sizeof(*shadowed));
+    siblings = malloc((tree->num_subtrees + 1) * sizeof(*siblings));
+    if (!shadowed || !siblings) {
+        free(shadowed);
+        free(siblings);
+        return NULL;
+    }
+    for (i = 0; i < tree->num_subtrees; i++) {
+        subtree = &tree->subtrees[i];
+        if (classify_prefix(subtree->prefix, subtree->prefix_length) == PREFIX_PARAM) {
+            siblings[i] = (struct sibling_prefix){param_marker, 1, i};
+        } else {
+            siblings[i] = (struct sibling_prefix){subtree->prefix, subtree->prefix_length, i};
+        }
+    }
+    qsort(siblings, tree->num_subtrees, sizeof(*siblings), compare_prefixes);
+    for (i = 1; i < tree->num_subtrees; i++) {
+        if (siblings[i].len == siblings[i - 1].len &&
+            (!siblings[i].len || !memcmp(siblings[i].prefix, siblings[i - 1].prefix, siblings[i].len))) {
+            shadowed[siblings[i].index] = true;
+        }
+    }
+    free(siblings);
+    return shadowed;
+}
+
+/**
+ * Add keys for every entry of a tree and its subtrees, the path to which has been walked already.
+ * Returns 0 on success, -1 on error.
+ */
+static int add_tree(struct compiler* c, const struct kitserv_api_tree* tree)
+{
+    const struct kitserv_api_tree* subtree;
+    enum prefix_kind kind;
+    bool* shadowed;
+    int path_len = c->path_len;
+    int num_params = c->num_params;
+    int i;
+
+    for (i = 0; i < tree->num_entries; i++) {
+        kind = classify_prefix(tree->entries[i].prefix, tree->entries[i].prefix_length);
+        if (kind == PREFIX_INVALID) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (add_key(c, &tree->entries[i], kind)) {
+            return -1;
+        }
+    }
+    if (tree->num_subtrees <= 0) {
+        return 0;
+    }
+    shadowed = find_shadowed_subtrees(tree);
+    if (!shadowed) {
+        return -1;
+    }
+    for (i = 0; i < tree->num_subtrees; i++) {
+        subtree = &tree->subtrees[i];
+        kind = classify_prefix(subtree->prefix, subtree->prefix_length);
+        // a wildcard takes the rest of the path, so it can only end one
+        if (kind == PREFIX_INVALID || kind == PREFIX_WILDCARD) {
+            errno = EINVAL;
+            goto err;
+        }
+        if (shadowed[i]) {
+            continue;
+        }
+        if (kind == PREFIX_PARAM) {
+            if (push_param(c, &subtree->prefix[1], subtree->prefix_length - 1) || append_path(c, param_marker, 1)) {
+                goto err;
+            }
+        } else if (append_path(c, subtree->prefix, subtree->prefix_length)) {
+            goto err;
+        }
+        if (append_path(c, "/", 1) || add_tree(c, subtree)) {
+            goto err;
+        }
+        c->path_len = path_len;
+        c->num_params = num_params;
+    }
+    free(shadowed);
+    return 0;
+
+err:
+    free(shadowed);
+    return -1;
+}
+
+/**
+ * Order keys by path, with paths before those they are a prefix of, then by declaration.
+ */
+static int compare_keys(const void* a, const void* b)
+{
+    const struct route_key* x = a;
+    const struct route_key* y = b;
+    int cmp;
+
+    cmp = memcmp(x->path, y->path, x->len < y->len ? x->len : y->len);
+    if (cmp) {
+        return cmp;
+    }
+    return x->len != y->len ? x->len - y->len : x->order - y->order;
+}
+
+/**
+ * Copy a route into the router, along with its parameter names.
+ */
+static void add_route(struct compiler* c, const struct route_key* key)
+{
+    router_t* router = c->router;
+    struct router_route* route = &router->routes[router->num_routes++];
+    int i;
+
+    *route = key->route;
+    route->params = &router->params[c->params_len];
+    for (i = 0; i < key->route.num_params; i++) {
+        router->params[c->params_len++] = &router->names[c->names_len];
+        memcpy(&router->names[c->names_len], key->params[i], key->param_lens[i]);
+        router->names[c->names_len + key->param_lens[i]] = '\0';
+        c->names_len += key->param_lens[i] + 1;
+    }
+}
+
+/**
+ * Fill in a node from the sorted keys in [lo, hi), which all share their first depth bytes, and its children from
+ * the keys that continue past its label. A parameter or wildcard node (marker) stands for the marker at depth alone.
+ */
+static void build_node(struct compiler* c, int index, int lo, int hi, int depth, bool marker)
+{
+    router_t* router = c->router;
+    struct route_key* keys = c->keys;
+    struct router_node* node = &router->nodes[index];
+    int end, i, group, child;
+    char next;
+
+    // being sorted, all keys share whatever the first and last do (but markers get nodes of their own)
+    end = depth + marker;
+    while (!marker && end < keys[lo].len && end < keys[hi - 1].len) {
+        if (keys[lo].path[end] != keys[hi - 1].path[end] || is_marker(keys[lo].path[end])) {
+            break;
+        }
+        end++;
+    }
+    *node = (struct router_node){
+        .label_off = c->labels_len,
+        .label_len = marker ? 0 : end - depth,
+        .first_route = router->num_routes,
+    };
+    memcpy(&router->labels[c->labels_len], &keys[lo].path[depth], node->label_len);
+    c->labels_len += node->label_len;
+    router->first_bytes[index] = node->label_len ? keys[lo].path[depth] : 0;
+
+    // keys that end here sort first
+    for (i = lo; i < hi && keys[i].len == end; i++) {
+        add_route(c, &keys[i]);
+        node->num_routes++;
+        node->methods |= keys[i].route.methods;
+        if (!keys[i].route.finishes_path) {
+            node->open_methods |= keys[i].route.methods;
+        }
+    }
+
+    // the rest go to a child for each byte that comes next: exact ones are laid out together (before any of their own
+    // children), while markers sort before them and go to a parameter or wildcard child
+    for (group = i; group < hi; group++) {
+        if ((group == i || keys[group].path[end] != keys[group - 1].path[end]) && !is_marker(keys[group].path[end])) {
+            node->num_children++;
+        }
+    }
+    node->first_child = router->num_nodes;
+    router->num_nodes += node->num_children;
+    for (child = node->first_child; i < hi; i = group) {
+        next = keys[i].path[end];
+        for (group = i + 1; group < hi && keys[group].path[end] == next; group++) {
+        }
+        if (next == PARAM_MARKER) {
+            node->param_child = router->num_nodes++;
+            build_node(c, node->param_child, i, group, end, true);
+        } else if (next == WILDCARD_MARKER) {
+            node->wildcard_child = router->num_nodes++;
+            build_node(c, node->wildcard_child, i, group, end, true);
+        } else {
+            build_node(c, child++, i, group, end, false);
+        }
+    }
+}
+
+int kitserv_router_compile(router_t* router, const struct kitserv_api_tree* tree)
+{
+    struct compiler c = {.router = router};
+    size_t labels_max = 0;
+    size_t names_max = 0;
+    int params_max = 0;
+    int i, j, ret = -1;
+
+    *router = (router_t){0};
+    if (add_tree(&c, tree)) {
+        goto out;
+    }
+    if (c.num_keys == 0) {
+        ret = 0;
+        goto out;
+    }
+    qsort(c.keys, c.num_keys, sizeof(*c.keys), compare_keys);
+
+    // a compressed trie has fewer than twice as many nodes as keys (plus one per parameter that leads to no branch),
+    // and no more label bytes than they do
+    for (i = 0; i < c.num_keys; i++) {
+        labels_max += c.keys[i].len;
+        params_max += c.keys[i].route.num_params;
+        for (j = 0; j < c.keys[i].route.num_params; j++) {
+            names_max += c.keys[i].param_lens[j] + 1;
+        }
+    }
+    router->nodes = malloc((2 * (size_t)c.num_keys + params_max) * sizeof(*router->nodes));
+    router->first_bytes = malloc(2 * (size_t)c.num_keys + params_max);
+    router->labels = malloc(labels_max + 1);
+    router->routes = malloc(c.num_keys * sizeof(*router->routes));
+    router->params = malloc((params_max + 1) * sizeof(*router->params));
+    router->names = malloc(names_max + 1);
+    if (!router->nodes || !router->first_bytes || !router->labels || !router->routes || !router->params ||
+        !router->names) {
+        free(router->nodes);
+        free(router->first_bytes);
+        free(router->labels);
+        free(router->routes);
+        free(router->params);
+        free(router->names);
+        *router = (router_t){0};
+        goto out;
+    }
+    router->num_nodes = 1;
+    build_node(&c, 0, 0, c.num_keys, 0, false);
+    ret = 0;
+
+out:
+    for (i = 0; i < c.num_keys; i++) {
+        free(c.keys[i].path);
+    }
+    free(c.keys);
+    free(c.path);
+    return ret;
+}
+
+/**
+ * Pick the child of node whose label starts with byte c.
+ * Returns the child, or NULL if there is none.
+ */
+static const struct router_node* find_child(const router_t* router, const struct router_node* node, unsigned char c)
+{
+    int lo = node->first_child;
+    int hi = node->first_child + node->num_children;
+    int mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (router->first_bytes[mid] < c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == node->first_child + node->num_children || router->first_bytes[lo] != c) {
+        return NULL;
+    }
+    return &router->nodes[lo];
+}
+
+/**
+ * Follow len bytes of path down from *node, the first *off bytes of whose label were matched already.
+ * Returns true if they all matched, leaving *node and *off where they did.
+ */
+static bool walk(const router_t* router, const struct router_node** node, int* off, const char* path, int len)
+{
+    const struct router_node* at = *node;
+    int matched = *off;
+    int n;
+
+    while (len > 0) {
+        if (matched == at->label_len) {
+            at = find_child(router, at, *path);
+            if (!at) {
+                return false;
+            }
+            matched = 0;
+        }
+        n = at->label_len - matched < len ? at->label_len - matched : len;
+        if (memcmp(&router->labels[at->label_off + matched], path, n)) {
+            return false;
+        }
+        matched += n;
+        path += n;
+        len -= n;
+    }
+    *node = at;
+    *off = matched;
+    return true;
+}
+
+/**
+ * Pick the first route ending at node that takes the method, or add the methods of those that match the path to
+ * state->allowed. finished tells if nothing but slashes follows the component that reached node.
+ */
+static const struct router_route* pick_route(struct match_state* state, const struct router_node* node, bool finished)
+{
+    const struct router_route* route;
+    int mask = finished ? node->methods : node->open_methods;
+
+    if (mask & state->method) {
+        for (route = &state->router->routes[node->first_route];; route++) {
+            if ((route->methods & state->method) && (finished || !route->finishes_path)) {
+                return route;
+            }
+        }
+    }
+    state->allowed |= mask;
+    return NULL;
+}
+
+static inline void capture(struct match_state* state, const char* from, int len)
+{
+    state->captures[state->num_captures].off = from - state->base;
+    state->captures[state->num_captures].len = len;
+    state->num_captures++;
+}
+
+/**
+ * Match path, which starts at a component, from node (off bytes into its label).
+ * Returns the route, or NULL if there is none this way (and if state->allowed is set, no other way should be tried).
+ */
+static const struct router_route* match_level(struct match_state* state, const struct router_node* node, int off,
+                                              const char* path)
+{
+    const router_t* router = state->router;
+    const struct router_node* exact = node;
+    const struct router_node* param = NULL;
+    const struct router_node* wildcard = NULL;
+    const struct router_route* route = NULL;
+    const char* end;
+    const char* rest;
+    int exact_off = off;
+    int param_off = 0;
+    int num_captures;
+    bool exact_matched, finished;
+
+    for (end = path; *end && *end != '/'; end++) {
+    }
+    for (rest = end; *rest == '/'; rest++) {
+    }
+    finished = !*rest;
+    // parameters and wildcards branch off where a node ends, never inside of a label
+    if (off == node->label_len) {
+        param = node->param_child && end > path ? &router->nodes[node->param_child] : NULL;
+        wildcard = node->wildcard_child ? &router->nodes[node->wildcard_child] : NULL;
+    }
+    exact_matched = walk(router, &exact, &exact_off, path, end - path);
+
+    // entries of each kind in turn, then subtrees
+    if (exact_matched && exact_off == exact->label_len) {
+        route = pick_route(state, exact, finished);
+    }
+    if (!route && param && (route = pick_route(state, param, finished))) {
+        capture(state, path, end - path);
+    }
+    if (route || state->allowed) {
+        return route;
+    }
+    if (*end && exact_matched && walk(router, &exact, &exact_off, end, 1)) {
+        route = match_level(state, exact, exact_off, end + 1);
+        if (route || state->allowed) {
+            return route;
+        }
+    }
+    if (*end && param && walk(router, &param, &param_off, end, 1)) {
+        num_captures = state->num_captures;
+        capture(state, path, end - path);
+        route = match_level(state, param, param_off, end + 1);
+        if (route || state->allowed) {
+            return route;
+        }
+        state->num_captures = num_captures;
+    }
+
+    // a wildcard is the last resort
+    if (wildcard && (route = pick_route(state, wildcard, true))) {
+        capture(state, path, strlen(path));
+    }
+    return route;
+}
+
+const struct router_route* kitserv_router_match(const router_t* router, const char* base, const char* path,
+                                                int method, struct router_capture* captures, int* allowed)
+{
+    struct match_state state = {
+        .router = router,
+        .base = base,
+        .method = method,
+        .captures = captures,
+    };
+    const struct router_route* route = NULL;
+
+    if (router->nodes) {
+        route = match_level(&state, router->nodes, 0, path);
+    }
+    *allowed = route ? 0 : state.allowed;
+    return route;
+}
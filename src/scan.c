@@ -0,0 +1,79 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#include "scan.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Each kernel runs the widest vectors it has over whole blocks, then narrower ones, then finishes byte by byte.
+ * Only whole blocks are loaded, so the scans never touch memory past end (which may be the end of a buffer).
+ */
+
+char* kitserv_scan_char(char* p, char* end, char c)
+{
+#if defined(__AVX2__)
+    const __m256i needle32 = _mm256_set1_epi8(c);
+    unsigned int mask32;
+
+    for (; end - p >= 32; p += 32) {
+        mask32 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), needle32));
+        if (mask32) {
+            return p + __builtin_ctz(mask32);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i needle16 = _mm_set1_epi8(c);
+    unsigned int mask16;
+
+    for (; end - p >= 16; p += 16) {
+        mask16 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), needle16));
+        if (mask16) {
+            return p + __builtin_ctz(mask16);
+        }
+    }
+#endif
+    for (; p < end && *p != c; p++)
+        ;
+    return p;
+}
+
+char* kitserv_scan_nonprint(char* p, char* end)
+{
+    // bytes are compared as signed, so everything from 0x80 up also counts as below ' '
+#if defined(__AVX2__)
+    const __m256i space32 = _mm256_set1_epi8(' ');
+    const __m256i del32 = _mm256_set1_epi8(0x7f);
+    __m256i v32;
+    unsigned int mask32;
+
+    for (; end - p >= 32; p += 32) {
+        v32 = _mm256_loadu_si256((const __m256i*)p);
+        mask32 = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(space32, v32), _mm256_cmpeq_epi8(v32, del32)));
+        if (mask32) {
+            return p + __builtin_ctz(mask32);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i space16 = _mm_set1_epi8(' ');
+    const __m128i del16 = _mm_set1_epi8(0x7f);
+    __m128i v16;
+    unsigned int mask16;
+
+    for (; end - p >= 16; p += 16) {
+        v16 = _mm_loadu_si128((const __m128i*)p);
+        mask16 = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v16, space16), _mm_cmpeq_epi8(v16, del16)));
+        if (mask16) {
+            return p + __builtin_ctz(mask16);
+        }
+    }
+#endif
+    for (; p < end && (signed char)*p >= ' ' && *p != 0x7f; p++)
+        ;
+    return p;
+}
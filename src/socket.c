@@ -40,7 +40,7 @@ static int socket_setnonblock(int socket)
  * Bind to a port of the given family.
  * Returns socket fd, or -1 on error.
  */
-static int find_and_bind_socket(const char* port_string, int family, bool nonblock)
+static int find_and_bind_socket(const char* port_string, int family, bool nonblock, bool reuse_port)
 {
     int rc, s, opt;
     char addr_name[1024];
@@ -85,6 +85,16 @@ static int find_and_bind_socket(const char* port_string, int family, bool nonblo
             return -1;
         }
 
+        if (reuse_port) {
+            rc = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+            if (rc < 0) {
+                perror("setsockopt (SO_REUSEPORT)");
+                close(s);
+                freeaddrinfo(info);
+                return -1;
+            }
+        }
+
         if (nonblock) {
             rc = socket_setnonblock(s);
             if (rc < 0) {
@@ -119,9 +129,9 @@ static int find_and_bind_socket(const char* port_string, int family, bool nonblo
     return -1;
 }
 
-int kitserv_socket_prepare(const char* port_string, bool use_ipv6, bool nonblocking_accepts)
+int kitserv_socket_prepare(const char* port_string, bool use_ipv6, bool nonblocking_accepts, bool reuse_port)
 {
-    return find_and_bind_socket(port_string, use_ipv6 ? AF_INET6 : AF_INET, nonblocking_accepts);
+    return find_and_bind_socket(port_string, use_ipv6 ? AF_INET6 : AF_INET, nonblocking_accepts, reuse_port);
 }
 
 int kitserv_socket_accept(int sockfd)
@@ -0,0 +1,167 @@
+/* Part of Kitserv, licensed under the GNU Affero GPL. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "timer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_MAX_TICKS (((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+uint64_t kitserv_timer_now()
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    // we only need tick precision, and the coarse clock is much cheaper to read
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void kitserv_timer_wheel_init(timer_wheel_t* wheel, uint64_t now_ms)
+{
+    int level, slot;
+
+    wheel->now = now_ms / TIMER_TICK_MS;
+    wheel->clock = wheel->now;
+    wheel->count = 0;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+        }
+    }
+}
+
+void kitserv_timer_init(struct timer* timer)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+}
+
+static inline void timer_unlink(struct timer* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/**
+ * Place a timer in the slot matching its expiry, relative to the current tick.
+ */
+static inline void timer_link(timer_wheel_t* wheel, struct timer* timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+    struct timer* head;
+    int level;
+
+    // find the first level whose range covers the remaining time
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    head = &wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void kitserv_timer_schedule(timer_wheel_t* wheel, struct timer* timer, int timeout_ms)
+{
+    uint64_t ticks = (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    if (kitserv_timer_pending(timer)) {
+        timer_unlink(timer);
+    } else {
+        wheel->count++;
+    }
+
+    if (ticks == 0) {
+        ticks = 1;
+    } else if (ticks > TIMER_MAX_TICKS) {
+        ticks = TIMER_MAX_TICKS;
+    }
+    timer->expires = wheel->clock + ticks;
+    timer_link(wheel, timer);
+}
+
+void kitserv_timer_cancel(timer_wheel_t* wheel, struct timer* timer)
+{
+    if (kitserv_timer_pending(timer)) {
+        timer_unlink(timer);
+        wheel->count--;
+    }
+}
+
+/**
+ * Re-place every timer in a higher-level slot now that the wheel has reached it.
+ */
+static void timer_cascade(timer_wheel_t* wheel, int level, int slot)
+{
+    struct timer* head = &wheel->slots[level][slot];
+    struct timer* timer;
+
+    while (head->next != head) {
+        timer = head->next;
+        timer_unlink(timer);
+        timer_link(wheel, timer);
+    }
+}
+
+void kitserv_timer_update(timer_wheel_t* wheel, uint64_t now_ms)
+{
+    uint64_t tick = now_ms / TIMER_TICK_MS;
+
+    if (tick > wheel->clock) {
+        wheel->clock = tick;
+    }
+    if (wheel->count == 0) {
+        // nothing to fire, so there is no need to walk the ticks later
+        wheel->now = wheel->clock;
+    }
+}
+
+void kitserv_timer_advance(timer_wheel_t* wheel, timer_expire_t expire, void* data)
+{
+    struct timer* head;
+    struct timer* timer;
+    int level;
+
+    while (wheel->now < wheel->clock && wheel->count > 0) {
+        wheel->now++;
+
+        // at the start of each higher-level slot's period, spread its timers into the levels below
+        for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (wheel->now & (((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1)) {
+                break;
+            }
+            timer_cascade(wheel, level, (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+        }
+
+        head = &wheel->slots[0][wheel->now & TIMER_WHEEL_MASK];
+        while (head->next != head) {
+            timer = head->next;
+            timer_unlink(timer);
+            wheel->count--;
+            expire(timer, data);
+        }
+    }
+    if (wheel->count == 0) {
+        wheel->now = wheel->clock;
+    }
+}
+
+int kitserv_timer_wait_timeout(const timer_wheel_t* wheel)
+{
+    return wheel->count ? TIMER_TICK_MS : -1;
+}